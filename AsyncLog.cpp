@@ -0,0 +1,351 @@
+//
+//  AsyncLog.cpp
+//
+//  SmartFocus X2 plugin
+//
+//  The ring buffer is the bounded MPMC queue from Dmitry Vyukov, used here with
+//  a single consumer : each slot carries a sequence number telling producers
+//  whether it's free and the writer whether it's been published.
+//
+
+#include "AsyncLog.h"
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <chrono>
+
+CAsyncLog &CAsyncLog::instance()
+{
+    static CAsyncLog Log;
+    return Log;
+}
+
+CAsyncLog::CAsyncLog()
+{
+    for(size_t i = 0; i < LOG_QUEUE_SIZE; i++)
+        m_Ring[i].nSeq.store(i, std::memory_order_relaxed);
+    m_nEnqueuePos = 0;
+    m_nDequeuePos = 0;
+    m_llDropped = 0;
+    m_bRunning = false;
+    m_nUsers = 0;
+    m_pLogFile = NULL;
+
+#if defined(SB_WIN_BUILD)
+    m_sLogfilePath = getenv("HOMEDRIVE") ? getenv("HOMEDRIVE") : "";
+    m_sLogfilePath += getenv("HOMEPATH") ? getenv("HOMEPATH") : ".";
+    m_sLogfilePath += "\\SmartFocusLog.txt";
+#else
+    m_sLogfilePath = getenv("HOME") ? getenv("HOME") : ".";
+    m_sLogfilePath += "/SmartFocusLog.txt";
+#endif
+}
+
+// still in use at exit or when the library is unloaded, a joinable writer would terminate the process.
+CAsyncLog::~CAsyncLog()
+{
+    std::lock_guard<std::mutex> lifeLock(m_LifeLock);
+
+    {
+        std::lock_guard<std::mutex> lock(m_Lock);
+        m_bRunning = false;
+        m_WakeCond.notify_all();
+    }
+    if(m_WriterThread.joinable())
+        m_WriterThread.join();
+    if(m_pLogFile)
+        fclose(m_pLogFile);
+}
+
+void CAsyncLog::acquire()
+{
+    std::lock_guard<std::mutex> lifeLock(m_LifeLock);
+    std::lock_guard<std::mutex> lock(m_Lock);
+    char szTime[32];
+    time_t tNow;
+    struct tm tmLocal;
+
+    if(m_nUsers++)
+        return;
+
+    // appended, turning logging off and on again (or a second instance going away) keeps what was there.
+    m_pLogFile = fopen(m_sLogfilePath.c_str(), "a");
+    m_llWallStartUs = std::chrono::duration_cast<std::chrono::microseconds>(std::chrono::system_clock::now().time_since_epoch()).count();
+    m_llMonoStartNs = CStopWatch::NowNs();
+    if(m_pLogFile) {
+        tNow = (time_t)(m_llWallStartUs / 1000000);
+#if defined(SB_WIN_BUILD)
+        localtime_s(&tmLocal, &tNow);
+#else
+        localtime_r(&tNow, &tmLocal);
+#endif
+        strftime(szTime, sizeof(szTime), "%Y-%m-%d %H:%M:%S", &tmLocal);
+        fprintf(m_pLogFile, "\n==== [%s] SmartFocus log session started ====\n", szTime);
+        fflush(m_pLogFile);
+    }
+    m_bRunning = true;
+    m_WriterThread = std::thread(&CAsyncLog::writerThread, this);
+}
+
+// m_LifeLock is held across the join, an acquire() in between would start a second writer on the same thread
+// object and have its file closed under it.
+void CAsyncLog::release()
+{
+    std::lock_guard<std::mutex> lifeLock(m_LifeLock);
+
+    {
+        std::lock_guard<std::mutex> lock(m_Lock);
+        if(!m_nUsers || --m_nUsers)
+            return;
+        m_bRunning = false;
+        m_WakeCond.notify_all();
+    }
+    if(m_WriterThread.joinable())
+        m_WriterThread.join();
+
+    std::lock_guard<std::mutex> lock(m_Lock);
+    if(m_pLogFile) {
+        fclose(m_pLogFile);
+        m_pLogFile = NULL;
+    }
+}
+
+// reserves a slot, returns NULL (and counts a drop) if the writer is too far behind.
+LogRecord *CAsyncLog::claim(size_t &nPos)
+{
+    LogRecord *pRecord;
+    size_t nSeq;
+    ptrdiff_t nDiff;
+
+    nPos = m_nEnqueuePos.load(std::memory_order_relaxed);
+    while(true) {
+        pRecord = &m_Ring[nPos & (LOG_QUEUE_SIZE - 1)];
+        nSeq = pRecord->nSeq.load(std::memory_order_acquire);
+        nDiff = (ptrdiff_t)nSeq - (ptrdiff_t)nPos;
+        if(nDiff == 0) {
+            if(m_nEnqueuePos.compare_exchange_weak(nPos, nPos + 1, std::memory_order_relaxed))
+                return pRecord;
+        }
+        else if(nDiff < 0) {
+            m_llDropped++;
+            return NULL;
+        }
+        else {
+            nPos = m_nEnqueuePos.load(std::memory_order_relaxed);
+        }
+    }
+}
+
+void CAsyncLog::writerThread()
+{
+    std::unique_lock<std::mutex> lock(m_Lock);
+
+    while(m_bRunning) {
+        m_WakeCond.wait_for(lock, std::chrono::milliseconds(LOG_DRAIN_INTERVAL));
+        lock.unlock();
+        if(drain() && m_pLogFile)
+            fflush(m_pLogFile);
+        lock.lock();
+    }
+    lock.unlock();
+    // whatever was logged before the last release still goes out.
+    drain();
+    if(m_pLogFile)
+        fflush(m_pLogFile);
+}
+
+int CAsyncLog::drain()
+{
+    char szLine[LOG_LINE_SIZE];
+    LogRecord *pRecord;
+    int nCount = 0;
+
+    while(true) {
+        pRecord = &m_Ring[m_nDequeuePos & (LOG_QUEUE_SIZE - 1)];
+        if(pRecord->nSeq.load(std::memory_order_acquire) != m_nDequeuePos + 1)
+            break;
+        format(*pRecord, szLine, LOG_LINE_SIZE);
+        pRecord->nSeq.store(m_nDequeuePos + LOG_QUEUE_SIZE, std::memory_order_release);
+        m_nDequeuePos++;
+        if(m_pLogFile)
+            fputs(szLine, m_pLogFile);
+        nCount++;
+    }
+    return nCount;
+}
+
+// "[YYYY-MM-DD HH:MM:SS.uuuuuu] " + the printf style message, formatted one conversion at a time.
+void CAsyncLog::format(const LogRecord &Record, char *pszLine, int nMaxLen)
+{
+    char szSpec[32];
+    const char *pszFmt = Record.pszFmt;
+    const LogArg *pArg;
+    long long llWallUs;
+    time_t tSeconds;
+    struct tm tmLocal;
+    int nLen = 0;
+    int nSpecLen;
+    int nArg = 0;
+    int i;
+    char cConv;
+
+    llWallUs = m_llWallStartUs + (Record.llTimeNs - m_llMonoStartNs) / 1000;
+    tSeconds = (time_t)(llWallUs / 1000000);
+#if defined(SB_WIN_BUILD)
+    localtime_s(&tmLocal, &tSeconds);
+#else
+    localtime_r(&tSeconds, &tmLocal);
+#endif
+    nLen = (int)strftime(pszLine, nMaxLen, "[%Y-%m-%d %H:%M:%S", &tmLocal);
+    nLen += snprintf(pszLine + nLen, nMaxLen - nLen, ".%06d] ", (int)(llWallUs % 1000000));
+
+    while(*pszFmt && nLen < nMaxLen - 2) {
+        if(*pszFmt != '%') {
+            pszLine[nLen++] = *pszFmt++;
+            continue;
+        }
+        if(pszFmt[1] == '%') {
+            pszLine[nLen++] = '%';
+            pszFmt += 2;
+            continue;
+        }
+        // flags, width and precision are kept, length modifiers are replaced by the stored type.
+        nSpecLen = 0;
+        szSpec[nSpecLen++] = *pszFmt++;
+        while(*pszFmt && strchr("-+ #0123456789.*", *pszFmt) && nSpecLen < 24)
+            szSpec[nSpecLen++] = *pszFmt++;
+        while(*pszFmt && strchr("hlLqjzt", *pszFmt))
+            pszFmt++;
+        cConv = *pszFmt ? *pszFmt++ : 's';
+
+        if(nArg >= Record.nArgs) {
+            nLen += snprintf(pszLine + nLen, nMaxLen - nLen, "<?>");
+            if(nLen > nMaxLen - 2)
+                nLen = nMaxLen - 2;
+            continue;
+        }
+        pArg = &Record.Args[nArg++];
+        switch(pArg->nType) {
+            case LOG_ARG_INT:
+            case LOG_ARG_UINT:
+                if(strchr("fFeEgG", cConv)) {
+                    szSpec[nSpecLen++] = cConv;
+                    szSpec[nSpecLen] = 0;
+                    nLen += snprintf(pszLine + nLen, nMaxLen - nLen, szSpec, pArg->nType == LOG_ARG_INT ? (double)pArg->v.llVal : (double)pArg->v.ullVal);
+                }
+                else if(cConv == 'c') {
+                    szSpec[nSpecLen++] = 'c';
+                    szSpec[nSpecLen] = 0;
+                    nLen += snprintf(pszLine + nLen, nMaxLen - nLen, szSpec, (int)pArg->v.llVal);
+                }
+                else {
+                    if(!strchr("diouxX", cConv))
+                        cConv = (pArg->nType == LOG_ARG_INT) ? 'd' : 'u';
+                    szSpec[nSpecLen++] = 'l';
+                    szSpec[nSpecLen++] = 'l';
+                    szSpec[nSpecLen++] = cConv;
+                    szSpec[nSpecLen] = 0;
+                    if(pArg->nType == LOG_ARG_INT)
+                        nLen += snprintf(pszLine + nLen, nMaxLen - nLen, szSpec, pArg->v.llVal);
+                    else
+                        nLen += snprintf(pszLine + nLen, nMaxLen - nLen, szSpec, pArg->v.ullVal);
+                }
+                break;
+
+            case LOG_ARG_DOUBLE:
+                if(!strchr("fFeEgG", cConv))
+                    cConv = 'f';
+                szSpec[nSpecLen++] = cConv;
+                szSpec[nSpecLen] = 0;
+                nLen += snprintf(pszLine + nLen, nMaxLen - nLen, szSpec, pArg->v.dVal);
+                break;
+
+            case LOG_ARG_STRING:
+                nLen += snprintf(pszLine + nLen, nMaxLen - nLen, "%.*s", (int)pArg->v.Str.nLen, Record.szInline + pArg->v.Str.nOffset);
+                break;
+
+            case LOG_ARG_HEX:
+                for(i = 0; i < pArg->v.Str.nLen && nLen < nMaxLen - 4; i++)
+                    nLen += snprintf(pszLine + nLen, nMaxLen - nLen, "%02X ", (unsigned char)Record.szInline[pArg->v.Str.nOffset + i]);
+                break;
+        }
+        if(nLen > nMaxLen - 2)
+            nLen = nMaxLen - 2;
+    }
+    pszLine[nLen++] = '\n';
+    pszLine[nLen] = 0;
+}
+
+LogArg *CAsyncLog::nextArg(LogRecord *pRecord)
+{
+    if(pRecord->nArgs >= LOG_MAX_ARGS)
+        return NULL;
+    return &pRecord->Args[pRecord->nArgs++];
+}
+
+void CAsyncLog::packArg(LogRecord *pRecord, long long llVal)
+{
+    LogArg *pArg = nextArg(pRecord);
+
+    if(!pArg)
+        return;
+    pArg->nType = LOG_ARG_INT;
+    pArg->v.llVal = llVal;
+}
+
+void CAsyncLog::packArg(LogRecord *pRecord, unsigned long long ullVal)
+{
+    LogArg *pArg = nextArg(pRecord);
+
+    if(!pArg)
+        return;
+    pArg->nType = LOG_ARG_UINT;
+    pArg->v.ullVal = ullVal;
+}
+
+void CAsyncLog::packArg(LogRecord *pRecord, double dVal)
+{
+    LogArg *pArg = nextArg(pRecord);
+
+    if(!pArg)
+        return;
+    pArg->nType = LOG_ARG_DOUBLE;
+    pArg->v.dVal = dVal;
+}
+
+// strings are truncated to whatever is left of the inline area.
+void CAsyncLog::packArg(LogRecord *pRecord, const char *pszVal)
+{
+    LogArg *pArg = nextArg(pRecord);
+    int nLen;
+
+    if(!pArg)
+        return;
+    if(!pszVal)
+        pszVal = "(null)";
+    nLen = (int)strnlen(pszVal, LOG_INLINE_SIZE - pRecord->nInlineLen);
+    memcpy(pRecord->szInline + pRecord->nInlineLen, pszVal, nLen);
+    pArg->nType = LOG_ARG_STRING;
+    pArg->v.Str.nOffset = (unsigned short)pRecord->nInlineLen;
+    pArg->v.Str.nLen = (unsigned short)nLen;
+    pRecord->nInlineLen += nLen;
+}
+
+void CAsyncLog::packArg(LogRecord *pRecord, const LogHex &Hex)
+{
+    LogArg *pArg = nextArg(pRecord);
+    int nLen;
+
+    if(!pArg)
+        return;
+    nLen = Hex.nLen;
+    if(nLen > LOG_INLINE_SIZE - pRecord->nInlineLen)
+        nLen = LOG_INLINE_SIZE - pRecord->nInlineLen;
+    if(nLen < 0)
+        nLen = 0;
+    memcpy(pRecord->szInline + pRecord->nInlineLen, Hex.pData, nLen);
+    pArg->nType = LOG_ARG_HEX;
+    pArg->v.Str.nOffset = (unsigned short)pRecord->nInlineLen;
+    pArg->v.Str.nLen = (unsigned short)nLen;
+    pRecord->nInlineLen += nLen;
+}
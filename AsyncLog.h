@@ -0,0 +1,134 @@
+//
+//  AsyncLog.h
+//
+//  SmartFocus X2 plugin
+//  Low overhead debug log. Callers copy a fixed size record (time stamp, format
+//  string pointer and raw arguments) into a lock-free ring buffer, a background
+//  thread does the formatting and the file I/O. Nothing on the serial I/O path
+//  ever calls the C library time or stdio functions.
+//
+//  Format strings must be literals (only the pointer is stored), string
+//  arguments are copied into the record. Wrap raw bytes in LogHex to get them
+//  printed as a hex dump by a %s conversion.
+//
+
+#ifndef __ASYNC_LOG__
+#define __ASYNC_LOG__
+
+#include <stdio.h>
+#include <stddef.h>
+#include <string>
+#include <atomic>
+#include <mutex>
+#include <thread>
+#include <condition_variable>
+
+#include "StopWatch.h"
+
+#define LOG_MAX_ARGS        8
+#define LOG_INLINE_SIZE     96      // room for copied string / hex arguments
+#define LOG_QUEUE_SIZE      1024    // records, must be a power of 2
+#define LOG_DRAIN_INTERVAL  20      // ms between background flushes
+#define LOG_LINE_SIZE       1024
+
+enum LogArgType {LOG_ARG_INT = 0, LOG_ARG_UINT, LOG_ARG_DOUBLE, LOG_ARG_STRING, LOG_ARG_HEX};
+
+struct LogHex {
+    LogHex(const unsigned char *pData, int nLen) : pData(pData), nLen(nLen) {};
+    const unsigned char *pData;
+    int                 nLen;
+};
+
+typedef struct {
+    int     nType;  // LogArgType
+    union {
+        long long           llVal;
+        unsigned long long  ullVal;
+        double              dVal;
+        struct {
+            unsigned short  nOffset;    // into szInline
+            unsigned short  nLen;
+        } Str;
+    } v;
+} LogArg;
+
+typedef struct {
+    std::atomic<size_t> nSeq;   // ring buffer slot sequence, see CAsyncLog::claim
+    long long   llTimeNs;
+    const char  *pszFmt;
+    int         nArgs;
+    int         nInlineLen;
+    LogArg      Args[LOG_MAX_ARGS];
+    char        szInline[LOG_INLINE_SIZE];
+} LogRecord;
+
+class CAsyncLog
+{
+public:
+    static CAsyncLog    &instance();
+
+    // the background thread and the log file only exist while someone has logging enabled.
+    void        acquire();
+    void        release();
+
+    template<typename... Args>
+    void        log(const char *pszFmt, const Args&... args)
+    {
+        size_t nPos;
+        LogRecord *pRecord = claim(nPos);
+
+        if(!pRecord)
+            return;
+        pRecord->llTimeNs = CStopWatch::NowNs();
+        pRecord->pszFmt = pszFmt;
+        pRecord->nArgs = 0;
+        pRecord->nInlineLen = 0;
+        pack(pRecord, args...);
+        pRecord->nSeq.store(nPos + 1, std::memory_order_release);
+    };
+
+    long long   getDropped() { return m_llDropped; };
+
+protected:
+    CAsyncLog();
+    ~CAsyncLog();
+
+    LogRecord   *claim(size_t &nPos);
+    void        writerThread();
+    int         drain();
+    void        format(const LogRecord &Record, char *pszLine, int nMaxLen);
+
+    void        pack(LogRecord *) {};
+    template<typename T, typename... Rest>
+    void        pack(LogRecord *pRecord, const T &First, const Rest&... rest) { packArg(pRecord, First); pack(pRecord, rest...); };
+
+    void        packArg(LogRecord *pRecord, long long llVal);
+    void        packArg(LogRecord *pRecord, unsigned long long ullVal);
+    void        packArg(LogRecord *pRecord, int nVal)              { packArg(pRecord, (long long)nVal); };
+    void        packArg(LogRecord *pRecord, long lVal)             { packArg(pRecord, (long long)lVal); };
+    void        packArg(LogRecord *pRecord, unsigned int nVal)     { packArg(pRecord, (unsigned long long)nVal); };
+    void        packArg(LogRecord *pRecord, unsigned long ulVal)   { packArg(pRecord, (unsigned long long)ulVal); };
+    void        packArg(LogRecord *pRecord, double dVal);
+    void        packArg(LogRecord *pRecord, const char *pszVal);
+    void        packArg(LogRecord *pRecord, const std::string &sVal) { packArg(pRecord, sVal.c_str()); };
+    void        packArg(LogRecord *pRecord, const LogHex &Hex);
+    LogArg      *nextArg(LogRecord *pRecord);
+
+    LogRecord               m_Ring[LOG_QUEUE_SIZE];
+    std::atomic<size_t>     m_nEnqueuePos;
+    size_t                  m_nDequeuePos;  // only touched by the writer thread
+    std::atomic<long long>  m_llDropped;
+
+    std::mutex              m_LifeLock;     // writer start / stop, held across the join, taken before m_Lock
+    std::mutex              m_Lock;         // acquire / release and the writer wake up, never taken by log()
+    std::condition_variable m_WakeCond;
+    std::thread             m_WriterThread;
+    bool                    m_bRunning;
+    int                     m_nUsers;
+    FILE                    *m_pLogFile;
+    std::string             m_sLogfilePath;
+    long long               m_llWallStartUs;    // wall clock at start, to print real times
+    long long               m_llMonoStartNs;
+};
+
+#endif //__ASYNC_LOG__
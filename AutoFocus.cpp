@@ -0,0 +1,242 @@
+//
+//  AutoFocus.cpp
+//
+//  SmartFocus X2 plugin
+//
+
+#include "AutoFocus.h"
+#include "SmartFocus.h"
+#include <math.h>
+
+CAutoFocus::CAutoFocus(CSmartFocus &Focuser)
+    : m_Focuser(Focuser)
+{
+    m_nState = AF_IDLE;
+    m_nModel = AF_HYPERBOLA;
+    m_nCenter = 0;
+    m_nStepSize = 0;
+    m_nGridSize = 0;
+    m_nFirstPos = 0;
+    m_nSamplePos = 0;
+    m_nGridIndex = 0;
+    m_dTolerance = 0.5;
+    memset(&m_Result, 0, sizeof(m_Result));
+    resetFit();
+}
+
+int CAutoFocus::start(int nCenter, int nStepSize, int nGridSize, int nModel, int nToleranceSteps)
+{
+    int nErr;
+    int nSpan;
+    int nPosLimit;
+
+    if(m_nState == AF_SAMPLING)
+        return ERR_COMMANDINPROGRESS;
+    if(nStepSize <= 0 || nGridSize < AF_MIN_SAMPLES || nGridSize > AF_MAX_SAMPLES)
+        return ERR_CMDFAILED;
+
+    // the grid is shifted rather than cut when it runs into a limit.
+    nSpan = nStepSize * (nGridSize - 1);
+    nPosLimit = m_Focuser.getPosLimit();
+    if(nSpan > nPosLimit)
+        return ERR_LIMITSEXCEEDED;
+    m_nFirstPos = nCenter - nSpan / 2;
+    if(m_nFirstPos < 0)
+        m_nFirstPos = 0;
+    if(m_nFirstPos + nSpan > nPosLimit)
+        m_nFirstPos = nPosLimit - nSpan;
+
+    m_nCenter = nCenter;
+    m_nStepSize = nStepSize;
+    m_nGridSize = nGridSize;
+    m_nModel = nModel;
+    m_dTolerance = nToleranceSteps > 0 ? double(nToleranceSteps) / nStepSize : 0.5;
+    m_nGridIndex = 0;
+    m_nSamplePos = m_nFirstPos;
+    m_Samples.clear();
+    memset(&m_Result, 0, sizeof(m_Result));
+    m_Result.nGridSize = nGridSize;
+    resetFit();
+
+    m_nState = AF_SAMPLING;
+    nErr = m_Focuser.gotoPosition(m_nSamplePos);
+    if(nErr)
+        m_nState = AF_FAILED;
+    return nErr;
+}
+
+// refits with the new sample, then either sends the focuser to the minimum or to the next grid position.
+int CAutoFocus::addMeasurement(double dHfd)
+{
+    AutoFocusSample Sample;
+    double dVertex;
+    double dSigma;
+    double dMinimum;
+    int nBelow = 0;
+    int nAbove = 0;
+    int nErr;
+
+    if(m_nState != AF_SAMPLING)
+        return ERR_CMDFAILED;
+
+    // no star, the position is skipped.
+    if(dHfd > 0.0) {
+        Sample.nPos = m_nSamplePos;
+        Sample.dHfd = dHfd;
+        m_Samples.push_back(Sample);
+        addToFit(double(m_nSamplePos - m_nCenter) / m_nStepSize, m_nModel == AF_HYPERBOLA ? dHfd * dHfd : dHfd);
+    }
+
+    if(int(m_Samples.size()) >= AF_MIN_SAMPLES && solveFit(dVertex, dSigma, dMinimum)) {
+        for(const AutoFocusSample &Sampled : m_Samples) {
+            if(double(Sampled.nPos - m_nCenter) / m_nStepSize < dVertex)
+                nBelow++;
+            else
+                nAbove++;
+        }
+        if(nBelow >= AF_MIN_PER_SIDE && nAbove >= AF_MIN_PER_SIDE && dSigma <= m_dTolerance)
+            return finish(true);
+    }
+
+    m_nGridIndex++;
+    if(m_nGridIndex >= m_nGridSize)
+        return finish(false);
+
+    m_nSamplePos = m_nFirstPos + m_nGridIndex * m_nStepSize;
+    nErr = m_Focuser.gotoPosition(m_nSamplePos);
+    if(nErr)
+        m_nState = AF_FAILED;
+    return nErr;
+}
+
+void CAutoFocus::abort()
+{
+    if(m_nState != AF_SAMPLING)
+        return;
+    m_Focuser.haltFocuser();
+    m_nState = AF_FAILED;
+}
+
+bool CAutoFocus::getResult(AutoFocusResult &Result)
+{
+    Result = m_Result;
+    return m_nState == AF_DONE;
+}
+
+#pragma mark fit
+
+void CAutoFocus::resetFit()
+{
+    memset(m_dSumX, 0, sizeof(m_dSumX));
+    memset(m_dSumXY, 0, sizeof(m_dSumXY));
+    m_dSumYY = 0.0;
+}
+
+// a sample only adds to the sums, every refit costs the same however many samples there are.
+void CAutoFocus::addToFit(double dX, double dY)
+{
+    double dXk = 1.0;
+
+    for(int k = 0; k < 5; k++) {
+        m_dSumX[k] += dXk;
+        if(k < 3)
+            m_dSumXY[k] += dXk * dY;
+        dXk *= dX;
+    }
+    m_dSumYY += dY * dY;
+}
+
+// solves the 3x3 normal equations, the vertex sigma comes from the parameter covariance.
+bool CAutoFocus::solveFit(double &dVertex, double &dSigma, double &dMinimum)
+{
+    const double *S = m_dSumX;
+    const double *T = m_dSumXY;
+    double dInv[3][3];
+    double dP[3];
+    double dDet;
+    double dResidual;
+    double dVariance;
+    double dGrad[3];
+    double dVar = 0.0;
+    double dN = S[0];
+
+    if(dN < 3.0)
+        return false;
+
+    // cofactors of the symmetric matrix [S0 S1 S2; S1 S2 S3; S2 S3 S4]
+    dInv[0][0] = S[2] * S[4] - S[3] * S[3];
+    dInv[0][1] = S[2] * S[3] - S[1] * S[4];
+    dInv[0][2] = S[1] * S[3] - S[2] * S[2];
+    dInv[1][1] = S[0] * S[4] - S[2] * S[2];
+    dInv[1][2] = S[1] * S[2] - S[0] * S[3];
+    dInv[2][2] = S[0] * S[2] - S[1] * S[1];
+    dDet = S[0] * dInv[0][0] + S[1] * dInv[0][1] + S[2] * dInv[0][2];
+    if(fabs(dDet) < 1e-12)
+        return false;
+    for(int i = 0; i < 3; i++) {
+        for(int j = i; j < 3; j++) {
+            dInv[i][j] /= dDet;
+            dInv[j][i] = dInv[i][j];
+        }
+    }
+    for(int i = 0; i < 3; i++)
+        dP[i] = dInv[i][0] * T[0] + dInv[i][1] * T[1] + dInv[i][2] * T[2];
+
+    // a curve opening downward has no best focus.
+    if(dP[2] <= 0.0)
+        return false;
+    dVertex = -dP[1] / (2.0 * dP[2]);
+    dMinimum = dP[0] - dP[1] * dP[1] / (4.0 * dP[2]);
+
+    dResidual = m_dSumYY - (dP[0] * T[0] + dP[1] * T[1] + dP[2] * T[2]);
+    if(dN <= 3.0) {
+        dSigma = HUGE_VAL;
+        return true;
+    }
+    dVariance = (dResidual > 0.0 ? dResidual : 0.0) / (dN - 3.0);
+    dGrad[0] = 0.0;
+    dGrad[1] = -1.0 / (2.0 * dP[2]);
+    dGrad[2] = dP[1] / (2.0 * dP[2] * dP[2]);
+    for(int i = 0; i < 3; i++)
+        for(int j = 0; j < 3; j++)
+            dVar += dGrad[i] * dInv[i][j] * dGrad[j];
+    dSigma = sqrt(dVariance * (dVar > 0.0 ? dVar : 0.0));
+    return true;
+}
+
+// sends the focuser to the fitted minimum, or back to where the run started if there is none.
+int CAutoFocus::finish(bool bConverged)
+{
+    double dVertex;
+    double dSigma;
+    double dMinimum;
+    double dLow;
+    double dHigh;
+    int nErr;
+
+    if(!solveFit(dVertex, dSigma, dMinimum))
+        return fail();
+    // not extrapolated past the samples.
+    dLow = double(m_nFirstPos - m_nCenter) / m_nStepSize;
+    dHigh = double(m_nSamplePos - m_nCenter) / m_nStepSize;
+    if(dVertex < dLow || dVertex > dHigh)
+        return fail();
+
+    m_Result.nBestPos = int(lround(m_nCenter + dVertex * m_nStepSize));
+    m_Result.dBestHfd = m_nModel == AF_HYPERBOLA ? sqrt(dMinimum > 0.0 ? dMinimum : 0.0) : dMinimum;
+    m_Result.dSigmaSteps = dSigma * m_nStepSize;
+    m_Result.nSamples = int(m_Samples.size());
+    m_Result.bConverged = bConverged;
+
+    nErr = m_Focuser.gotoPosition(m_Result.nBestPos);
+    m_nState = nErr ? AF_FAILED : AF_DONE;
+    return nErr;
+}
+
+int CAutoFocus::fail()
+{
+    m_Result.nSamples = int(m_Samples.size());
+    m_nState = AF_FAILED;
+    m_Focuser.gotoPosition(m_nCenter);
+    return ERR_CMDFAILED;
+}
@@ -0,0 +1,94 @@
+//
+//  AutoFocus.h
+//
+//  SmartFocus X2 plugin
+//  V-curve autofocus sequencer. Steps the focuser through a grid of positions
+//  around a starting point, takes one HFD (or FWHM) measurement per position
+//  from the caller and fits the curve by least squares after every sample, so
+//  the run stops as soon as the minimum is pinned down instead of walking the
+//  whole grid.
+//
+//  A star's HFD follows a hyperbola, HFD^2 = a^2 + (a/b)^2 * (x - c)^2, which is
+//  a parabola in HFD^2 : fitting a quadratic to HFD^2 fits the hyperbola exactly,
+//  fitting one to HFD gives the plain parabola model.
+//
+//  The grid is always walked in the same direction, from the low end, so every
+//  sample is taken with the same backlash.
+//
+//  Not thread safe, one caller drives a run.
+//
+
+#ifndef __AUTO_FOCUS__
+#define __AUTO_FOCUS__
+
+#include <vector>
+
+class CSmartFocus;
+
+#define AF_MIN_SAMPLES      5       // a quadratic and its error need at least 2 more points than parameters
+#define AF_MIN_PER_SIDE     2       // samples needed on each side of the minimum
+#define AF_MAX_SAMPLES      64
+
+enum AutoFocusModel {AF_HYPERBOLA = 0, AF_PARABOLA};
+enum AutoFocusState {AF_IDLE = 0, AF_SAMPLING, AF_DONE, AF_FAILED};
+
+typedef struct {
+    int     nBestPos;       // predicted best focus, where the focuser was sent
+    double  dBestHfd;       // curve value at the minimum
+    double  dSigmaSteps;    // 1 sigma uncertainty of nBestPos
+    int     nSamples;       // measurements used
+    int     nGridSize;      // samples the full grid would have taken
+    bool    bConverged;     // stopped on the tolerance rather than the end of the grid
+} AutoFocusResult;
+
+typedef struct {
+    int     nPos;
+    double  dHfd;
+} AutoFocusSample;
+
+class CAutoFocus
+{
+public:
+    CAutoFocus(CSmartFocus &Focuser);
+
+    // nGridSize positions nStepSize apart centered on nCenter. stops early once the
+    // minimum is known within nToleranceSteps (1 sigma), 0 for half a grid step.
+    int         start(int nCenter, int nStepSize, int nGridSize, int nModel = AF_HYPERBOLA, int nToleranceSteps = 0);
+    // measurement at getSamplePosition(), once the move there is complete. <= 0 if no star was found.
+    int         addMeasurement(double dHfd);
+    void        abort();
+
+    int         getState() { return m_nState; };
+    int         getSamplePosition() { return m_nSamplePos; };
+    bool        getResult(AutoFocusResult &Result);
+    const std::vector<AutoFocusSample> &getSamples() { return m_Samples; };
+
+protected:
+    void        resetFit();
+    void        addToFit(double dX, double dY);
+    bool        solveFit(double &dVertex, double &dSigma, double &dMinimum);
+    int         finish(bool bConverged);
+    int         fail();
+
+    CSmartFocus &m_Focuser;
+
+    int         m_nState;
+    int         m_nModel;
+    int         m_nCenter;
+    int         m_nStepSize;
+    int         m_nGridSize;
+    int         m_nFirstPos;
+    int         m_nSamplePos;
+    int         m_nGridIndex;
+    double      m_dTolerance;   // in grid steps
+    std::vector<AutoFocusSample> m_Samples;
+    AutoFocusResult m_Result;
+
+    // normal equations of y = p0 + p1.x + p2.x^2, x in grid steps from the center.
+    // m_dSumX[k] = sum of x^k for k = 0..4, m_dSumXY[k] = sum of y.x^k for k = 0..2
+    double      m_dSumX[5];
+    double      m_dSumXY[3];
+    double      m_dSumYY;
+};
+
+#endif //__AUTO_FOCUS__
@@ -0,0 +1,106 @@
+//
+//  CommandPacer.cpp
+//
+//  SmartFocus X2 plugin
+//
+
+#include "CommandPacer.h"
+
+CCommandPacer::CCommandPacer()
+{
+    reset();
+}
+
+void CCommandPacer::reset()
+{
+    std::lock_guard<std::mutex> lock(m_Lock);
+
+    for(int i = 0; i < 256; i++) {
+        m_nGapUs[i] = 0;
+        m_nMinTurnaroundUs[i] = 0;
+        m_bFailed[i] = false;
+    }
+    m_llLastActivityUs = 0;
+}
+
+long long CCommandPacer::now()
+{
+    return CStopWatch::NowNs() / 1000;
+}
+
+// how long to wait before a batch starting now, the slowest opcode in it decides.
+int CCommandPacer::delayBeforeUs(const unsigned char *pszOpcodes, int nCount)
+{
+    std::lock_guard<std::mutex> lock(m_Lock);
+    int nGapUs = 0;
+    long long llElapsedUs;
+
+    for(int i = 0; i < nCount; i++) {
+        if(m_nGapUs[pszOpcodes[i]] > nGapUs)
+            nGapUs = m_nGapUs[pszOpcodes[i]];
+    }
+    if(!nGapUs)
+        return 0;
+
+    llElapsedUs = now() - m_llLastActivityUs;
+    if(llElapsedUs >= nGapUs)
+        return 0;
+    return int(nGapUs - llElapsedUs);
+}
+
+void CCommandPacer::commandSent()
+{
+    std::lock_guard<std::mutex> lock(m_Lock);
+    m_llLastActivityUs = now();
+}
+
+void CCommandPacer::replyReceived(unsigned char cOpcode, long long llTurnaroundUs)
+{
+    std::lock_guard<std::mutex> lock(m_Lock);
+
+    m_llLastActivityUs = now();
+    if(!m_nMinTurnaroundUs[cOpcode] || llTurnaroundUs < m_nMinTurnaroundUs[cOpcode])
+        m_nMinTurnaroundUs[cOpcode] = int(llTurnaroundUs);
+
+    m_nGapUs[cOpcode] -= m_nGapUs[cOpcode] >> PACER_DECAY_SHIFT;
+    if(m_nGapUs[cOpcode] < floorUs(cOpcode))
+        m_nGapUs[cOpcode] = floorUs(cOpcode);
+    if(m_nGapUs[cOpcode] < PACER_MIN_GAP_US)
+        m_nGapUs[cOpcode] = 0;
+}
+
+// timeout or garbled reply, the firmware wasn't ready : double the gap, starting
+// from the measured turnaround when that's longer than the first step.
+void CCommandPacer::replyFailed(unsigned char cOpcode)
+{
+    std::lock_guard<std::mutex> lock(m_Lock);
+
+    m_llLastActivityUs = now();
+    m_bFailed[cOpcode] = true;
+    if(m_nGapUs[cOpcode] < PACER_BACKOFF_MIN_US || m_nGapUs[cOpcode] < floorUs(cOpcode))
+        m_nGapUs[cOpcode] = floorUs(cOpcode) > PACER_BACKOFF_MIN_US ? floorUs(cOpcode) : PACER_BACKOFF_MIN_US;
+    else
+        m_nGapUs[cOpcode] *= 2;
+    if(m_nGapUs[cOpcode] > PACER_MAX_GAP_US)
+        m_nGapUs[cOpcode] = PACER_MAX_GAP_US;
+}
+
+int CCommandPacer::getGapUs(unsigned char cOpcode)
+{
+    std::lock_guard<std::mutex> lock(m_Lock);
+    return m_nGapUs[cOpcode];
+}
+
+int CCommandPacer::getMinTurnaroundUs(unsigned char cOpcode)
+{
+    std::lock_guard<std::mutex> lock(m_Lock);
+    return m_nMinTurnaroundUs[cOpcode];
+}
+
+// m_Lock held
+int CCommandPacer::floorUs(unsigned char cOpcode)
+{
+    if(!m_bFailed[cOpcode])
+        return 0;
+    return m_nMinTurnaroundUs[cOpcode] < PACER_MAX_GAP_US ? m_nMinTurnaroundUs[cOpcode] : PACER_MAX_GAP_US;
+}
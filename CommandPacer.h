@@ -0,0 +1,53 @@
+//
+//  CommandPacer.h
+//
+//  SmartFocus X2 plugin
+//  Adaptive spacing between commands. Each opcode keeps the minimum quiet time
+//  the controller needs after the previous exchange before it is sent. The gap
+//  shrinks while replies come back clean and backs off on timeouts or garbled
+//  replies, so we run at the fastest rate the firmware actually tolerates.
+//  Once an opcode has failed, its measured minimum turnaround is the floor
+//  of the backoff and of the decay, the gap never goes back below what the
+//  controller has shown it needs for that command.
+//
+
+#ifndef __COMMAND_PACER__
+#define __COMMAND_PACER__
+
+#include <mutex>
+
+#include "StopWatch.h"
+
+#define PACER_BACKOFF_MIN_US    10000                       // first step after a failure
+#define PACER_MAX_GAP_US        200000                      // us, never slower than the old fixed 200 ms throttle
+#define PACER_DECAY_SHIFT       3                           // a clean reply removes 1/8th of the gap
+#define PACER_MIN_GAP_US        500                         // below this the gap snaps to 0
+
+class CCommandPacer
+{
+public:
+    CCommandPacer();
+
+    void        reset();
+
+    static long long now();     // monotonic, in micro seconds
+
+    int         delayBeforeUs(const unsigned char *pszOpcodes, int nCount);
+    void        commandSent();
+    void        replyReceived(unsigned char cOpcode, long long llTurnaroundUs);
+    void        replyFailed(unsigned char cOpcode);
+
+    int         getGapUs(unsigned char cOpcode);
+    int         getMinTurnaroundUs(unsigned char cOpcode);
+
+protected:
+    int         floorUs(unsigned char cOpcode);
+
+    std::mutex  m_Lock;
+    int         m_nGapUs[256];
+    int         m_nMinTurnaroundUs[256];    // 0 until the first reply
+    bool        m_bFailed[256];             // the gap floor is m_nMinTurnaroundUs from the first failure on
+    long long   m_llLastActivityUs;         // last command sent or reply received
+};
+
+#endif //__COMMAND_PACER__
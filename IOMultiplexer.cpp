@@ -0,0 +1,311 @@
+//
+//  IOMultiplexer.cpp
+//
+//  SmartFocus X2 plugin
+//
+
+#include "IOMultiplexer.h"
+#include "StopWatch.h"
+#include <algorithm>
+#include <errno.h>
+#ifdef SB_LINUX_BUILD
+#include <unistd.h>
+#include <sys/epoll.h>
+#include <sys/eventfd.h>
+#endif
+
+#include "../../licensedinterfaces/sberrorx.h"
+
+CIOMultiplexer &CIOMultiplexer::instance()
+{
+    static CIOMultiplexer Multiplexer;
+    return Multiplexer;
+}
+
+CIOMultiplexer::CIOMultiplexer()
+{
+    m_nNextId = 1;
+    m_bRunning = false;
+    m_llWakeups = 0;
+    m_bWakePending = false;
+    m_nEpollFd = -1;
+    m_nWakeFd = -1;
+#ifdef SB_LINUX_BUILD
+    struct epoll_event Event;
+
+    m_nEpollFd = epoll_create1(EPOLL_CLOEXEC);
+    m_nWakeFd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+    if(m_nEpollFd >= 0 && m_nWakeFd >= 0) {
+        Event.events = EPOLLIN;
+        Event.data.u64 = 0;     // channel ids start at 1
+        epoll_ctl(m_nEpollFd, EPOLL_CTL_ADD, m_nWakeFd, &Event);
+    }
+#endif
+}
+
+CIOMultiplexer::~CIOMultiplexer()
+{
+    stopThread();
+#ifdef SB_LINUX_BUILD
+    if(m_nWakeFd >= 0)
+        close(m_nWakeFd);
+    if(m_nEpollFd >= 0)
+        close(m_nEpollFd);
+#endif
+}
+
+int CIOMultiplexer::addChannel(SerXInterface *pSerx, CIOClient *pClient)
+{
+    std::lock_guard<std::mutex> lifeLock(m_LifeLock);
+    CIOFdSource *pFdSource = dynamic_cast<CIOFdSource *>(pSerx);
+    Channel Chan;
+
+    Chan.pSerx = pSerx;
+    Chan.pClient = pClient;
+    Chan.nFd = pFdSource ? pFdSource->getFd() : -1;
+    Chan.bWatched = false;
+    Chan.llRetryNs = 0;
+    {
+        std::lock_guard<std::mutex> listLock(m_ListLock);
+        Chan.nId = m_nNextId++;
+        watch(Chan);
+        m_Channels.push_back(Chan);
+    }
+    if(!m_bRunning)
+        startThread();
+    wake();
+    return Chan.nId;
+}
+
+void CIOMultiplexer::removeChannel(int nChannel)
+{
+    std::lock_guard<std::mutex> lifeLock(m_LifeLock);
+    bool bEmpty;
+
+    {
+        // waits for the I/O thread to be done with the channel.
+        std::lock_guard<std::mutex> dispatchLock(m_DispatchLock);
+        std::lock_guard<std::mutex> listLock(m_ListLock);
+        for(std::vector<Channel>::iterator it = m_Channels.begin(); it != m_Channels.end(); ++it) {
+            if(it->nId == nChannel) {
+                unwatch(*it);
+                m_Channels.erase(it);
+                break;
+            }
+        }
+        bEmpty = m_Channels.empty();
+    }
+    if(bEmpty)
+        stopThread();
+}
+
+void CIOMultiplexer::wake()
+{
+#ifdef SB_LINUX_BUILD
+    uint64_t llOne = 1;
+
+    if(m_nWakeFd >= 0) {
+        if(write(m_nWakeFd, &llOne, sizeof(llOne)) < 0) {
+            // already signaled, the counter is saturated.
+        }
+        return;
+    }
+#endif
+    std::lock_guard<std::mutex> wakeLock(m_WakeLock);
+    m_bWakePending = true;
+    m_WakeCond.notify_all();
+}
+
+int CIOMultiplexer::getChannelCount()
+{
+    std::lock_guard<std::mutex> listLock(m_ListLock);
+    return int(m_Channels.size());
+}
+
+#pragma mark I/O thread
+
+void CIOMultiplexer::startThread()
+{
+    m_bRunning = true;
+    m_Thread = std::thread(&CIOMultiplexer::ioThread, this);
+}
+
+void CIOMultiplexer::stopThread()
+{
+    m_bRunning = false;
+    wake();
+    if(m_Thread.joinable())
+        m_Thread.join();
+}
+
+void CIOMultiplexer::ioThread()
+{
+    int nTimeoutMs;
+    long long llNowNs;
+
+    while(m_bRunning) {
+        // short waits only while someone expects bytes from a port we have to poll.
+        nTimeoutMs = IO_IDLE_POLL_MS;
+        {
+            std::lock_guard<std::mutex> dispatchLock(m_DispatchLock);
+            {
+                std::lock_guard<std::mutex> listLock(m_ListLock);
+                m_Active.assign(m_Channels.begin(), m_Channels.end());
+            }
+            for(Channel &Chan : m_Active) {
+                if(!Chan.bWatched && Chan.pClient->ioExpectingData()) {
+                    nTimeoutMs = IO_ACTIVE_POLL_MS;
+                    break;
+                }
+            }
+        }
+
+        waitEvents(nTimeoutMs);
+        m_llWakeups.fetch_add(1, std::memory_order_relaxed);
+
+        std::lock_guard<std::mutex> dispatchLock(m_DispatchLock);
+        {
+            std::lock_guard<std::mutex> listLock(m_ListLock);
+            m_Active.assign(m_Channels.begin(), m_Channels.end());
+        }
+        llNowNs = CStopWatch::NowNs();
+        for(Channel &Chan : m_Active) {
+            if(Chan.bWatched)
+                readFd(Chan, llNowNs);
+            else
+                readPolled(Chan, llNowNs);
+        }
+        // failures and retries changed the epoll state of the copies.
+        {
+            std::lock_guard<std::mutex> listLock(m_ListLock);
+            for(Channel &Active : m_Active) {
+                for(Channel &Chan : m_Channels) {
+                    if(Chan.nId == Active.nId) {
+                        Chan.bWatched = Active.bWatched;
+                        Chan.llRetryNs = Active.llRetryNs;
+                    }
+                }
+            }
+        }
+    }
+}
+
+// fills m_Ready with the channels epoll found readable.
+int CIOMultiplexer::waitEvents(int nTimeoutMs)
+{
+    m_Ready.clear();
+#ifdef SB_LINUX_BUILD
+    struct epoll_event Events[16];
+    uint64_t llCount;
+    int nEvents;
+
+    if(m_nEpollFd >= 0 && m_nWakeFd >= 0) {
+        nEvents = epoll_wait(m_nEpollFd, Events, 16, nTimeoutMs);
+        for(int i = 0; i < nEvents; i++) {
+            if(Events[i].data.u64 == 0) {
+                if(read(m_nWakeFd, &llCount, sizeof(llCount)) < 0) {
+                    // drained by an earlier wait
+                }
+                continue;
+            }
+            m_Ready.push_back(int(Events[i].data.u64));
+        }
+        return nEvents;
+    }
+#endif
+    std::unique_lock<std::mutex> wakeLock(m_WakeLock);
+    m_WakeCond.wait_for(wakeLock, std::chrono::milliseconds(nTimeoutMs), [this] { return m_bWakePending; });
+    m_bWakePending = false;
+    return 0;
+}
+
+// whatever the port has, without waiting. a short read can't be told from an idle
+// port, so 1 byte is asked for when bytesWaitingRx says 0 : a dead port then fails.
+void CIOMultiplexer::readPolled(Channel &Chan, long long llNowNs)
+{
+    unsigned char szBuffer[IO_READ_CHUNK];
+    unsigned long ulBytesRead = 0;
+    int nWaiting;
+    int nErr;
+
+    if(Chan.llRetryNs > llNowNs)
+        return;
+    // an fd that failed goes back to epoll, a hang up will be reported again.
+    if(Chan.nFd >= 0) {
+        watch(Chan);
+        if(Chan.bWatched)
+            return;
+    }
+    nWaiting = Chan.pSerx->bytesWaitingRx();
+    nWaiting = std::min(std::max(nWaiting, 1), IO_READ_CHUNK);
+    nErr = Chan.pSerx->readFile(szBuffer, nWaiting, ulBytesRead, 0);
+    if(nErr) {
+        channelFailed(Chan, nErr, llNowNs);
+        return;
+    }
+    if(ulBytesRead)
+        Chan.pClient->ioReceived(szBuffer, int(ulBytesRead));
+}
+
+void CIOMultiplexer::readFd(Channel &Chan, long long llNowNs)
+{
+#ifdef SB_LINUX_BUILD
+    unsigned char szBuffer[IO_READ_CHUNK];
+    ssize_t nRead;
+
+    if(!isReady(Chan.nId))
+        return;
+    nRead = read(Chan.nFd, szBuffer, sizeof(szBuffer));
+    if(nRead > 0) {
+        Chan.pClient->ioReceived(szBuffer, int(nRead));
+        return;
+    }
+    if(nRead < 0 && (errno == EAGAIN || errno == EINTR))
+        return;
+    // 0 is a hang up, the adapter is gone.
+    channelFailed(Chan, ERR_COMMNOLINK, llNowNs);
+#else
+    readPolled(Chan, llNowNs);
+#endif
+}
+
+// out of the epoll set until the retry time, a hung up fd would be reported on every wait.
+void CIOMultiplexer::channelFailed(Channel &Chan, int nErr, long long llNowNs)
+{
+    Chan.llRetryNs = llNowNs + IO_RETRY_MS * 1000000LL;
+    unwatch(Chan);
+    Chan.pClient->ioFailed(nErr);
+}
+
+bool CIOMultiplexer::isReady(int nId)
+{
+    return std::find(m_Ready.begin(), m_Ready.end(), nId) != m_Ready.end();
+}
+
+void CIOMultiplexer::watch(Channel &Chan)
+{
+#ifdef SB_LINUX_BUILD
+    struct epoll_event Event;
+
+    if(Chan.nFd < 0 || m_nEpollFd < 0 || Chan.bWatched)
+        return;
+    Event.events = EPOLLIN;
+    Event.data.u64 = (uint64_t)Chan.nId;
+    if(!epoll_ctl(m_nEpollFd, EPOLL_CTL_ADD, Chan.nFd, &Event))
+        Chan.bWatched = true;
+#else
+    (void)Chan;
+#endif
+}
+
+void CIOMultiplexer::unwatch(Channel &Chan)
+{
+#ifdef SB_LINUX_BUILD
+    if(!Chan.bWatched)
+        return;
+    epoll_ctl(m_nEpollFd, EPOLL_CTL_DEL, Chan.nFd, NULL);
+    Chan.bWatched = false;
+#else
+    (void)Chan;
+#endif
+}
@@ -0,0 +1,113 @@
+//
+//  IOMultiplexer.h
+//
+//  SmartFocus X2 plugin
+//  One receive thread for every open SmartFocus port in the process, instead of
+//  a reader thread per focuser blocked in readFile. Ports that hand out a file
+//  descriptor (CIOFdSource) are waited on with epoll on Linux, the others are
+//  polled through SerXInterface : every IO_ACTIVE_POLL_MS while their client
+//  expects a reply or a move completion, every IO_IDLE_POLL_MS otherwise.
+//  Reads never block, so a slow or dead device can't hold up the others.
+//
+//  Writes stay on the calling thread, a command is a few bytes and the driver
+//  waits for its reply anyway.
+//
+
+#ifndef __IO_MULTIPLEXER__
+#define __IO_MULTIPLEXER__
+
+#include <vector>
+#include <atomic>
+#include <mutex>
+#include <thread>
+#include <condition_variable>
+
+#include "../../licensedinterfaces/serxinterface.h"
+
+#define IO_ACTIVE_POLL_MS   1       // about one byte time at 9600 baud
+#define IO_IDLE_POLL_MS     20
+#define IO_RETRY_MS         100     // a port that failed a read is left alone that long
+#define IO_READ_CHUNK       64
+
+// receives the bytes of one port. called on the I/O thread with no driver lock held,
+// must not block nor call CIOMultiplexer::removeChannel.
+class CIOClient
+{
+public:
+    virtual ~CIOClient() {};
+
+    virtual void    ioReceived(const unsigned char *pData, int nLen) = 0;
+    virtual void    ioFailed(int nErr) = 0;
+    // polled ports are checked every IO_ACTIVE_POLL_MS while true
+    virtual bool    ioExpectingData() = 0;
+};
+
+// implemented by SerXInterface backends built on a plain file descriptor.
+class CIOFdSource
+{
+public:
+    virtual ~CIOFdSource() {};
+
+    virtual int     getFd() = 0;    // -1 when closed
+};
+
+class CIOMultiplexer
+{
+public:
+    static CIOMultiplexer &instance();
+
+    // the port must be open. returns the channel id, > 0
+    int         addChannel(SerXInterface *pSerx, CIOClient *pClient);
+    // no callback is running or will run for the channel once this returns.
+    void        removeChannel(int nChannel);
+    // data is expected soon, recheck the poll interval now.
+    void        wake();
+
+    int         getChannelCount();
+    long long   getWakeups() { return m_llWakeups; };
+
+protected:
+    CIOMultiplexer();
+    ~CIOMultiplexer();
+
+    typedef struct {
+        int             nId;
+        SerXInterface   *pSerx;
+        CIOClient       *pClient;
+        int             nFd;        // -1 for ports only reachable through SerXInterface
+        bool            bWatched;   // nFd is in the epoll set
+        long long       llRetryNs;  // CStopWatch::NowNs() before which a failed port isn't read
+    } Channel;
+
+    void        startThread();
+    void        stopThread();
+    void        ioThread();
+    int         waitEvents(int nTimeoutMs);
+    void        readPolled(Channel &Chan, long long llNowNs);
+    void        readFd(Channel &Chan, long long llNowNs);
+    void        channelFailed(Channel &Chan, int nErr, long long llNowNs);
+    bool        isReady(int nId);
+    void        watch(Channel &Chan);
+    void        unwatch(Channel &Chan);
+
+    std::mutex              m_LifeLock;     // add / remove and the thread start / stop
+    std::mutex              m_DispatchLock; // held by the I/O thread while it reads and calls clients
+    std::mutex              m_ListLock;     // m_Channels
+    std::vector<Channel>    m_Channels;
+    std::vector<Channel>    m_Active;       // I/O thread copy of m_Channels
+    int                     m_nNextId;
+
+    std::thread             m_Thread;
+    std::atomic<bool>       m_bRunning;
+    std::atomic<long long>  m_llWakeups;
+
+    // epoll set and the eventfd that breaks the wait on Linux, a condition elsewhere
+    int                     m_nEpollFd;
+    int                     m_nWakeFd;
+    std::vector<int>        m_Ready;        // channel ids reported by the last wait
+    std::mutex              m_WakeLock;
+    std::condition_variable m_WakeCond;
+    bool                    m_bWakePending;
+};
+
+#endif //__IO_MULTIPLEXER__
@@ -0,0 +1,198 @@
+//
+//  LinkStats.cpp
+//
+//  SmartFocus X2 plugin
+//
+
+#include "LinkStats.h"
+#include <stdio.h>
+#include <string.h>
+#include <ctype.h>
+
+CLinkStats::CLinkStats()
+{
+    reset();
+}
+
+void CLinkStats::reset()
+{
+    std::lock_guard<std::mutex> lock(m_Lock);
+
+    memset(m_Histograms, 0, sizeof(m_Histograms));
+    m_nHistograms = 0;
+    for(int i = 0; i < 256; i++)
+        m_nSlot[i] = -1;
+    m_llBytesSent = 0;
+    m_llBytesReceived = 0;
+    m_llUnexpectedBytes = 0;
+    m_llMoveFailures = 0;
+    m_llResyncs = 0;
+    m_llLostCompletions = 0;
+}
+
+void CLinkStats::replyReceived(unsigned char cOpcode, long long llLatencyUs, bool bRefused)
+{
+    std::lock_guard<std::mutex> lock(m_Lock);
+    Histogram *pHist = histogramLocked(cOpcode);
+
+    if(!pHist)
+        return;
+    if(llLatencyUs < 0)
+        llLatencyUs = 0;
+    pHist->llBuckets[bucketOf(llLatencyUs)]++;
+    pHist->llCount++;
+    pHist->llTotalUs += llLatencyUs;
+    if(llLatencyUs > pHist->llMaxUs)
+        pHist->llMaxUs = llLatencyUs;
+    if(bRefused)
+        pHist->llRefused++;
+}
+
+void CLinkStats::replyTimedOut(unsigned char cOpcode, bool bShortRead)
+{
+    std::lock_guard<std::mutex> lock(m_Lock);
+    Histogram *pHist = histogramLocked(cOpcode);
+
+    if(!pHist)
+        return;
+    if(bShortRead)
+        pHist->llShortReads++;
+    else
+        pHist->llTimeouts++;
+}
+
+int CLinkStats::getOpcodes(unsigned char *pszOpcodes, int nMaxCount)
+{
+    std::lock_guard<std::mutex> lock(m_Lock);
+    int i;
+
+    for(i = 0; i < m_nHistograms && i < nMaxCount; i++)
+        pszOpcodes[i] = m_Histograms[i].cOpcode;
+    return i;
+}
+
+bool CLinkStats::getOpcodeStats(unsigned char cOpcode, OpcodeStats &Stats)
+{
+    std::lock_guard<std::mutex> lock(m_Lock);
+    const Histogram *pHist;
+
+    memset(&Stats, 0, sizeof(Stats));
+    Stats.cOpcode = cOpcode;
+    if(m_nSlot[cOpcode] < 0)
+        return false;
+    pHist = &m_Histograms[m_nSlot[cOpcode]];
+    Stats.llCount = pHist->llCount;
+    Stats.llTimeouts = pHist->llTimeouts;
+    Stats.llShortReads = pHist->llShortReads;
+    Stats.llRefused = pHist->llRefused;
+    Stats.llP50Us = percentileLocked(*pHist, 50.0);
+    Stats.llP99Us = percentileLocked(*pHist, 99.0);
+    Stats.llMaxUs = pHist->llMaxUs;
+    Stats.llMeanUs = pHist->llCount ? pHist->llTotalUs / pHist->llCount : 0;
+    return true;
+}
+
+void CLinkStats::getCounters(LinkCounters &Counters)
+{
+    Counters.llBytesSent = m_llBytesSent;
+    Counters.llBytesReceived = m_llBytesReceived;
+    Counters.llUnexpectedBytes = m_llUnexpectedBytes;
+    Counters.llMoveFailures = m_llMoveFailures;
+    Counters.llResyncs = m_llResyncs;
+    Counters.llLostCompletions = m_llLostCompletions;
+}
+
+long long CLinkStats::getPercentileUs(unsigned char cOpcode, double dPercentile)
+{
+    std::lock_guard<std::mutex> lock(m_Lock);
+
+    if(m_nSlot[cOpcode] < 0)
+        return 0;
+    return percentileLocked(m_Histograms[m_nSlot[cOpcode]], dPercentile);
+}
+
+void CLinkStats::report(std::string &sReport)
+{
+    unsigned char szOpcodes[STATS_MAX_OPCODES];
+    OpcodeStats Stats;
+    LinkCounters Counters;
+    char szLine[256];
+    int nOpcodes;
+
+    nOpcodes = getOpcodes(szOpcodes, STATS_MAX_OPCODES);
+    sReport.clear();
+    for(int i = 0; i < nOpcodes; i++) {
+        getOpcodeStats(szOpcodes[i], Stats);
+        snprintf(szLine, sizeof(szLine), "'%c' : %lld replies, p50 %lldus, p99 %lldus, max %lldus, mean %lldus, %lld timeouts, %lld short reads, %lld refused\n",
+                 isprint(Stats.cOpcode) ? Stats.cOpcode : '?', Stats.llCount, Stats.llP50Us, Stats.llP99Us, Stats.llMaxUs, Stats.llMeanUs,
+                 Stats.llTimeouts, Stats.llShortReads, Stats.llRefused);
+        sReport += szLine;
+    }
+    getCounters(Counters);
+    snprintf(szLine, sizeof(szLine), "%lld bytes sent, %lld bytes received, %lld unexpected bytes, %lld resyncs, %lld failed moves, %lld lost 'c'\n",
+             Counters.llBytesSent, Counters.llBytesReceived, Counters.llUnexpectedBytes, Counters.llResyncs, Counters.llMoveFailures,
+             Counters.llLostCompletions);
+    sReport += szLine;
+}
+
+// 0..3 are exact, then 4 buckets per power of 2.
+int CLinkStats::bucketOf(long long llUs)
+{
+    int nExp = 0;
+    int nBucket;
+
+    if(llUs < STATS_SUB_BUCKETS)
+        return (int)llUs;
+    while((llUs >> nExp) >= 2 * STATS_SUB_BUCKETS)
+        nExp++;
+    nBucket = (nExp + 1) * STATS_SUB_BUCKETS + (int)((llUs >> nExp) - STATS_SUB_BUCKETS);
+    return nBucket < STATS_BUCKETS ? nBucket : STATS_BUCKETS - 1;
+}
+
+long long CLinkStats::bucketUpperUs(int nBucket)
+{
+    int nExp;
+
+    if(nBucket < STATS_SUB_BUCKETS)
+        return nBucket;
+    nExp = nBucket / STATS_SUB_BUCKETS - 1;
+    return ((long long)(STATS_SUB_BUCKETS + nBucket % STATS_SUB_BUCKETS + 1) << nExp) - 1;
+}
+
+CLinkStats::Histogram *CLinkStats::histogramLocked(unsigned char cOpcode)
+{
+    if(m_nSlot[cOpcode] < 0) {
+        if(m_nHistograms >= STATS_MAX_OPCODES)
+            return NULL;
+        m_nSlot[cOpcode] = m_nHistograms;
+        m_Histograms[m_nHistograms++].cOpcode = cOpcode;
+    }
+    return &m_Histograms[m_nSlot[cOpcode]];
+}
+
+long long CLinkStats::percentileLocked(const Histogram &Hist, double dPercentile)
+{
+    return percentileUs(Hist.llBuckets, Hist.llCount, Hist.llMaxUs, dPercentile);
+}
+
+// upper bound of the bucket holding the percentile, capped by the real max.
+long long CLinkStats::percentileUs(const long long *pllBuckets, long long llCount, long long llMaxUs, double dPercentile)
+{
+    long long llRank;
+    long long llSeen = 0;
+    long long llUpperUs;
+
+    if(!llCount)
+        return 0;
+    llRank = (long long)(llCount * dPercentile / 100.0 + 0.5);
+    if(llRank < 1)
+        llRank = 1;
+    for(int i = 0; i < STATS_BUCKETS; i++) {
+        llSeen += pllBuckets[i];
+        if(llSeen >= llRank) {
+            llUpperUs = bucketUpperUs(i);
+            return llUpperUs < llMaxUs ? llUpperUs : llMaxUs;
+        }
+    }
+    return llMaxUs;
+}
@@ -0,0 +1,103 @@
+//
+//  LinkStats.h
+//
+//  SmartFocus X2 plugin
+//  Serial link statistics : a round trip latency histogram per opcode and
+//  failure / traffic counters, to tell slow USB-serial adapters and firmware
+//  stalls apart in the field.
+//
+//  Histograms are log bucketed, 4 buckets per power of 2 of the latency in us,
+//  so percentiles are within 25% of the real value from 1us to over an hour.
+//
+
+#ifndef __LINK_STATS__
+#define __LINK_STATS__
+
+#include <string>
+#include <atomic>
+#include <mutex>
+
+#define STATS_MAX_OPCODES   16
+#define STATS_BUCKETS       128
+#define STATS_SUB_BUCKETS   4       // per power of 2, must be a power of 2
+
+typedef struct {
+    unsigned char   cOpcode;
+    long long       llCount;        // replies received
+    long long       llTimeouts;     // no reply at all
+    long long       llShortReads;   // reply started but incomplete at the timeout
+    long long       llRefused;      // 'r' reply
+    long long       llP50Us;
+    long long       llP99Us;
+    long long       llMaxUs;
+    long long       llMeanUs;
+} OpcodeStats;
+
+typedef struct {
+    long long       llBytesSent;
+    long long       llBytesReceived;
+    long long       llUnexpectedBytes;  // neither a reply nor a move completion
+    long long       llMoveFailures;     // 'r' instead of the 'c' at the end of a move
+    long long       llResyncs;          // replies that went wrong and were parsed again from their second byte
+    long long       llLostCompletions;  // moves found ended by polling after their predicted end, no 'c' came
+} LinkCounters;
+
+class CLinkStats
+{
+public:
+    CLinkStats();
+
+    void        reset();
+
+    void        replyReceived(unsigned char cOpcode, long long llLatencyUs, bool bRefused);
+    void        replyTimedOut(unsigned char cOpcode, bool bShortRead);
+    void        bytesSent(int nBytes)   { m_llBytesSent.fetch_add(nBytes, std::memory_order_relaxed); };
+    void        bytesReceived(int nBytes)   { m_llBytesReceived.fetch_add(nBytes, std::memory_order_relaxed); };
+    void        unexpectedByte()        { m_llUnexpectedBytes.fetch_add(1, std::memory_order_relaxed); };
+    void        moveFailed()            { m_llMoveFailures.fetch_add(1, std::memory_order_relaxed); };
+    void        resynced()              { m_llResyncs.fetch_add(1, std::memory_order_relaxed); };
+    void        lostCompletion()        { m_llLostCompletions.fetch_add(1, std::memory_order_relaxed); };
+
+    // opcodes seen so far, in the order they were first used. returns the count.
+    int         getOpcodes(unsigned char *pszOpcodes, int nMaxCount);
+    bool        getOpcodeStats(unsigned char cOpcode, OpcodeStats &Stats);
+    void        getCounters(LinkCounters &Counters);
+    long long   getPercentileUs(unsigned char cOpcode, double dPercentile);
+
+    // one line per opcode plus the counters
+    void        report(std::string &sReport);
+
+    // the log bucketing, shared with CLockStats
+    static int          bucketOf(long long llUs);
+    static long long    bucketUpperUs(int nBucket);
+    static long long    percentileUs(const long long *pllBuckets, long long llCount, long long llMaxUs, double dPercentile);
+
+protected:
+    typedef struct {
+        unsigned char   cOpcode;
+        long long       llBuckets[STATS_BUCKETS];
+        long long       llCount;
+        long long       llTotalUs;
+        long long       llMaxUs;
+        long long       llTimeouts;
+        long long       llShortReads;
+        long long       llRefused;
+    } Histogram;
+
+    Histogram           *histogramLocked(unsigned char cOpcode);
+    long long           percentileLocked(const Histogram &Hist, double dPercentile);
+
+    std::mutex          m_Lock;
+    Histogram           m_Histograms[STATS_MAX_OPCODES];
+    int                 m_nHistograms;
+    int                 m_nSlot[256];   // opcode -> m_Histograms index, -1 until first used
+
+    std::atomic<long long>  m_llBytesSent;
+    std::atomic<long long>  m_llBytesReceived;
+    std::atomic<long long>  m_llUnexpectedBytes;
+    std::atomic<long long>  m_llMoveFailures;
+    std::atomic<long long>  m_llResyncs;
+    std::atomic<long long>  m_llLostCompletions;
+};
+
+#endif //__LINK_STATS__
@@ -0,0 +1,75 @@
+//
+//  LockStats.cpp
+//
+//  SmartFocus X2 plugin
+//
+
+#include "LockStats.h"
+#include <stdio.h>
+#include <string.h>
+
+CLockStats::CLockStats(const char * const *ppszNames, int nEntries)
+{
+    m_ppszNames = ppszNames;
+    m_nEntries = nEntries < LOCK_STATS_MAX_ENTRIES ? nEntries : LOCK_STATS_MAX_ENTRIES;
+    reset();
+}
+
+void CLockStats::reset()
+{
+    std::lock_guard<std::mutex> lock(m_Lock);
+
+    memset(m_Entries, 0, sizeof(m_Entries));
+}
+
+void CLockStats::locked(int nEntry, long long llWaitUs, long long llHoldUs)
+{
+    std::lock_guard<std::mutex> lock(m_Lock);
+    Entry *pEntry;
+
+    if(nEntry < 0 || nEntry >= m_nEntries)
+        return;
+    pEntry = &m_Entries[nEntry];
+    pEntry->llWaitBuckets[CLinkStats::bucketOf(llWaitUs)]++;
+    pEntry->llHoldBuckets[CLinkStats::bucketOf(llHoldUs)]++;
+    pEntry->llCount++;
+    if(llWaitUs > pEntry->llWaitMaxUs)
+        pEntry->llWaitMaxUs = llWaitUs;
+    if(llHoldUs > pEntry->llHoldMaxUs)
+        pEntry->llHoldMaxUs = llHoldUs;
+}
+
+bool CLockStats::getLockTimes(int nEntry, LockTimes &Times)
+{
+    std::lock_guard<std::mutex> lock(m_Lock);
+    Entry *pEntry;
+
+    if(nEntry < 0 || nEntry >= m_nEntries)
+        return false;
+    pEntry = &m_Entries[nEntry];
+    Times.pszName = m_ppszNames[nEntry];
+    Times.llCount = pEntry->llCount;
+    Times.llWaitP50Us = CLinkStats::percentileUs(pEntry->llWaitBuckets, pEntry->llCount, pEntry->llWaitMaxUs, 50.0);
+    Times.llWaitP99Us = CLinkStats::percentileUs(pEntry->llWaitBuckets, pEntry->llCount, pEntry->llWaitMaxUs, 99.0);
+    Times.llWaitMaxUs = pEntry->llWaitMaxUs;
+    Times.llHoldP50Us = CLinkStats::percentileUs(pEntry->llHoldBuckets, pEntry->llCount, pEntry->llHoldMaxUs, 50.0);
+    Times.llHoldP99Us = CLinkStats::percentileUs(pEntry->llHoldBuckets, pEntry->llCount, pEntry->llHoldMaxUs, 99.0);
+    Times.llHoldMaxUs = pEntry->llHoldMaxUs;
+    return true;
+}
+
+void CLockStats::report(std::string &sReport)
+{
+    LockTimes Times;
+    char szLine[256];
+
+    sReport.clear();
+    for(int i = 0; i < m_nEntries; i++) {
+        if(!getLockTimes(i, Times) || !Times.llCount)
+            continue;
+        snprintf(szLine, sizeof(szLine), "%s : %lld locks, wait p50 %lldus, p99 %lldus, max %lldus, held p50 %lldus, p99 %lldus, max %lldus\n",
+                 Times.pszName, Times.llCount, Times.llWaitP50Us, Times.llWaitP99Us, Times.llWaitMaxUs,
+                 Times.llHoldP50Us, Times.llHoldP99Us, Times.llHoldMaxUs);
+        sReport += szLine;
+    }
+}
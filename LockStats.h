@@ -0,0 +1,88 @@
+//
+//  LockStats.h
+//
+//  SmartFocus X2 plugin
+//  Host I/O mutex timing per X2 entry point : how long each call waited for
+//  the mutex and how long it then held it, to find the calls that keep the
+//  host UI threads waiting. Same log bucketed histograms as CLinkStats.
+//
+
+#ifndef __LOCK_STATS__
+#define __LOCK_STATS__
+
+#include <string>
+#include <mutex>
+
+#include "LinkStats.h"
+#include "StopWatch.h"
+
+#define LOCK_STATS_MAX_ENTRIES  16
+
+typedef struct {
+    const char      *pszName;
+    long long       llCount;
+    long long       llWaitP50Us;
+    long long       llWaitP99Us;
+    long long       llWaitMaxUs;
+    long long       llHoldP50Us;
+    long long       llHoldP99Us;
+    long long       llHoldMaxUs;
+} LockTimes;
+
+class CLockStats
+{
+public:
+    // entry points are indexes into ppszNames, which must outlive the stats.
+    CLockStats(const char * const *ppszNames, int nEntries);
+
+    void        reset();
+
+    void        locked(int nEntry, long long llWaitUs, long long llHoldUs);
+    bool        getLockTimes(int nEntry, LockTimes &Times);
+
+    // one line per entry point that took the lock
+    void        report(std::string &sReport);
+
+protected:
+    typedef struct {
+        long long       llWaitBuckets[STATS_BUCKETS];
+        long long       llHoldBuckets[STATS_BUCKETS];
+        long long       llCount;
+        long long       llWaitMaxUs;
+        long long       llHoldMaxUs;
+    } Entry;
+
+    std::mutex          m_Lock;
+    const char * const  *m_ppszNames;
+    int                 m_nEntries;
+    Entry               m_Entries[LOCK_STATS_MAX_ENTRIES];
+};
+
+// X2MutexLocker that times itself, for any mutex with lock() and unlock().
+template <class Mutex>
+class CTimedLocker
+{
+public:
+    CTimedLocker(Mutex *pMutex, CLockStats &Stats, int nEntry) : m_pMutex(pMutex), m_Stats(Stats), m_nEntry(nEntry)
+    {
+        m_llStartNs = CStopWatch::NowNs();
+        if(m_pMutex)
+            m_pMutex->lock();
+        m_llLockedNs = CStopWatch::NowNs();
+    };
+    ~CTimedLocker()
+    {
+        if(m_pMutex)
+            m_pMutex->unlock();
+        m_Stats.locked(m_nEntry, (m_llLockedNs - m_llStartNs) / 1000, (CStopWatch::NowNs() - m_llLockedNs) / 1000);
+    };
+
+protected:
+    Mutex           *m_pMutex;
+    CLockStats      &m_Stats;
+    int             m_nEntry;
+    long long       m_llStartNs;
+    long long       m_llLockedNs;
+};
+
+#endif //__LOCK_STATS__
@@ -0,0 +1,251 @@
+//
+//  MotionModel.cpp
+//
+//  SmartFocus X2 plugin
+//
+
+#include "MotionModel.h"
+#include <stdlib.h>
+#include <string.h>
+#include <math.h>
+
+CMotionModel::CMotionModel()
+{
+    m_llStartNs = 0;
+    m_nFrom = 0;
+    m_nTo = 0;
+    m_bActive = false;
+    setStepRate(DEFAULT_STEP_RATE);
+}
+
+void CMotionModel::start(int nFrom, int nTo)
+{
+    std::lock_guard<std::mutex> lock(m_Lock);
+
+    m_llStartNs = CStopWatch::NowNs();
+    m_nFrom = nFrom;
+    m_nTo = nTo;
+    m_bActive = true;
+}
+
+// called when the 'c' arrives, the move is a new sample for its direction.
+void CMotionModel::complete()
+{
+    std::lock_guard<std::mutex> lock(m_Lock);
+    double dSeconds;
+    int nSteps;
+
+    if(!m_bActive)
+        return;
+    m_bActive = false;
+
+    nSteps = abs(m_nTo - m_nFrom);
+    dSeconds = (CStopWatch::NowNs() - m_llStartNs) * 1e-9;
+    if(nSteps < MIN_CALIBRATION_STEPS || dSeconds <= 0)
+        return;
+
+    addSampleLocked(m_nTo > m_nFrom, nSteps, dSeconds);
+}
+
+// halted or refused move, the estimate is frozen where it is and not used for calibration.
+void CMotionModel::abort()
+{
+    std::lock_guard<std::mutex> lock(m_Lock);
+
+    if(!m_bActive)
+        return;
+    m_nFrom = m_nTo = estimateLocked();
+    m_bActive = false;
+}
+
+int CMotionModel::estimate()
+{
+    std::lock_guard<std::mutex> lock(m_Lock);
+
+    if(!m_bActive)
+        return m_nTo;
+    return estimateLocked();
+}
+
+bool CMotionModel::isActive()
+{
+    std::lock_guard<std::mutex> lock(m_Lock);
+    return m_bActive;
+}
+
+double CMotionModel::predictSeconds(int nFrom, int nTo)
+{
+    std::lock_guard<std::mutex> lock(m_Lock);
+
+    return durationOf(profileLocked(nTo > nFrom), abs(nTo - nFrom));
+}
+
+long long CMotionModel::getEtaNs()
+{
+    std::lock_guard<std::mutex> lock(m_Lock);
+
+    if(!m_bActive)
+        return 0;
+    return m_llStartNs + (long long)(durationOf(profileLocked(m_nTo > m_nFrom), abs(m_nTo - m_nFrom)) * 1e9);
+}
+
+int CMotionModel::getRemainingMs()
+{
+    long long llEtaNs = getEtaNs();
+    long long llNowNs = CStopWatch::NowNs();
+
+    if(!llEtaNs || llEtaNs <= llNowNs)
+        return 0;
+    return int((llEtaNs - llNowNs) / 1000000);
+}
+
+void CMotionModel::getProfile(bool bOutward, MotionProfile &Profile)
+{
+    std::lock_guard<std::mutex> lock(m_Lock);
+
+    Profile = profileLocked(bOutward);
+}
+
+int CMotionModel::getSamples(bool bOutward, MoveSample *pSamples, int nMaxCount)
+{
+    std::lock_guard<std::mutex> lock(m_Lock);
+    const DirectionFit &Fit = m_Fits[bOutward ? 1 : 0];
+    int nFirst;
+    int nCount;
+
+    nCount = Fit.nSamples < nMaxCount ? Fit.nSamples : nMaxCount;
+    // the most recent ones when they don't all fit.
+    nFirst = (Fit.nNext - nCount + MOTION_SAMPLES) % MOTION_SAMPLES;
+    for(int i = 0; i < nCount; i++)
+        pSamples[i] = Fit.Samples[(nFirst + i) % MOTION_SAMPLES];
+    return nCount;
+}
+
+void CMotionModel::addSample(bool bOutward, int nSteps, double dSeconds)
+{
+    std::lock_guard<std::mutex> lock(m_Lock);
+
+    if(nSteps < MIN_CALIBRATION_STEPS || dSeconds <= 0)
+        return;
+    addSampleLocked(bOutward, nSteps, dSeconds);
+}
+
+// of the direction with the most samples.
+double CMotionModel::getStepRate()
+{
+    std::lock_guard<std::mutex> lock(m_Lock);
+
+    return profileLocked(m_Fits[1].nSamples >= m_Fits[0].nSamples).dStepsPerSecond;
+}
+
+void CMotionModel::setStepRate(double dStepsPerSecond)
+{
+    std::lock_guard<std::mutex> lock(m_Lock);
+
+    if(dStepsPerSecond <= 0)
+        return;
+    memset(m_Fits, 0, sizeof(m_Fits));
+    for(int i = 0; i < 2; i++)
+        m_Fits[i].Profile.dStepsPerSecond = dStepsPerSecond;
+}
+
+// never runs past the target, the move may be slower than predicted.
+int CMotionModel::estimateLocked()
+{
+    double dSeconds = (CStopWatch::NowNs() - m_llStartNs) * 1e-9;
+    int nDistance = abs(m_nTo - m_nFrom);
+    int nTravelled = int(travelledAt(profileLocked(m_nTo > m_nFrom), nDistance, dSeconds));
+
+    if(nTravelled >= nDistance)
+        return m_nTo;
+    return (m_nTo > m_nFrom) ? m_nFrom + nTravelled : m_nFrom - nTravelled;
+}
+
+void CMotionModel::addSampleLocked(bool bOutward, int nSteps, double dSeconds)
+{
+    DirectionFit &Fit = m_Fits[bOutward ? 1 : 0];
+
+    Fit.Samples[Fit.nNext].nSteps = nSteps;
+    Fit.Samples[Fit.nNext].dSeconds = dSeconds;
+    Fit.nNext = (Fit.nNext + 1) % MOTION_SAMPLES;
+    if(Fit.nSamples < MOTION_SAMPLES)
+        Fit.nSamples++;
+    fitLocked(Fit);
+}
+
+// duration = steps / rate + ramp. one sample, or all of the same length, only gives the rate.
+void CMotionModel::fitLocked(DirectionFit &Fit)
+{
+    double dMeanSteps = 0;
+    double dMeanSeconds = 0;
+    double dCov = 0;
+    double dVar = 0;
+    double dSlope;
+    double dRamp;
+    int i;
+
+    for(i = 0; i < Fit.nSamples; i++) {
+        dMeanSteps += Fit.Samples[i].nSteps;
+        dMeanSeconds += Fit.Samples[i].dSeconds;
+    }
+    dMeanSteps /= Fit.nSamples;
+    dMeanSeconds /= Fit.nSamples;
+    for(i = 0; i < Fit.nSamples; i++) {
+        dCov += (Fit.Samples[i].nSteps - dMeanSteps) * (Fit.Samples[i].dSeconds - dMeanSeconds);
+        dVar += (Fit.Samples[i].nSteps - dMeanSteps) * (Fit.Samples[i].nSteps - dMeanSteps);
+    }
+
+    Fit.Profile.nSamples = Fit.nSamples;
+    if(dVar >= MIN_CALIBRATION_STEPS * MIN_CALIBRATION_STEPS && dCov > 0) {
+        dSlope = dCov / dVar;
+        dRamp = dMeanSeconds - dSlope * dMeanSteps;
+        if(dRamp >= 0) {
+            Fit.Profile.dStepsPerSecond = 1.0 / dSlope;
+            Fit.Profile.dRampSeconds = dRamp;
+            return;
+        }
+    }
+    Fit.Profile.dStepsPerSecond = dMeanSteps / dMeanSeconds;
+    Fit.Profile.dRampSeconds = 0;
+}
+
+// a direction never calibrated borrows the other one's profile.
+const MotionProfile &CMotionModel::profileLocked(bool bOutward)
+{
+    const DirectionFit &Fit = m_Fits[bOutward ? 1 : 0];
+
+    if(!Fit.nSamples && m_Fits[bOutward ? 0 : 1].nSamples)
+        return m_Fits[bOutward ? 0 : 1].Profile;
+    return Fit.Profile;
+}
+
+double CMotionModel::durationOf(const MotionProfile &Profile, int nSteps)
+{
+    double dCruise = nSteps / Profile.dStepsPerSecond;
+
+    // too short to get to full speed, a triangle.
+    if(dCruise < Profile.dRampSeconds)
+        return 2.0 * sqrt(dCruise * Profile.dRampSeconds);
+    return dCruise + Profile.dRampSeconds;
+}
+
+// steps done dSeconds into the move : ramp up, cruise, ramp down.
+double CMotionModel::travelledAt(const MotionProfile &Profile, int nSteps, double dSeconds)
+{
+    double dTotal = durationOf(Profile, nSteps);
+    double dAccel;
+    double dRamp;
+
+    if(dSeconds >= dTotal)
+        return nSteps;
+    if(Profile.dRampSeconds <= 0)
+        return dSeconds * Profile.dStepsPerSecond;
+
+    dAccel = Profile.dStepsPerSecond / Profile.dRampSeconds;
+    dRamp = Profile.dRampSeconds < dTotal / 2 ? Profile.dRampSeconds : dTotal / 2;
+    if(dSeconds < dRamp)
+        return dAccel * dSeconds * dSeconds / 2;
+    if(dSeconds > dTotal - dRamp)
+        return nSteps - dAccel * (dTotal - dSeconds) * (dTotal - dSeconds) / 2;
+    return dAccel * dRamp * dRamp / 2 + Profile.dStepsPerSecond * (dSeconds - dRamp);
+}
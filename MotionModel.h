@@ -0,0 +1,89 @@
+//
+//  MotionModel.h
+//
+//  SmartFocus X2 plugin
+//  Estimates the focuser position while a move is in progress, and when it will
+//  end, from the move start time, start position, target and a motion profile
+//  fitted on completed moves.
+//
+//  The profile is a trapezoid per direction : the motor ramps up for
+//  dRampSeconds, runs at dStepsPerSecond and ramps down as long, so a move of
+//  d steps takes d / dStepsPerSecond + dRampSeconds (or 2 * sqrt(d * dRampSeconds
+//  / dStepsPerSecond) when too short to reach full speed). Both are a least
+//  squares fit of duration against distance over the last MOTION_SAMPLES moves.
+//  The time from the 'g' to the 'c' is what's measured, the serial latency ends
+//  up in the ramp time.
+//
+
+#ifndef __MOTION_MODEL__
+#define __MOTION_MODEL__
+
+#include <mutex>
+
+#include "StopWatch.h"
+
+#define DEFAULT_STEP_RATE       500.0   // steps per second until the first move is calibrated
+#define MIN_CALIBRATION_STEPS   50      // shorter moves never reach full speed, they'd bend the fit
+#define MOTION_SAMPLES          32      // completed moves per direction the profile is fitted on
+
+typedef struct {
+    int         nSteps;
+    double      dSeconds;       // from the 'g' to the 'c'
+} MoveSample;
+
+typedef struct {
+    double      dStepsPerSecond;
+    double      dRampSeconds;
+    int         nSamples;       // moves it was fitted on, 0 for the default
+} MotionProfile;
+
+class CMotionModel
+{
+public:
+    CMotionModel();
+
+    void        start(int nFrom, int nTo);
+    void        complete();
+    void        abort();
+    int         estimate();
+    bool        isActive();
+
+    // predicted duration of a move, in s
+    double      predictSeconds(int nFrom, int nTo);
+    // CStopWatch::NowNs() time the running move should end, 0 when there's none
+    long long   getEtaNs();
+    // ms to go until then, 0 when past it or idle
+    int         getRemainingMs();
+
+    void        getProfile(bool bOutward, MotionProfile &Profile);
+    // the samples behind a profile, oldest first, to carry them over to the next session
+    int         getSamples(bool bOutward, MoveSample *pSamples, int nMaxCount);
+    void        addSample(bool bOutward, int nSteps, double dSeconds);
+    double      getStepRate();
+    // forgets the fitted profiles
+    void        setStepRate(double dStepsPerSecond);
+
+protected:
+    typedef struct {
+        MoveSample  Samples[MOTION_SAMPLES];
+        int         nSamples;
+        int         nNext;
+        MotionProfile   Profile;
+    } DirectionFit;
+
+    int         estimateLocked();
+    void        addSampleLocked(bool bOutward, int nSteps, double dSeconds);
+    void        fitLocked(DirectionFit &Fit);
+    const MotionProfile &profileLocked(bool bOutward);
+    static double   durationOf(const MotionProfile &Profile, int nSteps);
+    static double   travelledAt(const MotionProfile &Profile, int nSteps, double dSeconds);
+
+    std::mutex          m_Lock;
+    long long           m_llStartNs;    // CStopWatch::NowNs() when the move started
+    int                 m_nFrom;
+    int                 m_nTo;
+    bool                m_bActive;
+    DirectionFit        m_Fits[2];      // inward, outward
+};
+
+#endif //__MOTION_MODEL__
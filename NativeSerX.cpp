@@ -0,0 +1,303 @@
+//
+//  NativeSerX.cpp
+//
+//  SmartFocus X2 plugin
+//
+
+#include "NativeSerX.h"
+
+#ifndef SB_WIN_BUILD
+
+#include "StopWatch.h"
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <unistd.h>
+#include <sys/ioctl.h>
+#ifdef SB_LINUX_BUILD
+#include <linux/serial.h>
+#endif
+
+#include "../../licensedinterfaces/sberrorx.h"
+
+CNativeSerX::CNativeSerX()
+{
+    m_nFd = -1;
+    memset(&m_SavedTermios, 0, sizeof(m_SavedTermios));
+    m_nSavedSerialFlags = -1;
+    m_bLowLatency = false;
+}
+
+CNativeSerX::~CNativeSerX()
+{
+    close();
+}
+
+#pragma mark SerXInterface
+
+int CNativeSerX::open(const char* pszPort, const unsigned long& dwBaudRate, const Parity& parity, const char* pszSession)
+{
+    struct termios Termios;
+    speed_t nSpeed;
+    const char *pszDtr;
+    int nModemBits = TIOCM_DTR;
+
+    if(m_nFd >= 0)
+        return ERR_COMMOPENING;
+    nSpeed = speedFor(dwBaudRate);
+    if(nSpeed == B0)
+        return ERR_COMMSETTINGS;
+
+    // non blocking so the open doesn't wait for carrier detect.
+    m_nFd = ::open(pszPort, O_RDWR | O_NOCTTY | O_NONBLOCK | O_CLOEXEC);
+    if(m_nFd < 0)
+        return ERR_COMMOPENING;
+    // the host SerX also keeps other programs off an open port.
+    if(ioctl(m_nFd, TIOCEXCL) < 0 || tcgetattr(m_nFd, &m_SavedTermios) < 0) {
+        ::close(m_nFd);
+        m_nFd = -1;
+        return ERR_COMMOPENING;
+    }
+
+    Termios = m_SavedTermios;
+    cfmakeraw(&Termios);
+    cfsetispeed(&Termios, nSpeed);
+    cfsetospeed(&Termios, nSpeed);
+    Termios.c_cflag |= CLOCAL | CREAD;
+    Termios.c_cflag &= ~(CSTOPB | CRTSCTS | PARENB | PARODD);
+    switch(parity) {
+        case B_NOPARITY:
+            break;
+        case B_ODDPARITY:
+            Termios.c_cflag |= PARENB | PARODD;
+            break;
+        case B_EVENPARITY:
+            Termios.c_cflag |= PARENB;
+            break;
+        default:
+            // mark and space parity aren't portable, nothing we talk to uses them.
+            close();
+            return ERR_COMMSETTINGS;
+    }
+    // reads return what is there, poll() keeps the deadlines.
+    Termios.c_cc[VMIN] = 0;
+    Termios.c_cc[VTIME] = 0;
+    if(tcsetattr(m_nFd, TCSANOW, &Termios) < 0) {
+        close();
+        return ERR_COMMSETTINGS;
+    }
+
+    // same session string as the host SerX, "-DTR_CONTROL 0" keeps DTR low.
+    if(pszSession && (pszDtr = strstr(pszSession, "-DTR_CONTROL")) && !atoi(pszDtr + strlen("-DTR_CONTROL")))
+        ioctl(m_nFd, TIOCMBIC, &nModemBits);
+    else
+        ioctl(m_nFd, TIOCMBIS, &nModemBits);
+
+    setLowLatency();
+    tcflush(m_nFd, TCIOFLUSH);
+    return SB_OK;
+}
+
+int CNativeSerX::close()
+{
+    if(m_nFd < 0)
+        return SB_OK;
+    restoreSerialFlags();
+    tcsetattr(m_nFd, TCSANOW, &m_SavedTermios);
+    ::close(m_nFd);
+    m_nFd = -1;
+    return SB_OK;
+}
+
+bool CNativeSerX::isConnected(void) const
+{
+    return m_nFd >= 0;
+}
+
+int CNativeSerX::flushTx(void)
+{
+    if(m_nFd < 0)
+        return ERR_COMMNOLINK;
+    return tcdrain(m_nFd) < 0 ? ERR_COMMNOLINK : SB_OK;
+}
+
+int CNativeSerX::purgeTxRx(void)
+{
+    if(m_nFd < 0)
+        return ERR_COMMNOLINK;
+    return tcflush(m_nFd, TCIOFLUSH) < 0 ? ERR_COMMNOLINK : SB_OK;
+}
+
+int CNativeSerX::waitForBytesRx(const int& nNumber, const int& nTimeOutMs)
+{
+    long long llDeadlineNs = CStopWatch::NowNs() + nTimeOutMs * 1000000LL;
+    long long llLeftNs;
+    int nWaiting;
+    int nErr;
+
+    while(true) {
+        nWaiting = bytesWaitingRx();
+        if(nWaiting >= nNumber)
+            return SB_OK;
+        llLeftNs = llDeadlineNs - CStopWatch::NowNs();
+        if(llLeftNs <= 0)
+            return ERR_RXTIMEOUT;
+        // poll() stays readable once a byte is in, the rest comes about a byte per ms.
+        if(nWaiting > 0) {
+            usleep(1000);
+            continue;
+        }
+        nErr = waitFd(POLLIN, int((llLeftNs + 999999) / 1000000));
+        if(nErr && nErr != ERR_RXTIMEOUT)
+            return nErr;
+    }
+}
+
+// short read on timeout, like the host SerX.
+int CNativeSerX::readFile(void* lpBuffer, const unsigned long dwTotalBytesToRead, unsigned long& dwBytesRead, const unsigned long& dwTimeOut)
+{
+    unsigned char *pBuffer = (unsigned char *)lpBuffer;
+    long long llDeadlineNs = CStopWatch::NowNs() + (long long)dwTimeOut * 1000000LL;
+    long long llLeftNs;
+    ssize_t nRead;
+    bool bReadable = false;
+    int nErr;
+
+    dwBytesRead = 0;
+    if(m_nFd < 0)
+        return ERR_COMMNOLINK;
+    while(dwBytesRead < dwTotalBytesToRead) {
+        nRead = ::read(m_nFd, pBuffer + dwBytesRead, dwTotalBytesToRead - dwBytesRead);
+        if(nRead > 0) {
+            dwBytesRead += (unsigned long)nRead;
+            continue;
+        }
+        // with VMIN = VTIME = 0 an empty port reads 0 rather than EAGAIN, after
+        // poll() said readable it is a hang up.
+        if(nRead < 0 ? errno != EAGAIN && errno != EINTR : bReadable)
+            return ERR_COMMNOLINK;
+        llLeftNs = llDeadlineNs - CStopWatch::NowNs();
+        if(llLeftNs <= 0)
+            break;
+        nErr = waitFd(POLLIN, int((llLeftNs + 999999) / 1000000));
+        if(nErr == ERR_RXTIMEOUT)
+            break;
+        if(nErr)
+            return nErr;
+        bReadable = true;
+    }
+    return SB_OK;
+}
+
+int CNativeSerX::writeFile(void* lpBuffer, const unsigned long& dwBytesToWrite, unsigned long& dwBytesWritten)
+{
+    const unsigned char *pBuffer = (const unsigned char *)lpBuffer;
+    ssize_t nWritten;
+    int nErr;
+
+    dwBytesWritten = 0;
+    if(m_nFd < 0)
+        return ERR_COMMNOLINK;
+    while(dwBytesWritten < dwBytesToWrite) {
+        nWritten = ::write(m_nFd, pBuffer + dwBytesWritten, dwBytesToWrite - dwBytesWritten);
+        if(nWritten > 0) {
+            dwBytesWritten += (unsigned long)nWritten;
+            continue;
+        }
+        if(nWritten < 0 && errno != EAGAIN && errno != EINTR)
+            return ERR_COMMNOLINK;
+        // the output buffer is full, a few bytes at 9600 baud never should.
+        nErr = waitFd(POLLOUT, NATIVE_TX_TIMEOUT);
+        if(nErr)
+            return nErr == ERR_RXTIMEOUT ? ERR_TXTIMEOUT : nErr;
+    }
+    return SB_OK;
+}
+
+int CNativeSerX::bytesWaitingRx(void)
+{
+    int nWaiting = 0;
+
+    if(m_nFd < 0 || ioctl(m_nFd, FIONREAD, &nWaiting) < 0)
+        return 0;
+    return nWaiting;
+}
+
+#pragma mark helpers
+
+speed_t CNativeSerX::speedFor(unsigned long dwBaudRate)
+{
+    switch(dwBaudRate) {
+        case 1200:      return B1200;
+        case 2400:      return B2400;
+        case 4800:      return B4800;
+        case 9600:      return B9600;
+        case 19200:     return B19200;
+        case 38400:     return B38400;
+        case 57600:     return B57600;
+        case 115200:    return B115200;
+        case 230400:    return B230400;
+        default:        return B0;
+    }
+}
+
+// SB_OK once nEvents is set, ERR_RXTIMEOUT on timeout, ERR_COMMNOLINK when the adapter went away.
+int CNativeSerX::waitFd(short nEvents, int nTimeoutMs)
+{
+    struct pollfd Poll;
+    int nReady;
+
+    Poll.fd = m_nFd;
+    Poll.events = nEvents;
+    Poll.revents = 0;
+    do {
+        nReady = poll(&Poll, 1, nTimeoutMs);
+    } while(nReady < 0 && errno == EINTR);
+    if(nReady < 0)
+        return ERR_COMMNOLINK;
+    if(nReady == 0)
+        return ERR_RXTIMEOUT;
+    if(Poll.revents & nEvents)
+        return SB_OK;
+    return ERR_COMMNOLINK;  // POLLHUP, POLLERR or POLLNVAL alone
+}
+
+// ASYNC_LOW_LATENCY, restored on close. not every tty driver has it, a pty or a
+// CDC ACM port doesn't need it anyway.
+void CNativeSerX::setLowLatency()
+{
+    m_bLowLatency = false;
+    m_nSavedSerialFlags = -1;
+#ifdef SB_LINUX_BUILD
+    struct serial_struct Serial;
+
+    if(ioctl(m_nFd, TIOCGSERIAL, &Serial) < 0)
+        return;
+    m_nSavedSerialFlags = Serial.flags;
+    if(Serial.flags & ASYNC_LOW_LATENCY) {
+        m_bLowLatency = true;
+        return;
+    }
+    Serial.flags |= ASYNC_LOW_LATENCY;
+    m_bLowLatency = ioctl(m_nFd, TIOCSSERIAL, &Serial) == 0;
+#endif
+}
+
+void CNativeSerX::restoreSerialFlags()
+{
+#ifdef SB_LINUX_BUILD
+    struct serial_struct Serial;
+
+    if(m_nSavedSerialFlags < 0 || m_nSavedSerialFlags & ASYNC_LOW_LATENCY)
+        return;
+    if(ioctl(m_nFd, TIOCGSERIAL, &Serial) < 0)
+        return;
+    Serial.flags = m_nSavedSerialFlags;
+    ioctl(m_nFd, TIOCSSERIAL, &Serial);
+#endif
+    m_nSavedSerialFlags = -1;
+}
+
+#endif // SB_WIN_BUILD
@@ -0,0 +1,69 @@
+//
+//  NativeSerX.h
+//
+//  SmartFocus X2 plugin
+//  SerXInterface on a termios file descriptor, used instead of the host's SerX
+//  when NativeSerial is set in the ini or SMARTFOCUS_NATIVE_SERIAL in the
+//  environment. The port is put in raw mode with VMIN = VTIME = 0 so a read
+//  never waits in the tty layer, deadlines are kept with poll() to the
+//  millisecond instead of VTIME's 100 ms units. On Linux the driver's low
+//  latency flag is set, ftdi_sio then drops the adapter's latency timer from
+//  16 ms to 1 ms, which was most of every command round trip.
+//
+//  The descriptor is handed to CIOMultiplexer (CIOFdSource), replies are
+//  waited on with epoll instead of being polled.
+//
+//  POSIX only, Windows always goes through the host's SerX.
+//
+
+#ifndef __NATIVE_SERX__
+#define __NATIVE_SERX__
+
+#ifndef SB_WIN_BUILD
+
+#include <termios.h>
+
+#include "../../licensedinterfaces/serxinterface.h"
+
+#include "IOMultiplexer.h"
+
+#define NATIVE_TX_TIMEOUT   1000    // ms for the adapter to take a write
+
+class CNativeSerX : public SerXInterface, public CIOFdSource
+{
+public:
+    CNativeSerX();
+    virtual ~CNativeSerX();
+
+    // SerXInterface
+    virtual int     open(const char* pszPort, const unsigned long& dwBaudRate = 9600, const Parity& parity = B_NOPARITY, const char* pszSession = 0);
+    virtual int     close();
+    virtual bool    isConnected(void) const;
+    virtual int     flushTx(void);
+    virtual int     purgeTxRx(void);
+    virtual int     waitForBytesRx(const int& nNumber, const int& nTimeOutMs);
+    virtual int     readFile(void* lpBuffer, const unsigned long dwTotalBytesToRead, unsigned long& dwBytesRead, const unsigned long& dwTimeOut = 1000);
+    virtual int     writeFile(void* lpBuffer, const unsigned long& dwBytesToWrite, unsigned long& dwBytesWritten);
+    virtual int     bytesWaitingRx(void);
+
+    // CIOFdSource
+    virtual int     getFd() { return m_nFd; };
+
+    // the low latency flag was accepted by the tty driver
+    bool            isLowLatency() { return m_bLowLatency; };
+
+protected:
+    speed_t         speedFor(unsigned long dwBaudRate);
+    int             waitFd(short nEvents, int nTimeoutMs);
+    void            setLowLatency();
+    void            restoreSerialFlags();
+
+    int             m_nFd;
+    struct termios  m_SavedTermios;     // restored on close
+    int             m_nSavedSerialFlags;
+    bool            m_bLowLatency;
+};
+
+#endif // SB_WIN_BUILD
+
+#endif //__NATIVE_SERX__
@@ -0,0 +1,181 @@
+//
+//  ProtocolTrace.cpp
+//
+//  SmartFocus X2 plugin
+//
+
+#include "ProtocolTrace.h"
+#include <string.h>
+#include <chrono>
+
+#define TRACE_MAX_RECORD_HEADER 21  // type + 2 varints
+
+CProtocolTrace::CProtocolTrace()
+{
+    m_bActive = false;
+    m_pTraceFile = NULL;
+    m_llLastNs = 0;
+    m_nBufferLen = 0;
+}
+
+CProtocolTrace::~CProtocolTrace()
+{
+    stop();
+}
+
+// appends to pszPath, the magic is only written to a new file.
+int CProtocolTrace::start(const char *pszPath)
+{
+    std::lock_guard<std::mutex> lock(m_Lock);
+
+    if(m_pTraceFile)
+        return 0;
+    m_pTraceFile = fopen(pszPath, "ab");
+    if(!m_pTraceFile)
+        return -1;
+    fseek(m_pTraceFile, 0, SEEK_END);
+    if(ftell(m_pTraceFile) == 0)
+        fwrite(TRACE_MAGIC, 1, TRACE_MAGIC_SIZE, m_pTraceFile);
+    m_nBufferLen = 0;
+    m_bActive = true;
+    return 0;
+}
+
+void CProtocolTrace::stop()
+{
+    std::lock_guard<std::mutex> lock(m_Lock);
+
+    m_bActive = false;
+    if(!m_pTraceFile)
+        return;
+    flushLocked();
+    fclose(m_pTraceFile);
+    m_pTraceFile = NULL;
+}
+
+void CProtocolTrace::openSession(const char *pszPort)
+{
+    std::lock_guard<std::mutex> lock(m_Lock);
+    unsigned char szData[TRACE_BUFFER_SIZE / 4];
+    long long llWallUs;
+    int nPortLen;
+    int i;
+
+    if(!m_pTraceFile)
+        return;
+    llWallUs = std::chrono::duration_cast<std::chrono::microseconds>(std::chrono::system_clock::now().time_since_epoch()).count();
+    for(i = 0; i < 8; i++)
+        szData[i] = (unsigned char)(llWallUs >> (8 * i));
+    nPortLen = pszPort ? (int)strnlen(pszPort, sizeof(szData) - 8) : 0;
+    if(nPortLen)
+        memcpy(szData + 8, pszPort, nPortLen);
+    m_llLastNs = CStopWatch::NowNs();
+    recordLocked(TRACE_OPEN, szData, 8 + nPortLen);
+}
+
+// the session is flushed so a closed session is always complete on disk.
+void CProtocolTrace::closeSession()
+{
+    std::lock_guard<std::mutex> lock(m_Lock);
+
+    if(!m_pTraceFile)
+        return;
+    recordLocked(TRACE_CLOSE, NULL, 0);
+    flushLocked();
+    fflush(m_pTraceFile);
+}
+
+void CProtocolTrace::record(int nType, const unsigned char *pData, int nLen)
+{
+    if(!m_bActive)
+        return;
+    std::lock_guard<std::mutex> lock(m_Lock);
+    if(m_pTraceFile)
+        recordLocked(nType, pData, nLen);
+}
+
+void CProtocolTrace::recordLocked(int nType, const unsigned char *pData, int nLen)
+{
+    long long llNowNs = CStopWatch::NowNs();
+
+    if(nLen > TRACE_BUFFER_SIZE - TRACE_MAX_RECORD_HEADER)
+        nLen = TRACE_BUFFER_SIZE - TRACE_MAX_RECORD_HEADER;
+    if(m_nBufferLen + TRACE_MAX_RECORD_HEADER + nLen > TRACE_BUFFER_SIZE)
+        flushLocked();
+
+    m_Buffer[m_nBufferLen++] = (unsigned char)nType;
+    putVarint(nType == TRACE_OPEN ? 0 : (unsigned long long)(llNowNs - m_llLastNs));
+    putVarint(nLen);
+    if(nLen)
+        memcpy(m_Buffer + m_nBufferLen, pData, nLen);
+    m_nBufferLen += nLen;
+    m_llLastNs = llNowNs;
+}
+
+// LEB128, 7 bits per byte, so most time deltas take 2 to 4 bytes.
+void CProtocolTrace::putVarint(unsigned long long ullVal)
+{
+    while(ullVal >= 0x80) {
+        m_Buffer[m_nBufferLen++] = (unsigned char)(ullVal | 0x80);
+        ullVal >>= 7;
+    }
+    m_Buffer[m_nBufferLen++] = (unsigned char)ullVal;
+}
+
+void CProtocolTrace::flushLocked()
+{
+    if(m_nBufferLen && m_pTraceFile)
+        fwrite(m_Buffer, 1, m_nBufferLen, m_pTraceFile);
+    m_nBufferLen = 0;
+}
+
+static bool getVarint(FILE *pFile, unsigned long long &ullVal)
+{
+    int nByte;
+    int nShift = 0;
+
+    ullVal = 0;
+    do {
+        nByte = fgetc(pFile);
+        if(nByte == EOF || nShift > 63)
+            return false;
+        ullVal |= (unsigned long long)(nByte & 0x7f) << nShift;
+        nShift += 7;
+    } while(nByte & 0x80);
+    return true;
+}
+
+// reads every complete record, a record cut short at the end of the file is ignored.
+int CProtocolTrace::load(const char *pszPath, std::vector<TraceRecord> &Records)
+{
+    FILE *pFile;
+    char szMagic[TRACE_MAGIC_SIZE];
+    TraceRecord Record;
+    unsigned long long ullDeltaNs;
+    unsigned long long ullLen;
+    long long llTimeNs = 0;
+    int nType;
+
+    Records.clear();
+    pFile = fopen(pszPath, "rb");
+    if(!pFile)
+        return -1;
+    if(fread(szMagic, 1, TRACE_MAGIC_SIZE, pFile) != TRACE_MAGIC_SIZE || memcmp(szMagic, TRACE_MAGIC, TRACE_MAGIC_SIZE)) {
+        fclose(pFile);
+        return -2;
+    }
+
+    while((nType = fgetc(pFile)) != EOF) {
+        if(!getVarint(pFile, ullDeltaNs) || !getVarint(pFile, ullLen) || ullLen > TRACE_BUFFER_SIZE)
+            break;
+        Record.nType = nType;
+        Record.Data.resize((size_t)ullLen);
+        if(ullLen && fread(Record.Data.data(), 1, (size_t)ullLen, pFile) != ullLen)
+            break;
+        llTimeNs = (nType == TRACE_OPEN) ? 0 : llTimeNs + (long long)ullDeltaNs;
+        Record.llTimeNs = llTimeNs;
+        Records.push_back(Record);
+    }
+    fclose(pFile);
+    return 0;
+}
@@ -0,0 +1,71 @@
+//
+//  ProtocolTrace.h
+//
+//  SmartFocus X2 plugin
+//  Binary capture of everything sent to and received from the controller, with
+//  monotonic time stamps, so field sessions can be replayed offline (see
+//  tools/sfreplay).
+//
+//  File layout : TRACE_MAGIC, then records appended one after the other
+//      u8      record type (TRACE_OPEN, TRACE_CLOSE, TRACE_TX, TRACE_RX)
+//      varint  ns since the previous record of the session (0 for TRACE_OPEN)
+//      varint  data length
+//      data    the bytes on the wire, for TRACE_OPEN the wall clock in us (8 bytes LE) + port name
+//  A file can hold several sessions, each one starts with a TRACE_OPEN record.
+//
+
+#ifndef __PROTOCOL_TRACE__
+#define __PROTOCOL_TRACE__
+
+#include <stdio.h>
+#include <string>
+#include <vector>
+#include <atomic>
+#include <mutex>
+
+#include "StopWatch.h"
+
+#define TRACE_MAGIC         "SFTRACE1"
+#define TRACE_MAGIC_SIZE    8
+#define TRACE_BUFFER_SIZE   4096    // records are written to the file when this fills up or on close
+
+enum TraceRecordType {TRACE_OPEN = 'O', TRACE_CLOSE = 'C', TRACE_TX = 'T', TRACE_RX = 'R'};
+
+typedef struct {
+    int                         nType;      // TraceRecordType
+    long long                   llTimeNs;   // since the TRACE_OPEN of the session
+    std::vector<unsigned char>  Data;
+} TraceRecord;
+
+class CProtocolTrace
+{
+public:
+    CProtocolTrace();
+    ~CProtocolTrace();
+
+    int         start(const char *pszPath);
+    void        stop();
+    bool        isActive() { return m_bActive; };
+
+    // session markers, one per Connect / Disconnect
+    void        openSession(const char *pszPort);
+    void        closeSession();
+
+    void        record(int nType, const unsigned char *pData, int nLen);
+
+    static int  load(const char *pszPath, std::vector<TraceRecord> &Records);
+
+protected:
+    void        recordLocked(int nType, const unsigned char *pData, int nLen);
+    void        putVarint(unsigned long long ullVal);
+    void        flushLocked();
+
+    std::atomic<bool>   m_bActive;
+    std::mutex          m_Lock;
+    FILE                *m_pTraceFile;
+    long long           m_llLastNs;
+    unsigned char       m_Buffer[TRACE_BUFFER_SIZE];
+    int                 m_nBufferLen;
+};
+
+#endif //__PROTOCOL_TRACE__
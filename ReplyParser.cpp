@@ -0,0 +1,139 @@
+//
+//  ReplyParser.cpp
+//
+//  SmartFocus X2 plugin
+//
+
+#include "ReplyParser.h"
+#include <string.h>
+
+CReplyParser::CReplyParser()
+{
+    reset();
+}
+
+void CReplyParser::reset()
+{
+    m_nFrameLen = 0;
+    m_nFrameExpected = 0;
+    m_llLastByteUs = 0;
+}
+
+int CReplyParser::feed(unsigned char cByte, unsigned char cExpected, long long llNowUs, SFEvent *pEvents)
+{
+    int nEvents = 0;
+
+    if(isStale(llNowUs))
+        dropFrame(true, 0, pEvents, nEvents);
+    m_llLastByteUs = llNowUs;
+    parse(cByte, cExpected, pEvents, nEvents);
+    return nEvents;
+}
+
+int CReplyParser::flush(SFEvent *pEvents)
+{
+    int nEvents = 0;
+
+    if(m_nFrameLen)
+        dropFrame(true, 0, pEvents, nEvents);
+    return nEvents;
+}
+
+bool CReplyParser::isStale(long long llNowUs) const
+{
+    return m_nFrameLen && llNowUs - m_llLastByteUs > SF_FRAME_GAP_MS * 1000LL;
+}
+
+long long CReplyParser::getStaleUs() const
+{
+    return m_nFrameLen ? m_llLastByteUs + SF_FRAME_GAP_MS * 1000LL + 1 : 0;
+}
+
+#pragma mark state machine
+
+void CReplyParser::parse(unsigned char cByte, unsigned char cExpected, SFEvent *pEvents, int &nEvents)
+{
+    // the command it answered timed out, what's left of it is parsed again.
+    if(m_nFrameLen && m_szFrame[0] != cExpected)
+        dropFrame(false, cExpected, pEvents, nEvents);
+
+    if(!m_nFrameLen) {
+        hunt(cByte, cExpected, pEvents, nEvents);
+        return;
+    }
+
+    m_szFrame[m_nFrameLen++] = cByte;
+    if(m_nFrameLen < m_nFrameExpected)
+        return;
+    if(!payloadValid()) {
+        dropFrame(false, cExpected, pEvents, nEvents);
+        return;
+    }
+    addEvent(SF_EVENT_REPLY, m_szFrame, m_nFrameLen, pEvents, nEvents);
+    m_nFrameLen = 0;
+}
+
+// between replies : only the expected opcode starts one, 'c' and 'r' are move events.
+void CReplyParser::hunt(unsigned char cByte, unsigned char cExpected, SFEvent *pEvents, int &nEvents)
+{
+    if(cExpected && (cByte == cExpected || (cByte == SF_REFUSED && sfIsRefusable(cExpected)))) {
+        m_nFrameExpected = cByte == SF_REFUSED ? 1 : sfReplyLength(cExpected);
+        if(m_nFrameExpected <= 1) {
+            addEvent(SF_EVENT_REPLY, &cByte, 1, pEvents, nEvents);
+            return;
+        }
+        m_szFrame[0] = cByte;
+        m_nFrameLen = 1;
+        return;
+    }
+    switch(cByte) {
+        case 'c':
+            addEvent(SF_EVENT_COMPLETE, &cByte, 1, pEvents, nEvents);
+            break;
+        case 'r':
+            addEvent(SF_EVENT_MOVE_FAILED, &cByte, 1, pEvents, nEvents);
+            break;
+        default:
+            addEvent(SF_EVENT_NOISE, &cByte, 1, pEvents, nEvents);
+            break;
+    }
+}
+
+// a truncated reply is reported whole and its bytes go with it : a payload byte
+// parsed again could pass for a 'c' or an 'r'. only when the first byte was not
+// the start of a reply after all (resync) are the bytes that followed it parsed again.
+void CReplyParser::dropFrame(bool bTruncated, unsigned char cExpected, SFEvent *pEvents, int &nEvents)
+{
+    unsigned char szRest[MAX_REPLY_SIZE];
+    int nRest = m_nFrameLen - 1;
+
+    if(bTruncated) {
+        addEvent(SF_EVENT_TRUNCATED, m_szFrame, m_nFrameLen, pEvents, nEvents);
+        m_nFrameLen = 0;
+        return;
+    }
+    memcpy(szRest, m_szFrame + 1, nRest);
+    addEvent(SF_EVENT_RESYNC, m_szFrame, 1, pEvents, nEvents);
+    m_nFrameLen = 0;
+    for(int i = 0; i < nRest; i++)
+        parse(szRest[i], cExpected, pEvents, nEvents);
+}
+
+bool CReplyParser::payloadValid() const
+{
+    int nValue = 0;
+
+    for(int i = 1; i < m_nFrameLen; i++)
+        nValue = (nValue << 8) | m_szFrame[i];
+    return nValue <= sfMaxPayload(m_szFrame[0]);
+}
+
+void CReplyParser::addEvent(int nType, const unsigned char *pData, int nLen, SFEvent *pEvents, int &nEvents)
+{
+    if(nEvents >= SF_MAX_EVENTS)
+        return;
+    pEvents[nEvents].nType = nType;
+    memcpy(pEvents[nEvents].szFrame, pData, nLen);
+    pEvents[nEvents].nLen = nLen;
+    nEvents++;
+}
@@ -0,0 +1,68 @@
+//
+//  ReplyParser.h
+//
+//  SmartFocus X2 plugin
+//  State machine splitting the bytes from the controller into replies, move
+//  completions ('c'), move failures ('r') and noise. A reply is only started
+//  by the opcode of the oldest command waiting for one and has to end with a
+//  valid payload (SF_OPCODES). When it doesn't, or the reply was for a command
+//  that timed out, its first byte is dropped and the following ones are parsed
+//  again : a stray byte costs one byte time and the 'c' it hid is still seen,
+//  no purge needed.
+//
+//  A reply that stops half way for SF_FRAME_GAP_MS is given up as truncated,
+//  with the bytes it got : they are not parsed again.
+//
+//  Not thread safe, CSmartFocus calls it with m_RespLock held.
+//
+
+#ifndef __REPLY_PARSER__
+#define __REPLY_PARSER__
+
+#include "SmartFocusProtocol.h"
+
+#define SF_FRAME_GAP_MS     50      // longest silence inside a reply, the FTDI latency timer is 16 ms
+#define SF_MAX_EVENTS       (MAX_REPLY_SIZE + 1)    // one parse never produces more
+
+// SF_EVENT_RESYNC is the first byte of what looked like a reply, dropped.
+enum SFEventType {SF_EVENT_REPLY = 0, SF_EVENT_TRUNCATED, SF_EVENT_COMPLETE, SF_EVENT_MOVE_FAILED, SF_EVENT_NOISE, SF_EVENT_RESYNC};
+
+typedef struct {
+    int             nType;
+    unsigned char   szFrame[MAX_REPLY_SIZE];    // reply bytes, or the byte for the other events
+    int             nLen;
+} SFEvent;
+
+class CReplyParser
+{
+public:
+    CReplyParser();
+
+    void        reset();
+    // cExpected is the opcode of the oldest command waiting for its reply, 0 if none.
+    // pEvents must hold SF_MAX_EVENTS, returns how many were written.
+    int         feed(unsigned char cByte, unsigned char cExpected, long long llNowUs, SFEvent *pEvents);
+    // gives up the reply in progress, see isStale.
+    int         flush(SFEvent *pEvents);
+
+    // a reply started and nothing came for SF_FRAME_GAP_MS
+    bool        isStale(long long llNowUs) const;
+    // when the reply in progress goes stale, 0 if there is none
+    long long   getStaleUs() const;
+    // opcode of the reply in progress, 0 if there is none
+    unsigned char   getPartialOpcode() const { return m_nFrameLen ? m_szFrame[0] : 0; };
+
+protected:
+    void        parse(unsigned char cByte, unsigned char cExpected, SFEvent *pEvents, int &nEvents);
+    void        hunt(unsigned char cByte, unsigned char cExpected, SFEvent *pEvents, int &nEvents);
+    void        dropFrame(bool bTruncated, unsigned char cExpected, SFEvent *pEvents, int &nEvents);
+    bool        payloadValid() const;
+    void        addEvent(int nType, const unsigned char *pData, int nLen, SFEvent *pEvents, int &nEvents);
+
+    unsigned char   m_szFrame[MAX_REPLY_SIZE];
+    int             m_nFrameLen;        // 0 while hunting for the start of a reply
+    int             m_nFrameExpected;
+    long long       m_llLastByteUs;
+};
+
+#endif //__REPLY_PARSER__
@@ -11,6 +11,7 @@
 #include <ctype.h>
 #include <memory.h>
 #include <string.h>
+#include <algorithm>
 #ifdef SB_MAC_BUILD
 #include <unistd.h>
 #endif
@@ -26,65 +27,56 @@ CSmartFocus::CSmartFocus()
 
     m_bDebugLog = false;
     m_bIsConnected = false;
+    m_szFirmwareVersion[0] = 0;
 
     m_nCurPos = 0;
+    m_bPosValid = false;
+    m_nCachedStatus = IDLE;
+    m_llStatusUs = 0;
     m_nTargetPos = 0;
     m_nPosLimit = 65535;
-    m_bMoving = false;
+    m_llConnectTimeUs = 0;
+    m_nMoveState = MOVE_IDLE;
 
-    m_CmdTimer.Reset();
+    m_nIOChannel = 0;
+    m_pWaker = NULL;
+    m_bHaveLastSession = false;
+    m_bMoveHandover = false;
+    m_bMoveQueueRunning = false;
 
-    
-#ifdef PLUGIN_DEBUG
-#if defined(SB_WIN_BUILD)
-    m_sLogfilePath = getenv("HOMEDRIVE");
-    m_sLogfilePath += getenv("HOMEPATH");
-    m_sLogfilePath += "\\SmartFocusLog.txt";
-#elif defined(SB_LINUX_BUILD)
-    m_sLogfilePath = getenv("HOME");
-    m_sLogfilePath += "/SmartFocusLog.txt";
-#elif defined(SB_MAC_BUILD)
-    m_sLogfilePath = getenv("HOME");
-    m_sLogfilePath += "/SmartFocusLog.txt";
-#endif
-    Logfile = fopen(m_sLogfilePath.c_str(), "w");
-#endif
+    m_bAutoReconnect = false;
+    m_nLinkState = LINK_UP;
+    m_nReconnects = 0;
+    m_bSupervisorRunning = false;
 
-#if defined PLUGIN_DEBUG && PLUGIN_DEBUG >= 2
-    ltime = time(NULL);
-    timestamp = asctime(localtime(&ltime));
-    timestamp[strlen(timestamp) - 1] = 0;
-    fprintf(Logfile, "[%s] [SmartFocus::SmartFocus] version %.3f build 2020_03_19_1445.\n", timestamp, DRIVER_VERSION);
-    fprintf(Logfile, "[%s] SmartFocus Constructor Called\n", timestamp);
-    fflush(Logfile);
+#ifdef PLUGIN_DEBUG
+    setDebugLog(true);
 #endif
 
-    
+    SF_LOG("[SmartFocus::SmartFocus] version %.3f build 2020_03_19_1445.", DRIVER_VERSION);
+    SF_LOG("SmartFocus Constructor Called");
 }
 
 CSmartFocus::~CSmartFocus()
 {
-#ifdef	PLUGIN_DEBUG
-    // Close LogFile
-    if (Logfile) fclose(Logfile);
-#endif
+    stopReader();
+    stopMoveQueue();
+    stopSupervisor();
+    setDebugLog(false);
 }
 
 int CSmartFocus::Connect(const char *pszPort)
 {
     int nErr = PLUGIN_OK;
     int nStatus;
+    int nPosition;
+    CStopWatch ConnectTimer;
 
     if(!m_pSerx)
         return ERR_COMMNOLINK;
 
-#ifdef PLUGIN_DEBUG
-	ltime = time(NULL);
-	timestamp = asctime(localtime(&ltime));
-	timestamp[strlen(timestamp) - 1] = 0;
-	fprintf(Logfile, "[%s] CSmartFocus::Connect Called %s\n", timestamp, pszPort);
-	fflush(Logfile);
-#endif
+    SF_LOG("CSmartFocus::Connect Called %s", pszPort);
+    ConnectTimer.Reset();
 
     // 9600 8N1
     nErr = m_pSerx->open(pszPort, 9600, SerXInterface::B_NOPARITY, "-DTR_CONTROL 1");
@@ -96,72 +88,129 @@ int CSmartFocus::Connect(const char *pszPort)
     if(!m_bIsConnected)
         return nErr;
 
-    m_pSleeper->sleep(2000);
+    m_Trace.openSession(pszPort);
+    m_sPort = pszPort;
+    m_nLinkState = LINK_UP;
+    m_nReconnects = 0;
 
-#ifdef PLUGIN_DEBUG
-	ltime = time(NULL);
-	timestamp = asctime(localtime(&ltime));
-	timestamp[strlen(timestamp) - 1] = 0;
-	fprintf(Logfile, "[%s] CSmartFocus::Connect connected to %s\n", timestamp, pszPort);
-	fflush(Logfile);
-#endif
-	
+    // from now on the I/O thread owns the receive side of the port.
+    m_pSerx->purgeTxRx();
+    m_nMoveState = MOVE_IDLE;
+    invalidateState();
+    m_szFirmwareVersion[0] = 0;
+    m_Pacer.reset();
+    startReader();
+    startMoveQueue();
+
+    // opening the port resets the controller, wait until it answers instead of a fixed 2 seconds.
+    nErr = probeController();
+    if(nErr) {
+        stopMoveQueue();
+        stopReader();
+        m_pSerx->close();
+		m_bIsConnected = false;
+        m_Trace.closeSession();
+        SF_LOG("CSmartFocus::Connect **** ERROR **** no answer from the controller after %d ms", CONNECT_TIMEOUT);
+        return nErr;
+    }
+    m_llConnectTimeUs = ConnectTimer.GetElapsedNs() / 1000;
+    // the probes that went unanswered during the boot say nothing about the link.
+    m_Pacer.reset();
+    m_Stats.reset();
+
+    SF_LOG("CSmartFocus::Connect connected to %s in %lld us", pszPort, m_llConnectTimeUs);
 
     // get status so we can figure out what device we are connecting to.
-#ifdef PLUGIN_DEBUG
-	ltime = time(NULL);
-	timestamp = asctime(localtime(&ltime));
-	timestamp[strlen(timestamp) - 1] = 0;
-	fprintf(Logfile, "[%s] CSmartFocus::Connect getting device status\n", timestamp);
-	fflush(Logfile);
-#endif
-    nErr = getDeviceStatus(nStatus);
+    SF_LOG("CSmartFocus::Connect getting device status");
+    nErr = refreshDeviceState(nStatus, nPosition);
     if(nErr) {
+        stopMoveQueue();
+        stopReader();
+        m_pSerx->close();
 		m_bIsConnected = false;
-#ifdef PLUGIN_DEBUG
-		ltime = time(NULL);
-		timestamp = asctime(localtime(&ltime));
-		timestamp[strlen(timestamp) - 1] = 0;
-		fprintf(Logfile, "[%s] CSmartFocus::Connect **** ERROR **** getting device status\n", timestamp);
-		fflush(Logfile);
-#endif
+        m_Trace.closeSession();
+        SF_LOG("CSmartFocus::Connect **** ERROR **** getting device status");
         return nErr;
     }
+    if(m_bHaveLastSession)
+        checkLastSession(nStatus, nPosition);
+    journalState();
+    // it doesn't change while connected, host calls get it from m_szFirmwareVersion.
+    if(readFirmwareVersion())
+        SF_LOG("CSmartFocus::Connect **** ERROR **** getting the firmware version, will retry when asked");
     // m_globalStatus.deviceType now contains the device type
+    if(m_bAutoReconnect)
+        startSupervisor();
     return nErr;
 }
 
 void CSmartFocus::Disconnect()
 {
-    if(m_bIsConnected && m_pSerx)
+    std::string sReport;
+    size_t nStart;
+    size_t nEnd;
+
+    stopSupervisor();
+    stopMoveQueue();
+    stopReader();
+    if(m_bIsConnected)
+        journalState();
+    if(m_bIsConnected && m_pSerx) {
         m_pSerx->close();
- 
+        m_Trace.closeSession();
+        if(m_bDebugLog) {
+            m_Stats.report(sReport);
+            for(nStart = 0; (nEnd = sReport.find('\n', nStart)) != std::string::npos; nStart = nEnd + 1)
+                SF_LOG("CSmartFocus::Disconnect link stats %s", sReport.substr(nStart, nEnd - nStart));
+        }
+    }
+
 	m_bIsConnected = false;
+    m_nMoveState = MOVE_IDLE;
+    m_MoveQueue.clear();
+    invalidateState();
+    m_nLinkState = LINK_UP;
 }
 
 #pragma mark move commands
 int CSmartFocus::haltFocuser()
 {
     int nErr;
-    unsigned char szResp[SERIAL_BUFFER_SIZE];
+    CSFMessage<'s'> Stop;
 
 	if(!m_bIsConnected)
 		return ERR_COMMNOLINK;
 
-    nErr = Command((unsigned char *)"s", 1, szResp, 1, SERIAL_BUFFER_SIZE);
-    if(nErr)
-        return nErr;
-    m_nTargetPos = m_nCurPos;
-    m_bMoving = false;
-    
+    // a queued move being sent goes out before the 's', not after it.
+    std::lock_guard<std::mutex> gotoLock(m_GotoLock);
+    disarmMove();
+
+    nErr = Command(Stop);
+
     return nErr;
 }
 
+// disarmed before the 's' so the 'c' that follows a halt isn't taken for a completed move.
+void CSmartFocus::disarmMove()
+{
+    std::lock_guard<std::mutex> moveLock(m_MoveLock);
+
+    m_nMoveState = MOVE_IDLE;
+    m_MoveQueue.clear();
+    m_bMoveHandover = false;
+    invalidateState();
+    // best guess of where the motor stopped, the next idle getPosition reads the real value.
+    if(m_MotionModel.isActive()) {
+        m_MotionModel.abort();
+        m_nCurPos = m_MotionModel.estimate();
+    }
+    m_nTargetPos = m_nCurPos.load();
+    journalState();
+}
+
 int CSmartFocus::gotoPosition(int nPos)
 {
     int nErr = PLUGIN_OK;
-    unsigned char szCmd[SERIAL_BUFFER_SIZE];
-    unsigned char szResp[SERIAL_BUFFER_SIZE];
 
 	if(!m_bIsConnected)
 		return ERR_COMMNOLINK;
@@ -170,40 +219,13 @@ int CSmartFocus::gotoPosition(int nPos)
     if (nPos>m_nPosLimit)
         return ERR_LIMITSEXCEEDED;
 
-    // don't send any other commands while moving.
-    if(m_bMoving) {
-        return ERR_COMMANDINPROGRESS;
-    }
+    SF_LOG("CSmartFocus::gotoPosition goto position  : %d", nPos);
 
-#ifdef PLUGIN_DEBUG
-    ltime = time(NULL);
-    timestamp = asctime(localtime(&ltime));
-    timestamp[strlen(timestamp) - 1] = 0;
-    fprintf(Logfile, "[%s] CSmartFocus::gotoPosition goto position  : %d\n", timestamp, nPos);
-    fflush(Logfile);
-#endif
-    
-    szCmd[0] = 'g';
-    szCmd[1] = (nPos & 0xff00) >> 8;
-    szCmd[2] = (nPos & 0x00ff);
-    
-    nErr = Command(szCmd, 3, szResp, 1, SERIAL_BUFFER_SIZE);
-    if(nErr) {
-    #ifdef PLUGIN_DEBUG
-        ltime = time(NULL);
-        timestamp = asctime(localtime(&ltime));
-        timestamp[strlen(timestamp) - 1] = 0;
-        fprintf(Logfile, "[%s] CSmartFocus::gotoPosition goto error  : %d\n", timestamp, nErr);
-        fflush(Logfile);
-    #endif
-        return nErr;
-    }
-    m_nTargetPos = nPos;
-    m_bMoving = true;
-    
+    nErr = queueMove(false, nPos);
     return nErr;
 }
 
+// while moving the offset is counted from where the moves already queued end.
 int CSmartFocus::moveRelativeToPosision(int nSteps)
 {
     int nErr;
@@ -211,153 +233,265 @@ int CSmartFocus::moveRelativeToPosision(int nSteps)
 	if(!m_bIsConnected)
 		return ERR_COMMNOLINK;
 
-#ifdef PLUGIN_DEBUG
-    ltime = time(NULL);
-    timestamp = asctime(localtime(&ltime));
-    timestamp[strlen(timestamp) - 1] = 0;
-    fprintf(Logfile, "[%s] CSmartFocus::moveRelativeToPosision goto relative position  : %d\n", timestamp, nSteps);
-    fflush(Logfile);
-#endif
+    SF_LOG("CSmartFocus::moveRelativeToPosision goto relative position  : %d", nSteps);
 
-    m_nTargetPos = m_nCurPos + nSteps;
-    nErr = gotoPosition(m_nTargetPos);
+    nErr = queueMove(true, nSteps);
     return nErr;
 }
 
+// starts the move if the focuser is idle, otherwise queues it behind the running one.
+// armed and sent under m_GotoLock, a halt can't disarm it before the 'g' is out.
+int CSmartFocus::queueMove(bool bRelative, int nValue)
+{
+    int nErr;
+    int nPos;
+    bool bSend;
+    std::lock_guard<std::mutex> gotoLock(m_GotoLock);
+
+    nErr = armMove(bRelative, nValue, bSend, nPos);
+    if(nErr || !bSend)
+        return nErr;
+
+    nErr = sendGoto(nPos);
+    if(nErr)
+        gotoFailed(nErr);
+    return nErr;
+}
+
+// bSend : the move starts now, nPos has to be sent. otherwise it waits behind the running one.
+int CSmartFocus::armMove(bool bRelative, int nValue, bool &bSend, int &nPos)
+{
+    QueuedMove Move;
+    std::lock_guard<std::mutex> moveLock(m_MoveLock);
+
+    bSend = false;
+    if(m_nMoveState == MOVE_RUNNING) {
+        // jog clicks and autofocus steps add up to a single move.
+        if(bRelative && !m_MoveQueue.empty() && m_MoveQueue.back().bRelative) {
+            m_MoveQueue.back().nValue += nValue;
+            SF_LOG("CSmartFocus::queueMove %d steps merged, %d steps queued", nValue, m_MoveQueue.back().nValue);
+            return PLUGIN_OK;
+        }
+        if(m_MoveQueue.size() >= MOVE_QUEUE_SIZE)
+            return ERR_COMMANDINPROGRESS;
+        Move.bRelative = bRelative;
+        Move.nValue = nValue;
+        m_MoveQueue.push_back(Move);
+        SF_LOG("CSmartFocus::queueMove %s %d queued, %d move(s) waiting", bRelative ? "offset" : "position", nValue, int(m_MoveQueue.size()));
+        return PLUGIN_OK;
+    }
+
+    nPos = bRelative ? m_nCurPos + nValue : nValue;
+    if(nPos < 0 || nPos > m_nPosLimit)
+        return ERR_LIMITSEXCEEDED;
+    // armed before sending so a 'c' from a very short move can't be missed by the I/O thread.
+    invalidateState();
+    m_nTargetPos = nPos;
+    m_MotionModel.start(m_nCurPos, nPos);
+    m_nMoveState = MOVE_RUNNING;
+    // for the completion check at the predicted end.
+    m_MoveCond.notify_all();
+    journalState();
+    bSend = true;
+    return PLUGIN_OK;
+}
+
+void CSmartFocus::gotoFailed(int nErr)
+{
+    std::lock_guard<std::mutex> moveLock(m_MoveLock);
+
+    m_nMoveState = MOVE_IDLE;
+    m_MoveQueue.clear();
+    m_MotionModel.abort();
+    m_nTargetPos = m_nCurPos.load();
+    journalState();
+    SF_LOG("CSmartFocus::gotoPosition goto error  : %d", nErr);
+}
+
 #pragma mark command complete functions
 
+// no serial I/O here, the I/O thread updates m_nMoveState when the 'c' or 'r' arrives.
 int CSmartFocus::isGoToComplete(bool &bComplete)
 {
     int nErr = PLUGIN_OK;
-    unsigned char szResp[SERIAL_BUFFER_SIZE];
+    int nState;
 
 	if(!m_bIsConnected)
 		return ERR_COMMNOLINK;
-    
-    if(!m_bMoving) {
-        bComplete = true;
-        return nErr;
-    }
-            
-    bComplete = false;
-    nErr = readResponse(szResp, 1, SERIAL_BUFFER_SIZE);
-    if(nErr)    // probably a timeout
-        return PLUGIN_OK;
 
-    if(szResp[0] == 'r')
-        return ERR_CMDFAILED;
-    
-    if(szResp[0] == 'c') {
-        m_bMoving = false;
-        bComplete = true;
+    nState = m_nMoveState;
+    switch(nState) {
+        case MOVE_RUNNING:
+            bComplete = false;
+            break;
+
+        case MOVE_FAILED:
+            bComplete = false;
+            m_nMoveState.compare_exchange_strong(nState, MOVE_IDLE);
+            return ERR_CMDFAILED;
+
+        case MOVE_COMPLETE:
+        case MOVE_IDLE:
+        default:
+            bComplete = true;
+            m_nMoveState.compare_exchange_strong(nState, MOVE_IDLE);
+            break;
     }
-        
 
-#ifdef PLUGIN_DEBUG
-    ltime = time(NULL);
-    timestamp = asctime(localtime(&ltime));
-    timestamp[strlen(timestamp) - 1] = 0;
-    fprintf(Logfile, "[%s] CSmartFocus::isGoToComplete bComplete : %s\n", timestamp, bComplete?"True":"False");
-    fprintf(Logfile, "[%s] CSmartFocus::isGoToComplete m_bMoving : %s\n", timestamp, m_bMoving?"True":"False");
-    fflush(Logfile);
-#endif
+
+    SF_LOG("CSmartFocus::isGoToComplete bComplete : %s", bComplete?"True":"False");
+    SF_LOG("CSmartFocus::isGoToComplete m_nMoveState : %d", int(m_nMoveState));
 
     return nErr;
 }
 
 
 #pragma mark getters and setters
+// status and position in a single round trip.
+int CSmartFocus::refreshDeviceState(int &nStatus, int &nPosition)
+{
+    int nErr;
+    CSFMessage<'t'> Status;
+    CSFMessage<'p'> Position;
+    SFTransaction *Batch[2] = {&Status.Transaction, &Position.Transaction};
+
+	if(!m_bIsConnected)
+		return ERR_COMMNOLINK;
+
+    nErr = Transact(Batch, 2);
+    if(nErr)
+        return nErr;
+    if(!Status.isValid() || !Position.isValid())
+        return PLUGIN_BAD_CMD_RESPONSE;
+
+    nStatus = Status.byteValue();
+    statusReceived(nStatus);
+    nPosition = Position.wordValue();
+    if(m_nMoveState != MOVE_RUNNING) {
+        m_nCurPos = nPosition;
+        m_bPosValid = true;
+        journalState();
+    }
+    return nErr;
+}
+
 int CSmartFocus::getDeviceStatus(int &nStatus)
 {
     int nErr;
-    unsigned char szResp[SERIAL_BUFFER_SIZE];
+    CSFMessage<'t'> Status;
 	
 	if(!m_bIsConnected)
 		return ERR_COMMNOLINK;
 	
+    if(cachedStatus(nStatus))
+        return PLUGIN_OK;
+
+    nErr = Command(Status);
+    return statusReply(Status, nErr, nStatus);
+}
+
+// a recent enough reply, or the 'c' of the last move, is as good as a new one.
+bool CSmartFocus::cachedStatus(int &nStatus)
+{
+    long long llStatusUs = m_llStatusUs;
 
-    nErr = Command((const unsigned char*)"t", 1, szResp, 2,  SERIAL_BUFFER_SIZE);
+    if(!llStatusUs || CCommandPacer::now() - llStatusUs >= STATUS_CACHE_TTL * 1000LL)
+        return false;
+    nStatus = m_nCachedStatus;
+    return true;
+}
+
+int CSmartFocus::statusReply(const CSFMessage<'t'> &Status, int nErr, int &nStatus)
+{
     if(nErr)
         return nErr;
-    nStatus = szResp[1];
+    if(!Status.isValid())
+        return PLUGIN_BAD_CMD_RESPONSE;
+    nStatus = Status.byteValue();
+    statusReceived(nStatus);
     return nErr;
 }
 
+// read once at Connect.
 int CSmartFocus::getFirmwareVersion(char *pszVersion, int nStrMaxLen)
 {
     int nErr = PLUGIN_OK;
-    unsigned char szResp[SERIAL_BUFFER_SIZE];
 	
 	if(!m_bIsConnected)
 		return ERR_COMMNOLINK;
 
-    if(!m_bIsConnected)
-        return NOT_CONNECTED;
+    if(nStrMaxLen <= 0)
+        return ERR_CMDFAILED;
 
-    // don't send any other commands while moving.
-    if(m_bMoving) {
-        return ERR_COMMANDINPROGRESS;
+    // Connect couldn't get it.
+    if(!m_szFirmwareVersion[0]) {
+        // don't send any other commands while moving.
+        if(m_nMoveState == MOVE_RUNNING) {
+            return ERR_COMMANDINPROGRESS;
+        }
+        nErr = readFirmwareVersion();
+        if(nErr)
+            return nErr;
     }
 
-    nErr = Command((const unsigned char*)"b", 1, szResp, 2, SERIAL_BUFFER_SIZE);
-    if(nErr) {
-        #ifdef PLUGIN_DEBUG
-            ltime = time(NULL);
-            timestamp = asctime(localtime(&ltime));
-            timestamp[strlen(timestamp) - 1] = 0;
-            fprintf(Logfile, "[%s] CSmartFocus::getFirmwareVersion ERROR : %d\n", timestamp, nErr);
-            fflush(Logfile);
-        #endif
-        return nErr;
-    }
-    
-#ifdef PLUGIN_DEBUG
-    ltime = time(NULL);
-    timestamp = asctime(localtime(&ltime));
-    timestamp[strlen(timestamp) - 1] = 0;
-    fprintf(Logfile, "[%s] CSmartFocus::getFirmwareVersion szResp : %s\n", timestamp, szResp);
-    fflush(Logfile);
-#endif
-
-    strncpy(pszVersion, (char *)szResp+1, 1);
+    snprintf(pszVersion, nStrMaxLen, "%s", m_szFirmwareVersion);
     return nErr;
 }
 
 
 int CSmartFocus::getPosition(int &nPosition)
 {
-    int nErr = PLUGIN_OK;
-    unsigned char szResp[SERIAL_BUFFER_SIZE];
+    int nErr;
+    CSFMessage<'p'> Position;
 
 	if(!m_bIsConnected)
 		return ERR_COMMNOLINK;
 
-    // don't send any other commands while moving.
-    if(m_bMoving) {
+    if(cachedPosition(nPosition))
+        return PLUGIN_OK;
+
+    nErr = Command(Position);
+    return positionReply(Position, nErr, nPosition);
+}
+
+// true when there is no need to ask the controller.
+bool CSmartFocus::cachedPosition(int &nPosition)
+{
+    // don't send any other commands while moving, the motion model knows where we are.
+    if(m_nMoveState == MOVE_RUNNING) {
+        nPosition = m_MotionModel.estimate();
+        return true;
+    }
+    // while the supervisor restores the link the last known position is still right.
+    if(m_nLinkState != LINK_UP && m_SupervisorThread.get_id() != std::this_thread::get_id()) {
         nPosition = m_nCurPos;
-        return nErr;
+        return true;
     }
-    
-    nErr = Command((const unsigned char*)"p", 1, szResp, 3,  SERIAL_BUFFER_SIZE);
+    // nothing moved since it was read or reached.
+    if(m_bPosValid) {
+        nPosition = m_nCurPos;
+        return true;
+    }
+    return false;
+}
+
+int CSmartFocus::positionReply(const CSFMessage<'p'> &Position, int nErr, int &nPosition)
+{
     if(nErr) {
-        if(m_bMoving) {
-            nPosition = m_nCurPos;
+        if(m_nMoveState == MOVE_RUNNING) {
+            nPosition = m_MotionModel.estimate();
             nErr = PLUGIN_OK;
         }
         return nErr;
     }
-    if(szResp[0] == 'p') {
-        nPosition = (((int(szResp[1])<<8)&0xff00) | (int(szResp[2])&0x00ff)) & 0x0000ffff;
+    if(Position.isValid()) {
+        nPosition = Position.wordValue();
         m_nCurPos = nPosition;
+        m_bPosValid = true;
+        journalState();
     }
     
-    #ifdef PLUGIN_DEBUG
-        ltime = time(NULL);
-        timestamp = asctime(localtime(&ltime));
-        timestamp[strlen(timestamp) - 1] = 0;
-        fprintf(Logfile, "[%s] CSmartFocus::getPosition m_nCurPos : %d\n", timestamp, m_nCurPos);
-        fflush(Logfile);
-    #endif
+    SF_LOG("CSmartFocus::getPosition m_nCurPos : %d", m_nCurPos.load());
 
     return nErr;
 }
@@ -366,13 +500,13 @@ int CSmartFocus::getPosition(int &nPosition)
 int CSmartFocus::syncMotorPosition(int nPos)
 {
     int nErr = PLUGIN_OK;
-    unsigned char szResp[SERIAL_BUFFER_SIZE];
+    CSFMessage<'z'> Zero;
 
 	if(!m_bIsConnected)
 		return ERR_COMMNOLINK;
 
     // don't send any other commands while moving.
-    if(m_bMoving) {
+    if(m_nMoveState == MOVE_RUNNING) {
         return ERR_COMMANDINPROGRESS;
     }
 
@@ -380,17 +514,64 @@ int CSmartFocus::syncMotorPosition(int nPos)
     if(nPos != 0)
         return ERR_CMDFAILED;
     
-    nErr = Command((const unsigned char*)"z", 1, szResp, 1, SERIAL_BUFFER_SIZE);
-    printf("[syncMotorPosition] szResp = %s\n", szResp);
+    nErr = Command(Zero);
+    SF_LOG("CSmartFocus::syncMotorPosition szResp : %s", LogHex(Zero.reply(), Zero.Transaction.nRespLen));
     if(nErr)
         return nErr;
 
     m_nCurPos = 0;
+    m_bPosValid = true;
+    journalState();
     return nErr;
 }
 
 
 
+// the shared log writer runs as long as one instance has logging enabled.
+void CSmartFocus::setDebugLog(bool bEnable)
+{
+    if(m_bDebugLog.exchange(bEnable) == bEnable)
+        return;
+    if(bEnable)
+        CAsyncLog::instance().acquire();
+    else
+        CAsyncLog::instance().release();
+}
+
+// loads what the previous session left there, checked against the controller on Connect.
+int CSmartFocus::setJournalFile(const char *pszPath)
+{
+    m_Journal.stop();
+    m_bHaveLastSession = false;
+    if(!pszPath || !*pszPath)
+        return PLUGIN_OK;
+
+    if(CStateJournal::load(pszPath, m_LastSession)) {
+        // the move timings carry over, the first moves get a right ETA.
+        for(int nDir = 0; nDir < 2; nDir++) {
+            for(int i = 0; i < m_LastSession.nSamples[nDir]; i++)
+                m_MotionModel.addSample(nDir == 1, m_LastSession.Samples[nDir][i].nSteps, m_LastSession.Samples[nDir][i].dSeconds);
+        }
+        m_bHaveLastSession = true;
+        SF_LOG("CSmartFocus::setJournalFile last session at %d%s, %d/%d move samples", m_LastSession.nPosition,
+               m_LastSession.bMoving ? " moving" : "", m_LastSession.nSamples[0], m_LastSession.nSamples[1]);
+    }
+    m_Journal.start(pszPath);
+    return PLUGIN_OK;
+}
+
+// NULL or an empty path stops the capture, the file is appended to so sessions accumulate.
+int CSmartFocus::setTraceFile(const char *pszPath)
+{
+    m_Trace.stop();
+    if(!pszPath || !*pszPath)
+        return PLUGIN_OK;
+    SF_LOG("CSmartFocus::setTraceFile tracing to %s", pszPath);
+    if(m_Trace.start(pszPath))
+        return ERR_CMDFAILED;
+    return PLUGIN_OK;
+}
+
 int CSmartFocus::getPosLimit()
 {
     return m_nPosLimit;
@@ -402,131 +583,863 @@ void CSmartFocus::setPosLimit(int nLimit)
 }
 
 
+#pragma mark state journal
+// cheap, the journal writes it out later on its own thread.
+void CSmartFocus::journalState()
+{
+    JournalState State;
+
+    if(!m_Journal.isActive())
+        return;
+    State.nPosition = m_nCurPos;
+    State.bPositionValid = m_bPosValid;
+    State.bMoving = m_nMoveState == MOVE_RUNNING;
+    State.nTarget = m_nTargetPos;
+    for(int nDir = 0; nDir < 2; nDir++)
+        State.nSamples[nDir] = m_MotionModel.getSamples(nDir == 1, State.Samples[nDir], MOTION_SAMPLES);
+    m_Journal.update(State);
+}
+
+// the first Connect after setJournalFile : a move the last session didn't see the end of is
+// picked up if it's still running, a focuser moved by hand or cut short is logged.
+void CSmartFocus::checkLastSession(int nStatus, int nPosition)
+{
+    m_bHaveLastSession = false;
+    if(m_LastSession.bMoving && nStatus == MOVING) {
+        std::lock_guard<std::mutex> moveLock(m_MoveLock);
+        SF_LOG("CSmartFocus::checkLastSession move to %d still running at %d, waiting for its end", m_LastSession.nTarget, nPosition);
+        invalidateState();
+        m_nTargetPos = m_LastSession.nTarget;
+        m_MotionModel.start(nPosition, m_LastSession.nTarget);
+        m_nMoveState = MOVE_RUNNING;
+        m_MoveCond.notify_all();
+        return;
+    }
+    if(m_LastSession.bMoving && nPosition != m_LastSession.nTarget)
+        SF_LOG("CSmartFocus::checkLastSession move to %d cut short at %d", m_LastSession.nTarget, nPosition);
+    else if(!m_LastSession.bMoving && m_LastSession.bPositionValid && nPosition != m_LastSession.nPosition)
+        SF_LOG("CSmartFocus::checkLastSession moved from %d to %d since the last session", m_LastSession.nPosition, nPosition);
+}
+
+#pragma mark link statistics
+bool CSmartFocus::getOpcodeStats(unsigned char cOpcode, OpcodeStats &Stats)
+{
+    return m_Stats.getOpcodeStats(cOpcode, Stats);
+}
+
+void CSmartFocus::getLinkCounters(LinkCounters &Counters)
+{
+    m_Stats.getCounters(Counters);
+}
+
+void CSmartFocus::getLinkStatsReport(std::string &sReport)
+{
+    m_Stats.report(sReport);
+}
+
+void CSmartFocus::resetLinkStats()
+{
+    m_Stats.reset();
+}
+
 #pragma mark command and response functions
 
-int CSmartFocus::Command(const unsigned char *pszszCmd, int nCmdSize, unsigned char *pszResult, int nResultLen, int nResultMaxLen)
+// with the supervisor running a transaction lost with the link is sent again once the link is back,
+// except a 'g' : restoring the move is the supervisor's, see restoreState.
+int CSmartFocus::Transact(SFTransaction **ppTransactions, int nCount, int nTimeoutMs)
 {
-    int nErr = PLUGIN_OK;
-    unsigned char szResp[SERIAL_BUFFER_SIZE];
-    unsigned long  ulBytesWrite;
-    int dDelayMs;
-#ifdef PLUGIN_DEBUG
-    unsigned char cHexMessage[LOG_BUFFER_SIZE];
-#endif
-    
+    int nErr;
+    bool bSupervisor;
+
+    bSupervisor = (m_SupervisorThread.get_id() == std::this_thread::get_id());
+    if(!bSupervisor && m_bSupervisorRunning && m_nLinkState != LINK_UP && !waitForLink(RECONNECT_WAIT))
+        return ERR_COMMNOLINK;
+
+    nErr = transactOnce(ppTransactions, nCount, nTimeoutMs);
+    if(!nErr || bSupervisor || !m_bSupervisorRunning || m_nLinkState == LINK_UP)
+        return nErr;
+
+    SF_LOG("CSmartFocus::Transact link lost during '%c', waiting for the supervisor", ppTransactions[0]->pCmd[0]);
+    if(!waitForLink(RECONNECT_WAIT))
+        return ERR_COMMNOLINK;
+    // sent again it would be refused, the motor is already on its way.
+    if(ppTransactions[0]->pCmd[0] == 'g')
+        return restoredGotoResult();
+    for(int i = 0; i < nCount; i++)
+        sfResetTransaction(*ppTransactions[i]);
+    return transactOnce(ppTransactions, nCount, nTimeoutMs);
+}
+
+// sends all the commands back to back then collects the replies, so a batch costs about one round trip.
+int CSmartFocus::transactOnce(SFTransaction **ppTransactions, int nCount, int nTimeoutMs)
+{
+    int nErr;
+    int nReadErr;
+    int i;
+
 	if(!m_bIsConnected)
 		return ERR_COMMNOLINK;
 
-    
-    // do we need to wait ?
-    if(m_CmdTimer.GetElapsedSeconds()<CMD_WAIT_INTERVAL) {
-        dDelayMs = CMD_WAIT_INTERVAL - int(m_CmdTimer.GetElapsedSeconds() *1000);
-        if(dDelayMs>0)
-            m_pSleeper->sleep(dDelayMs);
+    nErr = sendTransactions(ppTransactions, nCount, true);
+    if(nErr)
+        return nErr;
+
+    for(i = 0; i < nCount; i++) {
+        if(!ppTransactions[i]->nExpectedLen)
+            continue;
+        nReadErr = readResponse(ppTransactions[i], nTimeoutMs);
+        if(nReadErr && !nErr)
+            nErr = nReadErr;
     }
-    
-    m_pSerx->purgeTxRx();
-#ifdef PLUGIN_DEBUG
-	ltime = time(NULL);
-	timestamp = asctime(localtime(&ltime));
-	timestamp[strlen(timestamp) - 1] = 0;
-    fprintf(Logfile, "[%s] CSmartFocus::Command command lenght = %d\n", timestamp, nCmdSize);
-    fprintf(Logfile, "[%s] CSmartFocus::Command Sending %c\n", timestamp, pszszCmd[0]);
-    if(nCmdSize>1) {
-        fprintf(Logfile, "[%s] CSmartFocus::Command command parameters =  %d\n", timestamp, (((int(pszszCmd[1])<<8)&0xff00) | (int(pszszCmd[2])&0x00ff)) & 0x0000ffff);
-    }
-    hexdump(pszszCmd, cHexMessage, nCmdSize, LOG_BUFFER_SIZE);
-    fprintf(Logfile, "[%s] CSmartFocus::Command Sending '%s'\n", timestamp, cHexMessage);
-
-    fflush(Logfile);
-#endif
-    nErr = m_pSerx->writeFile((void *)pszszCmd, nCmdSize, ulBytesWrite);
-    m_pSerx->flushTx();
+    return nErr;
+}
 
-    if(nErr){
-        return nErr;
+// the gap the pacer wants before these commands, 0 to send now.
+int CSmartFocus::pacingDelayUs(SFTransaction **ppTransactions, int nCount)
+{
+    unsigned char szOpcodes[MAX_PIPELINED_CMDS];
+    int i;
+
+    for(i = 0; i < nCount && i < MAX_PIPELINED_CMDS; i++)
+        szOpcodes[i] = ppTransactions[i]->pCmd[0];
+    return m_Pacer.delayBeforeUs(szOpcodes, i);
+}
+
+// writes the commands and queues them for their replies. bPace sleeps the pacer gap
+// first, without it the caller has waited for pacingDelayUs.
+int CSmartFocus::sendTransactions(SFTransaction **ppTransactions, int nCount, bool bPace)
+{
+    int nErr = PLUGIN_OK;
+    unsigned char szBatch[MAX_CMD_SIZE * MAX_PIPELINED_CMDS];
+    const unsigned char *pWrite;
+    int nBatchLen = 0;
+    unsigned long  ulBytesWrite;
+    int nDelayUs;
+    long long llSentUs;
+    int i;
+
+    if(nCount > MAX_PIPELINED_CMDS)
+        return ERR_CMDFAILED;
+
+    // a single command is written from its message, only a batch is put together.
+    if(nCount == 1) {
+        pWrite = ppTransactions[0]->pCmd;
+        nBatchLen = ppTransactions[0]->nCmdLen;
+    }
+    else {
+        for(i = 0; i < nCount; i++) {
+            memcpy(szBatch + nBatchLen, ppTransactions[i]->pCmd, ppTransactions[i]->nCmdLen);
+            nBatchLen += ppTransactions[i]->nCmdLen;
+        }
+        pWrite = szBatch;
+    }
+
+    std::lock_guard<std::mutex> writeLock(m_WriteLock);
+
+    // do we need to wait ?
+    if(bPace) {
+        nDelayUs = pacingDelayUs(ppTransactions, nCount);
+        if(nDelayUs > 0)
+            m_pSleeper->sleep((nDelayUs + 999) / 1000);
     }
 
-    if(pszResult) {
-        memset(pszResult, 0, nResultMaxLen);
-        // read response
-        nErr = readResponse(szResp, nResultLen, SERIAL_BUFFER_SIZE);
-        if(nErr){
+    // queued before the write so the I/O thread can't see a reply before its transaction.
+    {
+        std::lock_guard<std::mutex> respLock(m_RespLock);
+        for(i = 0; i < nCount; i++) {
+            if(ppTransactions[i]->nExpectedLen)
+                m_Pending.push_back(ppTransactions[i]);
         }
-#ifdef PLUGIN_DEBUG
-		ltime = time(NULL);
-		timestamp = asctime(localtime(&ltime));
-		timestamp[strlen(timestamp) - 1] = 0;
-		fprintf(Logfile, "[%s] CSmartFocus::Command response \"%c\"\n", timestamp, szResp[0]);
-        if(nResultLen>1) {
-            fprintf(Logfile, "[%s] CSmartFocus::Command response parameters = %d\n", timestamp, (((int(szResp[1])<<8)&0xff00) | (int(szResp[2])&0x00ff)) & 0x0000ffff);
-            
+    }
+    if(m_bDebugLog) {
+        SF_LOG("CSmartFocus::Transact %d command(s), %d bytes", nCount, nBatchLen);
+        for(i = 0; i < nCount; i++) {
+            SF_LOG("CSmartFocus::Transact Sending %c", ppTransactions[i]->pCmd[0]);
+            if(ppTransactions[i]->nCmdLen>1) {
+                SF_LOG("CSmartFocus::Transact command parameters =  %d", (((int(ppTransactions[i]->pCmd[1])<<8)&0xff00) | (int(ppTransactions[i]->pCmd[2])&0x00ff)) & 0x0000ffff);
+            }
+        }
+        SF_LOG("CSmartFocus::Transact Sending '%s'", LogHex(pWrite, nBatchLen));
+    }
+    // no flushTx, we wait for the replies anyway and draining the UART only adds the wire time.
+    m_Trace.record(TRACE_TX, pWrite, nBatchLen);
+    llSentUs = CCommandPacer::now();
+    for(i = 0; i < nCount; i++)
+        ppTransactions[i]->llSentUs = llSentUs;
+    nErr = m_pSerx->writeFile((void *)pWrite, nBatchLen, ulBytesWrite);
+    // the replies are due, polled ports go to the short interval.
+    CIOMultiplexer::instance().wake();
+    m_Pacer.commandSent();
+    m_Stats.bytesSent(nBatchLen);
+    if(nErr) {
+        linkLost("write error");
+        std::lock_guard<std::mutex> respLock(m_RespLock);
+        for(i = 0; i < nCount; i++) {
+            std::deque<SFTransaction *>::iterator it = std::find(m_Pending.begin(), m_Pending.end(), ppTransactions[i]);
+            if(it != m_Pending.end())
+                m_Pending.erase(it);
         }
-        hexdump(szResp, cHexMessage, nResultLen, LOG_BUFFER_SIZE);
-        fprintf(Logfile, "[%s] CSmartFocus::Command received '%s'\n", timestamp, cHexMessage);
+    }
+    return nErr;
+}
 
-        fflush(Logfile);
-#endif
-        memcpy(pszResult, szResp, nResultLen);
-#ifdef PLUGIN_DEBUG
-		ltime = time(NULL);
-		timestamp = asctime(localtime(&ltime));
-		timestamp[strlen(timestamp) - 1] = 0;
-		fprintf(Logfile, "[%s] CSmartFocus::Command 1st byte response copied to pszResult : \"%c\"\n", timestamp, pszResult[0]);
-        if(nResultLen>1) {
-            fprintf(Logfile, "[%s] CSmartFocus::Command copied response parameters = %d\n", timestamp, (((int(pszResult[1])<<8)&0xff00) | (int(pszResult[2])&0x00ff)) & 0x0000ffff );
+// waits for the I/O thread to complete the transaction.
+int CSmartFocus::readResponse(SFTransaction *pTransaction, int nTimeoutMs)
+{
+    long long llNowUs;
+    long long llWakeUs;
+    long long llStaleUs;
+    long long llDeadlineUs = CCommandPacer::now() + nTimeoutMs * 1000LL;
+    std::unique_lock<std::mutex> respLock(m_RespLock);
+
+    while(!responseDone(pTransaction, respLock, llStaleUs)) {
+        llNowUs = CCommandPacer::now();
+        if(llNowUs >= llDeadlineUs)
+            break;
+        llWakeUs = llStaleUs;
+        if(!llWakeUs || llWakeUs > llDeadlineUs)
+            llWakeUs = llDeadlineUs;
+        m_RespCond.wait_for(respLock, std::chrono::microseconds(llWakeUs - llNowUs));
+    }
+    return finishResponse(pTransaction);
+}
+
+// with m_RespLock held by respLock. llStaleUs is when the reply in progress goes stale, 0 if none.
+bool CSmartFocus::responseDone(SFTransaction *pTransaction, std::unique_lock<std::mutex> &respLock, long long &llStaleUs)
+{
+    SFEvent Events[SF_MAX_EVENTS];
+    int nEvents;
+
+    // a reply that stopped half way, the I/O thread would only notice with the next byte.
+    while(!pTransaction->bDone && m_Parser.isStale(CCommandPacer::now())) {
+        nEvents = routeReplies(Events, m_Parser.flush(Events));
+        respLock.unlock();
+        moveEvents(Events, nEvents);
+        respLock.lock();
+    }
+    llStaleUs = m_Parser.getStaleUs();
+    return pTransaction->bDone;
+}
+
+// with m_RespLock held, once the transaction is done or its time is up.
+int CSmartFocus::finishResponse(SFTransaction *pTransaction)
+{
+    bool bShortRead;
+
+    // timeout, or the reply was cut short.
+    bShortRead = pTransaction->bDone && pTransaction->nRespLen < pTransaction->nExpectedLen && pTransaction->pResp[0] != SF_REFUSED;
+    if (!pTransaction->bDone || bShortRead) {
+        std::deque<SFTransaction *>::iterator it = std::find(m_Pending.begin(), m_Pending.end(), pTransaction);
+        if(it == m_Pending.begin() && m_Parser.getPartialOpcode() == pTransaction->pCmd[0])
+            bShortRead = true;
+        if(it != m_Pending.end())
+            m_Pending.erase(it);
+        m_Pacer.replyFailed(pTransaction->pCmd[0]);
+        m_Stats.replyTimedOut(pTransaction->pCmd[0], bShortRead);
+        SF_LOG("CSmartFocus::readResponse %s waiting for '%c' reply", bShortRead ? "short read" : "timeout", pTransaction->pCmd[0]);
+        return ERR_NORESPONSE;
+    }
+    m_Pacer.replyReceived(pTransaction->pCmd[0], pTransaction->llDoneUs - pTransaction->llSentUs);
+    m_Stats.replyReceived(pTransaction->pCmd[0], pTransaction->llDoneUs - pTransaction->llSentUs, pTransaction->pResp[0] == SF_REFUSED);
+
+    if(m_bDebugLog) {
+        SF_LOG("CSmartFocus::readResponse response \"%c\"", pTransaction->pResp[0]);
+        if(pTransaction->nRespLen>2) {
+            SF_LOG("CSmartFocus::readResponse response parameters = %d", (((int(pTransaction->pResp[1])<<8)&0xff00) | (int(pTransaction->pResp[2])&0x00ff)) & 0x0000ffff);
         }
-        hexdump(szResp, cHexMessage, nResultLen, LOG_BUFFER_SIZE);
-        fprintf(Logfile, "[%s] CSmartFocus::Command copied to pszResult (hex) : '%s'\n", timestamp, cHexMessage);
+        SF_LOG("CSmartFocus::readResponse received '%s'", LogHex(pTransaction->pResp, pTransaction->nRespLen));
+    }
+    return PLUGIN_OK;
+}
 
-		fflush(Logfile);
-#endif
+// status queries until one gets a valid reply, each one waits twice as long as the previous one.
+int CSmartFocus::probeController()
+{
+    CSFMessage<'t'> Probe;
+    CStopWatch ProbeTimer;
+    int nProbeMs = CONNECT_FIRST_PROBE;
+    int nElapsedMs;
+    int nErr;
+
+    ProbeTimer.Reset();
+    while(true) {
+        sfResetTransaction(Probe.Transaction);
+        nErr = Command(Probe, nProbeMs);
+        if(!nErr && Probe.isValid() && (Probe.byteValue() == IDLE || Probe.byteValue() == MOVING))
+            return PLUGIN_OK;
+
+        nElapsedMs = int(ProbeTimer.GetElapsedNs() / 1000000);
+        if(nElapsedMs >= CONNECT_TIMEOUT)
+            return nErr ? nErr : ERR_NORESPONSE;
+        // a write error returns at once, don't spin on it.
+        if(nErr && nErr != ERR_NORESPONSE)
+            m_pSleeper->sleep(nProbeMs);
+        // no back off, a controller still booting isn't a slow link.
+        m_Pacer.reset();
+        nProbeMs = std::min(nProbeMs * 2, CONNECT_MAX_PROBE);
+        nProbeMs = std::min(nProbeMs, std::max(CONNECT_TIMEOUT - nElapsedMs, CONNECT_FIRST_PROBE));
     }
+}
+
+// the move must already be armed, see queueMove.
+int CSmartFocus::sendGoto(int nPos)
+{
+    int nErr;
+    CSFMessage<'g'> Goto;
+
+    Goto.setParam(nPos);
+    nErr = Command(Goto);
+    if(!nErr && Goto.isRefused())
+        nErr = ERR_CMDFAILED;
     return nErr;
 }
 
-int CSmartFocus::readResponse(unsigned char *pszRespBuffer, int nResultLen, int nBufferLen)
+// the version is a single binary byte.
+int CSmartFocus::readFirmwareVersion()
 {
-    int nErr = PLUGIN_OK;
-    unsigned long ulBytesRead = 0;
-	
-	if(!m_bIsConnected)
-		return ERR_COMMNOLINK;
+    int nErr;
+    CSFMessage<'b'> Version;
 
-    memset(pszRespBuffer, 0, (size_t) nBufferLen);
-    if(nResultLen > nBufferLen)
-        return ERR_CMDFAILED;
-    
-    nErr = m_pSerx->readFile(pszRespBuffer, nResultLen, ulBytesRead, MAX_TIMEOUT);
+    nErr = Command(Version);
     if(nErr) {
+        SF_LOG("CSmartFocus::readFirmwareVersion ERROR : %d", nErr);
         return nErr;
     }
+    SF_LOG("CSmartFocus::readFirmwareVersion szResp : %s", LogHex(Version.reply(), Version.Transaction.nRespLen));
+    if(!Version.isValid())
+        return PLUGIN_BAD_CMD_RESPONSE;
 
-    if (ulBytesRead < nResultLen) {// timeout
-#ifdef PLUGIN_DEBUG
-        ltime = time(NULL);
-        timestamp = asctime(localtime(&ltime));
-        timestamp[strlen(timestamp) - 1] = 0;
-        fprintf(Logfile, "[%s] CSmartFocus::readResponse timeout\n", timestamp);
-        fflush(Logfile);
-#endif
-        nErr = ERR_NORESPONSE;
+    snprintf(m_szFirmwareVersion, SERIAL_BUFFER_SIZE, "%d", Version.byteValue());
+    return PLUGIN_OK;
+}
+
+void CSmartFocus::statusReceived(int nStatus)
+{
+    m_nCachedStatus = nStatus;
+    m_llStatusUs = CCommandPacer::now();
+}
+
+// a move, a halt or a failure : the next position and status requests go to the device.
+void CSmartFocus::invalidateState()
+{
+    m_bPosValid = false;
+    m_llStatusUs = 0;
+}
+
+#pragma mark serial receive side
+
+void CSmartFocus::startReader()
+{
+    if(m_nIOChannel)
+        return;
+    {
+        // whatever was half received belongs to the previous session.
+        std::lock_guard<std::mutex> respLock(m_RespLock);
+        m_Parser.reset();
+    }
+    m_nIOChannel = CIOMultiplexer::instance().addChannel(m_pSerx, this);
+}
+
+// once this returns the I/O thread no longer touches the port.
+void CSmartFocus::stopReader()
+{
+    if(!m_nIOChannel)
+        return;
+    CIOMultiplexer::instance().removeChannel(m_nIOChannel);
+    m_nIOChannel = 0;
+}
+
+void CSmartFocus::ioReceived(const unsigned char *pData, int nLen)
+{
+    long long llNowUs = CCommandPacer::now();
+
+    m_Trace.record(TRACE_RX, pData, nLen);
+    m_Stats.bytesReceived(nLen);
+    for(int i = 0; i < nLen; i++)
+        parseByte(pData[i], llNowUs);
+    wakeAsync();
+}
+
+// replies, move events and link changes, for a CSFScheduler waiting on them.
+void CSmartFocus::wakeAsync()
+{
+    CSFWaker *pWaker = m_pWaker;
+
+    if(pWaker)
+        pWaker->wake();
+}
+
+// the multiplexer leaves the port alone for IO_RETRY_MS, the supervisor takes it from here.
+void CSmartFocus::ioFailed(int nErr)
+{
+    (void)nErr;
+    linkLost("read error");
+}
+
+// replies are due or a move will end with a 'c'.
+bool CSmartFocus::ioExpectingData()
+{
+    std::lock_guard<std::mutex> respLock(m_RespLock);
+
+    return !m_Pending.empty() || m_nMoveState == MOVE_RUNNING;
+}
+
+// routes a received byte either to the oldest pending transaction or to the async move state.
+void CSmartFocus::parseByte(unsigned char cByte, long long llNowUs)
+{
+    SFEvent Events[SF_MAX_EVENTS];
+    int nEvents;
+    bool bPartial;
+
+    {
+        std::lock_guard<std::mutex> respLock(m_RespLock);
+        bPartial = m_Parser.getPartialOpcode() != 0;
+        nEvents = m_Parser.feed(cByte, m_Pending.empty() ? 0 : m_Pending.front()->pCmd[0], llNowUs, Events);
+        nEvents = routeReplies(Events, nEvents);
+        // a reply started : a reader that went to sleep before it now has a stale deadline to wait for.
+        if(!bPartial && m_Parser.getPartialOpcode())
+            m_RespCond.notify_all();
+    }
+    moveEvents(Events, nEvents);
+}
+
+// with m_RespLock held. completes the pending transactions, the move events are moved
+// to the front of pEvents for moveEvents, which can't run under m_RespLock.
+int CSmartFocus::routeReplies(SFEvent *pEvents, int nEvents)
+{
+    SFTransaction *pTransaction;
+    int nMoveEvents = 0;
+
+    for(int i = 0; i < nEvents; i++) {
+        pTransaction = m_Pending.empty() ? NULL : m_Pending.front();
+        switch(pEvents[i].nType) {
+            case SF_EVENT_TRUNCATED:
+                // what came after the opcode is thrown away with the reply.
+                for(int j = 1; j < pEvents[i].nLen; j++)
+                    m_Stats.unexpectedByte();
+                // fall through
+            case SF_EVENT_REPLY:
+                // the parser only starts a reply on the opcode of the oldest transaction.
+                if(!pTransaction || (pEvents[i].szFrame[0] != pTransaction->pCmd[0] && pEvents[i].szFrame[0] != SF_REFUSED))
+                    break;
+                memcpy(pTransaction->pResp, pEvents[i].szFrame, pEvents[i].nLen);
+                pTransaction->nRespLen = pEvents[i].nLen;
+                pTransaction->llDoneUs = CCommandPacer::now();
+                pTransaction->bDone = true;
+                m_Pending.pop_front();
+                m_RespCond.notify_all();
+                break;
+
+            case SF_EVENT_COMPLETE:
+                // the move isn't started before its 'g' is acknowledged, this 'c' ends nothing.
+                if(pTransaction && pTransaction->pCmd[0] == 'g') {
+                    m_Stats.unexpectedByte();
+                    break;
+                }
+                pEvents[nMoveEvents++] = pEvents[i];
+                break;
+
+            case SF_EVENT_RESYNC:
+                m_Stats.resynced();
+                // fall through
+            case SF_EVENT_NOISE:
+                // a garbled reply, slow down for that opcode.
+                if(pTransaction)
+                    m_Pacer.replyFailed(pTransaction->pCmd[0]);
+                m_Stats.unexpectedByte();
+                break;
+
+            default:
+                pEvents[nMoveEvents++] = pEvents[i];
+                break;
+        }
+    }
+    return nMoveEvents;
+}
+
+void CSmartFocus::moveEvents(const SFEvent *pEvents, int nEvents)
+{
+    for(int i = 0; i < nEvents; i++) {
+        switch(pEvents[i].nType) {
+            case SF_EVENT_COMPLETE:
+                moveEnded();
+                break;
+            case SF_EVENT_MOVE_FAILED:
+                if(failMove())
+                    m_Stats.moveFailed();
+                break;
+        }
+    }
+}
+
+#pragma mark link supervisor
+
+void CSmartFocus::startSupervisor()
+{
+    if(m_bSupervisorRunning)
+        return;
+    m_bSupervisorRunning = true;
+    m_SupervisorThread = std::thread(&CSmartFocus::supervisorThread, this);
+}
+
+void CSmartFocus::stopSupervisor()
+{
+    {
+        std::lock_guard<std::mutex> linkLock(m_LinkLock);
+        m_bSupervisorRunning = false;
+        m_LinkCond.notify_all();
+    }
+    if(m_SupervisorThread.joinable())
+        m_SupervisorThread.join();
+}
+
+// only the first error counts, the supervisor owns the port until the link is back.
+void CSmartFocus::linkLost(const char *pszReason)
+{
+    int nState = LINK_UP;
+
+    if(!m_bSupervisorRunning)
+        return;
+    if(!m_nLinkState.compare_exchange_strong(nState, LINK_DOWN))
+        return;
+    SF_LOG("CSmartFocus::linkLost %s", pszReason);
+    {
+        std::lock_guard<std::mutex> linkLock(m_LinkLock);
+        m_LinkCond.notify_all();
+    }
+    wakeAsync();
+}
+
+bool CSmartFocus::waitForLink(int nTimeoutMs)
+{
+    std::unique_lock<std::mutex> linkLock(m_LinkLock);
+
+    m_LinkCond.wait_for(linkLock, std::chrono::milliseconds(nTimeoutMs), [this] { return m_nLinkState == LINK_UP || !m_bSupervisorRunning; });
+    return m_nLinkState == LINK_UP;
+}
+
+void CSmartFocus::setLinkState(int nState)
+{
+    {
+        std::lock_guard<std::mutex> linkLock(m_LinkLock);
+        m_nLinkState = nState;
+        m_LinkCond.notify_all();
+    }
+    wakeAsync();
+}
+
+void CSmartFocus::supervisorThread()
+{
+    std::unique_lock<std::mutex> linkLock(m_LinkLock);
+
+    while(m_bSupervisorRunning) {
+        m_LinkCond.wait(linkLock, [this] { return m_nLinkState == LINK_DOWN || !m_bSupervisorRunning; });
+        if(!m_bSupervisorRunning)
+            break;
+        linkLock.unlock();
+        reconnect();
+        linkLock.lock();
+    }
+}
+
+// reopens the port with an exponential back off until the controller answers again or we're stopped.
+int CSmartFocus::reconnect()
+{
+    int nErr = ERR_COMMNOLINK;
+    int nDelayMs = RECONNECT_FIRST_DELAY;
+    int nAttempts = 0;
+    CStopWatch OutageTimer;
+
+    OutageTimer.Reset();
+    stopReader();
+    m_pSerx->close();
+    while(m_bSupervisorRunning) {
+        {
+            std::unique_lock<std::mutex> linkLock(m_LinkLock);
+            if(m_LinkCond.wait_for(linkLock, std::chrono::milliseconds(nDelayMs), [this] { return !m_bSupervisorRunning; }))
+                break;
+        }
+        nAttempts++;
+        nErr = m_pSerx->open(m_sPort.c_str(), 9600, SerXInterface::B_NOPARITY, "-DTR_CONTROL 1");
+        if(!nErr) {
+            m_pSerx->purgeTxRx();
+            // the replies flow again but host commands keep waiting until the state is restored.
+            startReader();
+            setLinkState(LINK_RESTORING);
+            nErr = probeController();
+            if(!nErr)
+                nErr = restoreState();
+            if(!nErr) {
+                m_Pacer.reset();
+                m_nReconnects++;
+                setLinkState(LINK_UP);
+                SF_LOG("CSmartFocus::reconnect link back after %.3f s, %d attempt(s)", OutageTimer.GetElapsedSeconds(), nAttempts);
+                return PLUGIN_OK;
+            }
+            setLinkState(LINK_DOWN);
+            stopReader();
+            m_pSerx->close();
+        }
+        SF_LOG("CSmartFocus::reconnect attempt %d failed : %d", nAttempts, nErr);
+        nDelayMs = std::min(nDelayMs * 2, RECONNECT_MAX_DELAY);
+    }
+    return nErr;
+}
+
+// picks up where we were : an interrupted move is either still running, done, or sent again.
+int CSmartFocus::restoreState()
+{
+    int nErr;
+    int nStatus;
+    int nPosition;
+    int nTarget;
+
+    nErr = refreshDeviceState(nStatus, nPosition);
+    if(nErr)
         return nErr;
+
+    if(m_nMoveState != MOVE_RUNNING) {
+        SF_LOG("CSmartFocus::restoreState idle at %d", nPosition);
+        return PLUGIN_OK;
     }
 
+    nTarget = m_nTargetPos;
+    if(nStatus == MOVING) {
+        // the 'c' will come on the new link.
+        SF_LOG("CSmartFocus::restoreState move to %d still running", nTarget);
+        return PLUGIN_OK;
+    }
+    // the outage would spoil the step rate calibration.
+    m_MotionModel.abort();
+    if(nPosition == nTarget) {
+        SF_LOG("CSmartFocus::restoreState move to %d completed during the outage", nTarget);
+        // as if the 'c' had made it, the queued moves go on.
+        moveEnded();
+        return PLUGIN_OK;
+    }
+
+    SF_LOG("CSmartFocus::restoreState move to %d interrupted at %d, sending it again", nTarget, nPosition);
+    m_nCurPos = nPosition;
+    invalidateState();
+    m_MotionModel.start(nPosition, nTarget);
+    journalState();
+    nErr = sendGoto(nTarget);
+    if(nErr == ERR_CMDFAILED) {
+        failMove();
+        return PLUGIN_OK;
+    }
     return nErr;
 }
 
-#ifdef PLUGIN_DEBUG
-void CSmartFocus::hexdump(const unsigned char* pszInputBuffer, unsigned char *pszOutputBuffer, int nInputBufferSize, int nOutpuBufferSize)
+// for a 'g' lost with the link, once it's back. a move that failed since shows in isGoToComplete.
+int CSmartFocus::restoredGotoResult()
+{
+    std::lock_guard<std::mutex> moveLock(m_MoveLock);
+
+    return m_nMoveState == MOVE_IDLE ? ERR_CMDFAILED : PLUGIN_OK;
+}
+
+#pragma mark move queue
+
+void CSmartFocus::startMoveQueue()
 {
-    unsigned char *pszBuf = pszOutputBuffer;
-    int nIdx=0;
+    if(m_bMoveQueueRunning)
+        return;
+    m_bMoveHandover = false;
+    m_bMoveQueueRunning = true;
+    m_MoveQueueThread = std::thread(&CSmartFocus::moveQueueThread, this);
+}
 
-    memset(pszOutputBuffer, 0, nOutpuBufferSize);
-    for(nIdx=0; nIdx < nInputBufferSize && pszBuf < (pszOutputBuffer + nOutpuBufferSize -3); nIdx++){
-        snprintf((char *)pszBuf,4,"%02X ", pszInputBuffer[nIdx]);
-        pszBuf+=3;
+void CSmartFocus::stopMoveQueue()
+{
+    {
+        std::lock_guard<std::mutex> moveLock(m_MoveLock);
+        m_bMoveQueueRunning = false;
+        m_MoveCond.notify_all();
     }
+    if(m_MoveQueueThread.joinable())
+        m_MoveQueueThread.join();
+}
+
+// the I/O thread can't wait for the reply of the next 'g' itself, this thread sends it.
+void CSmartFocus::moveQueueThread()
+{
+    std::unique_lock<std::mutex> moveLock(m_MoveLock);
+    long long llEtaNs;
+    long long llMoveEtaNs = 0;
+    long long llCheckNs = 0;
+    long long llNowNs;
+    int nVerifyMs = MOVE_VERIFY_FIRST;
+
+    while(m_bMoveQueueRunning) {
+        if(m_bMoveHandover) {
+            moveLock.unlock();
+            sendQueuedMove();
+            wakeAsync();
+            moveLock.lock();
+            continue;
+        }
+
+        // idle until the predicted end of the running move, the 'c' normally comes first.
+        llEtaNs = m_nMoveState == MOVE_RUNNING ? m_MotionModel.getEtaNs() : 0;
+        if(!llEtaNs) {
+            m_MoveCond.wait(moveLock);
+            continue;
+        }
+        if(llEtaNs != llMoveEtaNs) {
+            llMoveEtaNs = llEtaNs;
+            llCheckNs = llEtaNs + MOVE_VERIFY_GRACE * 1000000LL;
+            nVerifyMs = MOVE_VERIFY_FIRST;
+        }
+        llNowNs = CStopWatch::NowNs();
+        if(llNowNs < llCheckNs) {
+            m_MoveCond.wait_for(moveLock, std::chrono::nanoseconds(llCheckNs - llNowNs));
+            continue;
+        }
+
+        moveLock.unlock();
+        verifyMove(llEtaNs);
+        moveLock.lock();
+        llCheckNs = CStopWatch::NowNs() + nVerifyMs * 1000000LL;
+        nVerifyMs = std::min(nVerifyMs * 2, MOVE_VERIFY_MAX);
+    }
+}
+
+// the move should be over and no 'c' came : either it's late (stalled, slower than
+// predicted) or the 'c' got lost on the line, the controller tells which.
+void CSmartFocus::verifyMove(long long llEtaNs)
+{
+    CSFMessage<'t'> Status;
+    CSFMessage<'p'> Position;
+    SFTransaction *Batch[2] = {&Status.Transaction, &Position.Transaction};
+    int nStatus;
+    int nPosition;
+    int nErr;
+
+    // the supervisor deals with the move once the link is back.
+    if(m_nLinkState != LINK_UP)
+        return;
+    nErr = Transact(Batch, 2);
+    if(nErr || !Status.isValid() || !Position.isValid())
+        return;
+    nStatus = Status.byteValue();
+    statusReceived(nStatus);
+    nPosition = Position.wordValue();
+    if(nStatus == MOVING) {
+        SF_LOG("CSmartFocus::verifyMove still moving at %d, %d ms past the predicted end", nPosition, int((CStopWatch::NowNs() - llEtaNs) / 1000000));
+        return;
+    }
+
+    {
+        std::lock_guard<std::mutex> moveLock(m_MoveLock);
+        // the 'c' came in the meantime.
+        if(m_nMoveState != MOVE_RUNNING || m_MotionModel.getEtaNs() != llEtaNs)
+            return;
+        m_Stats.lostCompletion();
+        if(nPosition == m_nTargetPos) {
+            SF_LOG("CSmartFocus::verifyMove stopped on target %d, the 'c' was lost", nPosition);
+            moveEndedLocked();
+        }
+        else {
+            SF_LOG("CSmartFocus::verifyMove stopped at %d short of %d, the 'c' was lost", nPosition, m_nTargetPos.load());
+            m_nCurPos = nPosition;
+            failMoveLocked();
+        }
+    }
+    wakeAsync();
+}
+
+// the focuser stays MOVE_RUNNING for the host from the 'c' of one move to the 'c' of the last one.
+void CSmartFocus::sendQueuedMove()
+{
+    QueuedMove Move;
+    int nPos;
+    int nErr;
+    std::lock_guard<std::mutex> gotoLock(m_GotoLock);
+
+    {
+        std::lock_guard<std::mutex> moveLock(m_MoveLock);
+        // a halt came first.
+        if(!m_bMoveHandover)
+            return;
+        m_bMoveHandover = false;
+        while(true) {
+            if(m_nMoveState != MOVE_RUNNING || m_MoveQueue.empty())
+                return;
+            Move = m_MoveQueue.front();
+            m_MoveQueue.pop_front();
+            nPos = Move.bRelative ? m_nCurPos + Move.nValue : Move.nValue;
+            if(nPos < 0 || nPos > m_nPosLimit) {
+                SF_LOG("CSmartFocus::sendQueuedMove position %d out of range, queue dropped", nPos);
+                m_nMoveState = MOVE_FAILED;
+                m_MoveQueue.clear();
+                return;
+            }
+            if(nPos != m_nCurPos)
+                break;
+            // offsets that cancel out, nothing to send.
+            if(m_MoveQueue.empty()) {
+                m_nMoveState = MOVE_COMPLETE;
+                return;
+            }
+        }
+        invalidateState();
+        m_nTargetPos = nPos;
+        m_MotionModel.start(m_nCurPos, nPos);
+        journalState();
+        SF_LOG("CSmartFocus::sendQueuedMove goto position : %d, %d move(s) still queued", nPos, int(m_MoveQueue.size()));
+    }
+
+    nErr = sendGoto(nPos);
+    if(nErr) {
+        SF_LOG("CSmartFocus::sendQueuedMove goto error : %d", nErr);
+        failMove();
+    }
+}
+
+// 'c' : the move ended on target, snap the estimate to it and start the next queued one.
+void CSmartFocus::moveEnded()
+{
+    std::lock_guard<std::mutex> moveLock(m_MoveLock);
+
+    moveEndedLocked();
+}
+
+void CSmartFocus::moveEndedLocked()
+{
+    if(m_nMoveState != MOVE_RUNNING)
+        return;
+    m_MotionModel.complete();
+    m_nCurPos = m_nTargetPos.load();
+    if(m_MoveQueue.empty()) {
+        // on target and stopped, no need to ask.
+        m_bPosValid = true;
+        statusReceived(IDLE);
+        m_nMoveState = MOVE_COMPLETE;
+        journalState();
+        return;
+    }
+    m_bMoveHandover = true;
+    m_MoveCond.notify_all();
+}
+
+// 'r' instead of 'c', or a queued 'g' that didn't go through. the rest of the queue goes too.
+bool CSmartFocus::failMove()
+{
+    std::lock_guard<std::mutex> moveLock(m_MoveLock);
+
+    return failMoveLocked();
+}
+
+bool CSmartFocus::failMoveLocked()
+{
+    if(m_nMoveState != MOVE_RUNNING)
+        return false;
+    m_nMoveState = MOVE_FAILED;
+    m_MotionModel.abort();
+    m_MoveQueue.clear();
+    m_bMoveHandover = false;
+    invalidateState();
+    journalState();
+    return true;
 }
-#endif
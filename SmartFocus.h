@@ -16,6 +16,11 @@
 #include <exception>
 #include <typeinfo>
 #include <stdexcept>
+#include <thread>
+#include <mutex>
+#include <condition_variable>
+#include <atomic>
+#include <deque>
 
 #include "../../licensedinterfaces/sberrorx.h"
 #include "../../licensedinterfaces/serxinterface.h"
@@ -23,8 +28,17 @@
 #include "../../licensedinterfaces/sleeperinterface.h"
 
 #include "StopWatch.h"
+#include "MotionModel.h"
+#include "CommandPacer.h"
+#include "AsyncLog.h"
+#include "ProtocolTrace.h"
+#include "LinkStats.h"
+#include "StateJournal.h"
+#include "IOMultiplexer.h"
+#include "SmartFocusProtocol.h"
+#include "ReplyParser.h"
 
-// #define PLUGIN_DEBUG 2
+// #define PLUGIN_DEBUG 2     // debug log enabled from the start, otherwise see setDebugLog
 
 #define DRIVER_VERSION      1.0
 
@@ -32,15 +46,52 @@
 #define MAX_TIMEOUT 500
 #define LOG_BUFFER_SIZE 256
 
-#define CMD_WAIT_INTERVAL 200
+#define STATUS_CACHE_TTL    1000    // ms a status reply answers getDeviceStatus
+
+#define CONNECT_TIMEOUT     2000    // ms, longest the controller takes to come back from the DTR reset
+#define CONNECT_FIRST_PROBE 25      // ms, doubled after every unanswered status probe
+#define CONNECT_MAX_PROBE   200     // ms, so a controller coming up late isn't noticed much later
+
+#define RECONNECT_FIRST_DELAY   100     // ms before the first reopen, doubled after every failed attempt
+#define RECONNECT_MAX_DELAY     5000
+#define RECONNECT_WAIT          3000    // ms a command waits for the link to come back before failing
+
+// debug log, costs a single atomic load when logging is disabled
+#define SF_LOG(...)     do { if(m_bDebugLog) CAsyncLog::instance().log(__VA_ARGS__); } while(0)
 
 enum SmartFocus_Errors    {PLUGIN_OK = 0, NOT_CONNECTED, ND_CANT_CONNECT, PLUGIN_BAD_CMD_RESPONSE, COMMAND_FAILED};
 enum MotorDir       {NORMAL = 0 , REVERSE};
 enum MotorStatus    {IDLE = 0, MOVING};
+enum MoveState      {MOVE_IDLE = 0, MOVE_RUNNING, MOVE_COMPLETE, MOVE_FAILED};
+enum LinkState      {LINK_UP = 0, LINK_DOWN, LINK_RESTORING};
 
+#define MAX_PIPELINED_CMDS  8
+#define MOVE_QUEUE_SIZE     16  // moves waiting for the running one to end
 
-class CSmartFocus
+// no 'c' by the predicted end of a move : status and position are asked for, then again
+// with a doubling interval as long as the motor is still going.
+#define MOVE_VERIFY_GRACE   100     // ms after the predicted end
+#define MOVE_VERIFY_FIRST   100     // ms
+#define MOVE_VERIFY_MAX     1000
+
+// a move accepted while another one runs, sent when the 'c' of the previous one arrives.
+typedef struct {
+    bool            bRelative;
+    int             nValue;         // target, or offset from where the previous move ends
+} QueuedMove;
+
+// told from the driver threads that a reply, a move event or a link change came in, see SmartFocusAsync.h
+class CSFWaker
 {
+public:
+    virtual ~CSFWaker() {};
+    virtual void    wake() = 0;
+};
+
+class CSmartFocus : public CIOClient
+{
+    friend class CSFAsyncFocuser;
+
 public:
     CSmartFocus();
     ~CSmartFocus();
@@ -51,6 +102,7 @@ public:
 
     void        SetSerxPointer(SerXInterface *p) { m_pSerx = p; };
     void        setSleeper(SleeperInterface *pSleeper) { m_pSleeper = pSleeper; };
+    void        setWaker(CSFWaker *pWaker) { m_pWaker = pWaker; };
 
     // move commands
     int         haltFocuser();
@@ -61,44 +113,154 @@ public:
     int         isGoToComplete(bool &bComplete);
 
     // getter and setter
-    void        setDebugLog(bool bEnable) {m_bDebugLog = bEnable; };
+    void        setDebugLog(bool bEnable);
+    int         setTraceFile(const char *pszPath);
+    // last known state kept in pszPath across sessions, set before Connect. see StateJournal.h
+    int         setJournalFile(const char *pszPath);
+    long long   getJournalWrites() { return m_Journal.getWriteCount(); };
 
     int         getDeviceStatus(int &nStatus);
+    int         refreshDeviceState(int &nStatus, int &nPosition);
 
     int         getFirmwareVersion(char *pszVersion, int nStrMaxLen);
     int         getPosition(int &nPosition);
+    // the position when it's known without asking the controller, no I/O.
+    bool        getCachedPosition(int &nPosition) { return cachedPosition(nPosition); };
     int         syncMotorPosition(int nPos);
     int         getPosLimit(void);
     void        setPosLimit(int nLimit);
+    long long   getConnectTimeUs() { return m_llConnectTimeUs; };
+
+    // supervised reconnect, set before Connect
+    void        setAutoReconnect(bool bEnable) { m_bAutoReconnect = bEnable; };
+    bool        isLinkUp() { return m_nLinkState == LINK_UP; };
+    int         getReconnectCount() { return m_nReconnects; };
+
+    // predicted from the moves completed so far
+    int         getMoveTimeRemainingMs() { return m_MotionModel.getRemainingMs(); };
+    void        getMotionProfile(bool bOutward, MotionProfile &Profile) { m_MotionModel.getProfile(bOutward, Profile); };
+
+    // link statistics, reset on Connect
+    bool        getOpcodeStats(unsigned char cOpcode, OpcodeStats &Stats);
+    void        getLinkCounters(LinkCounters &Counters);
+    void        getLinkStatsReport(std::string &sReport);
+    void        resetLinkStats();
 
 protected:
 
-    int             Command(const unsigned char *pszCmd, int nCmdSize, unsigned char *pszResult, int nResultLen, int nResultMaxLen);
-    int             readResponse(unsigned char *pszRespBuffer, int nResultLen, int nBufferLen);
+    template <unsigned char OPCODE>
+    int             Command(CSFMessage<OPCODE> &Message, int nTimeoutMs = MAX_TIMEOUT)
+    {
+        SFTransaction *pTransaction = &Message.Transaction;
+        return Transact(&pTransaction, 1, nTimeoutMs);
+    }
+    int             Transact(SFTransaction **ppTransactions, int nCount, int nTimeoutMs = MAX_TIMEOUT);
+    int             transactOnce(SFTransaction **ppTransactions, int nCount, int nTimeoutMs);
+    int             pacingDelayUs(SFTransaction **ppTransactions, int nCount);
+    int             sendTransactions(SFTransaction **ppTransactions, int nCount, bool bPace);
+    int             readResponse(SFTransaction *pTransaction, int nTimeoutMs);
+    bool            responseDone(SFTransaction *pTransaction, std::unique_lock<std::mutex> &respLock, long long &llStaleUs);
+    int             finishResponse(SFTransaction *pTransaction);
+    int             probeController();
+    int             sendGoto(int nPos);
+    int             readFirmwareVersion();
+    void            statusReceived(int nStatus);
+    void            invalidateState();
+    int             queueMove(bool bRelative, int nValue);
+    int             armMove(bool bRelative, int nValue, bool &bSend, int &nPos);
+    void            gotoFailed(int nErr);
+    void            disarmMove();
+    bool            cachedPosition(int &nPosition);
+    int             positionReply(const CSFMessage<'p'> &Position, int nErr, int &nPosition);
+    bool            cachedStatus(int &nStatus);
+    int             statusReply(const CSFMessage<'t'> &Status, int nErr, int &nStatus);
+
+    // move queue thread
+    void            startMoveQueue();
+    void            stopMoveQueue();
+    void            moveQueueThread();
+    void            sendQueuedMove();
+    void            moveEnded();
+    void            moveEndedLocked();
+    bool            failMove();
+    bool            failMoveLocked();
+    void            verifyMove(long long llEtaNs);
+    void            journalState();
+    void            checkLastSession(int nStatus, int nPosition);
+
+    // receive side, served by the CIOMultiplexer thread
+    void            startReader();
+    void            stopReader();
+    virtual void    ioReceived(const unsigned char *pData, int nLen);
+    virtual void    ioFailed(int nErr);
+    virtual bool    ioExpectingData();
+    void            parseByte(unsigned char cByte, long long llNowUs);
+    int             routeReplies(SFEvent *pEvents, int nEvents);
+    void            moveEvents(const SFEvent *pEvents, int nEvents);
+    void            wakeAsync();
+
+    // link supervisor thread
+    void            startSupervisor();
+    void            stopSupervisor();
+    void            supervisorThread();
+    void            linkLost(const char *pszReason);
+    bool            waitForLink(int nTimeoutMs);
+    void            setLinkState(int nState);
+    int             reconnect();
+    int             restoreState();
+    int             restoredGotoResult();
 
     SerXInterface   *m_pSerx;
     SleeperInterface    *m_pSleeper;
+    CSFWaker            *m_pWaker;      // set before Connect
 
-    bool            m_bDebugLog;
+    std::atomic<bool>   m_bDebugLog;
     bool            m_bIsConnected;
     char            m_szFirmwareVersion[SERIAL_BUFFER_SIZE];
-    char            m_szLogBuffer[LOG_BUFFER_SIZE];
-
-    int             m_nCurPos;
-    int             m_nTargetPos;
-    int             m_nPosLimit;
-    bool            m_bMoving;
-    
-    CStopWatch      m_CmdTimer;
-    
-#ifdef PLUGIN_DEBUG
-    void            hexdump(const unsigned char* pszInputBuffer, unsigned char *pszOutputBuffer, int nInputBufferSize, int nOutpuBufferSize);
-    std::string m_sLogfilePath;
-	// timestamp for logs
-	char *timestamp;
-	time_t ltime;
-	FILE *Logfile;	  // LogFile
-#endif
+
+    std::atomic<int>    m_nCurPos;      // last position known for sure
+    std::atomic<bool>   m_bPosValid;    // m_nCurPos is the device position, until a move or a halt
+    std::atomic<int>    m_nCachedStatus;
+    std::atomic<long long>  m_llStatusUs;   // CCommandPacer::now() of the m_nCachedStatus reply, 0 if none
+    std::atomic<int>    m_nTargetPos;
+    std::atomic<int>    m_nPosLimit;    // read without the host mutex
+    long long       m_llConnectTimeUs;  // open to first valid status reply, last Connect
+    std::atomic<int>    m_nMoveState;   // MoveState, updated by the I/O thread on 'c' / 'r'
+    CMotionModel        m_MotionModel;  // position estimate while m_nMoveState is MOVE_RUNNING
+
+    CCommandPacer   m_Pacer;
+    CLinkStats      m_Stats;
+    CProtocolTrace  m_Trace;        // binary capture of the serial traffic, off unless setTraceFile was called
+    CStateJournal   m_Journal;      // off unless setJournalFile was called
+    JournalState    m_LastSession;
+    bool            m_bHaveLastSession; // m_LastSession was loaded and not checked against the controller yet
+
+    // the shared I/O thread drains the port and hands replies to the pending transactions
+    int                 m_nIOChannel;   // CIOMultiplexer channel, 0 when not registered
+    std::mutex          m_WriteLock;    // keeps the write order and the m_Pending order the same
+    std::mutex          m_RespLock;
+    std::condition_variable m_RespCond;
+    std::deque<SFTransaction *> m_Pending;  // sent, waiting for their reply, oldest first
+    CReplyParser        m_Parser;       // under m_RespLock
+
+    // moves requested during a move, coalesced and sent by the move queue thread on 'c'.
+    std::mutex          m_GotoLock;     // arming and sending a 'g', or disarming and sending the 's', go as one
+    std::mutex          m_MoveLock;     // m_MoveQueue and the MOVE_RUNNING transitions
+    std::condition_variable m_MoveCond;
+    std::deque<QueuedMove>  m_MoveQueue;
+    bool                m_bMoveHandover;    // the running move ended, the next one is due
+    std::thread         m_MoveQueueThread;
+    std::atomic<bool>   m_bMoveQueueRunning;
+
+    // the supervisor reopens the port when a read or write fails, while the host keeps its link.
+    bool                m_bAutoReconnect;
+    std::string         m_sPort;
+    std::atomic<int>    m_nLinkState;   // LinkState
+    std::atomic<int>    m_nReconnects;
+    std::thread         m_SupervisorThread;
+    std::atomic<bool>   m_bSupervisorRunning;
+    std::mutex          m_LinkLock;
+    std::condition_variable m_LinkCond;
 
 };
 
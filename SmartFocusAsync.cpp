@@ -0,0 +1,339 @@
+//
+//  SmartFocusAsync.cpp
+//
+//  SmartFocus X2 plugin
+//
+
+#include "SmartFocusAsync.h"
+
+#ifdef SF_ASYNC_AVAILABLE
+
+#include <climits>
+#include <algorithm>
+
+#pragma mark CSFTask
+
+std::coroutine_handle<> CSFTask::FinalAwaiter::await_suspend(Handle Task) noexcept
+{
+    promise_type &Promise = Task.promise();
+
+    if(Promise.m_Continuation)
+        return Promise.m_Continuation;
+    // spawned, nobody holds the task.
+    if(Promise.m_pnResult)
+        *Promise.m_pnResult = Promise.m_nResult;
+    if(Promise.m_pScheduler)
+        Promise.m_pScheduler->taskDone();
+    Task.destroy();
+    return std::noop_coroutine();
+}
+
+#pragma mark CSFWait
+
+CSFWait::CSFWait(CSFScheduler *pScheduler, ReadyFunc Ready, long long llDeadlineUs)
+{
+    m_pScheduler = pScheduler;
+    m_Ready = Ready;
+    m_llDeadlineUs = llDeadlineUs;
+    m_bReady = false;
+}
+
+bool CSFWait::await_ready()
+{
+    long long llRecheckUs = 0;
+
+    return check(llRecheckUs);
+}
+
+void CSFWait::await_suspend(std::coroutine_handle<> Waiter)
+{
+    m_Waiter = Waiter;
+    m_pScheduler->suspend(this);
+}
+
+// true when the wait is over, m_bReady tells why.
+bool CSFWait::check(long long &llRecheckUs)
+{
+    if(m_Ready && m_Ready(llRecheckUs)) {
+        m_bReady = true;
+        return true;
+    }
+    return CCommandPacer::now() >= m_llDeadlineUs;
+}
+
+#pragma mark CSFScheduler
+
+CSFScheduler::CSFScheduler()
+{
+    m_nTasks = 0;
+    m_bWoken = false;
+}
+
+void CSFScheduler::spawn(CSFTask Task, int *pnResult)
+{
+    CSFTask::Handle Handle = Task.release();
+
+    Handle.promise().m_pScheduler = this;
+    Handle.promise().m_pnResult = pnResult;
+    m_nTasks++;
+    m_Ready.push_back(Handle);
+}
+
+void CSFScheduler::run()
+{
+    std::coroutine_handle<> Waiter;
+    CSFWait *pWait;
+    long long llNowUs;
+    long long llWakeUs;
+    long long llRecheckUs;
+    size_t i;
+
+    while(m_nTasks > 0) {
+        while(!m_Ready.empty()) {
+            Waiter = m_Ready.front();
+            m_Ready.pop_front();
+            Waiter.resume();
+        }
+        if(m_nTasks <= 0)
+            break;
+
+        // a wake from here on is for the checks below or the wait after them.
+        {
+            std::lock_guard<std::mutex> wakeLock(m_WakeLock);
+            m_bWoken = false;
+        }
+        llWakeUs = LLONG_MAX;
+        for(i = 0; i < m_Waits.size(); ) {
+            pWait = m_Waits[i];
+            llRecheckUs = 0;
+            if(pWait->check(llRecheckUs)) {
+                // in the order they started waiting.
+                m_Ready.push_back(pWait->m_Waiter);
+                m_Waits.erase(m_Waits.begin() + i);
+                continue;
+            }
+            llWakeUs = std::min(llWakeUs, pWait->m_llDeadlineUs);
+            if(llRecheckUs)
+                llWakeUs = std::min(llWakeUs, llRecheckUs);
+            i++;
+        }
+        if(!m_Ready.empty())
+            continue;
+
+        std::unique_lock<std::mutex> wakeLock(m_WakeLock);
+        if(llWakeUs == LLONG_MAX) {
+            m_WakeCond.wait(wakeLock, [this] { return m_bWoken; });
+            continue;
+        }
+        llNowUs = CCommandPacer::now();
+        if(llWakeUs > llNowUs)
+            m_WakeCond.wait_for(wakeLock, std::chrono::microseconds(llWakeUs - llNowUs), [this] { return m_bWoken; });
+    }
+}
+
+void CSFScheduler::wake()
+{
+    std::lock_guard<std::mutex> wakeLock(m_WakeLock);
+
+    m_bWoken = true;
+    m_WakeCond.notify_one();
+}
+
+CSFWait CSFScheduler::sleepFor(int nMs)
+{
+    return sleepUs(nMs * 1000LL);
+}
+
+CSFWait CSFScheduler::sleepUs(long long llUs)
+{
+    return CSFWait(this, CSFWait::ReadyFunc(), CCommandPacer::now() + llUs);
+}
+
+CSFWait CSFScheduler::waitFor(CSFWait::ReadyFunc Ready, int nTimeoutMs)
+{
+    return CSFWait(this, Ready, nTimeoutMs < 0 ? LLONG_MAX : CCommandPacer::now() + nTimeoutMs * 1000LL);
+}
+
+// nobody signals a mutex release, it is tried again every SF_LOCK_POLL_US.
+CSFWait CSFScheduler::lock(std::mutex &Mutex)
+{
+    return waitFor([&Mutex](long long &llRecheckUs) {
+        if(Mutex.try_lock())
+            return true;
+        llRecheckUs = CCommandPacer::now() + SF_LOCK_POLL_US;
+        return false;
+    });
+}
+
+void CSFScheduler::suspend(CSFWait *pWait)
+{
+    m_Waits.push_back(pWait);
+}
+
+#pragma mark CSFAsyncFocuser
+
+CSFAsyncFocuser::CSFAsyncFocuser(CSmartFocus &Focuser, CSFScheduler &Scheduler)
+    : m_Focuser(Focuser), m_Scheduler(Scheduler)
+{
+    m_Focuser.setWaker(&m_Scheduler);
+}
+
+CSFAsyncFocuser::~CSFAsyncFocuser()
+{
+    m_Focuser.setWaker(NULL);
+}
+
+CSFTask CSFAsyncFocuser::gotoPosition(int nPos)
+{
+    if(!m_Focuser.m_bIsConnected)
+        co_return ERR_COMMNOLINK;
+    if(nPos > m_Focuser.m_nPosLimit)
+        co_return ERR_LIMITSEXCEEDED;
+    co_return co_await queueMove(false, nPos);
+}
+
+CSFTask CSFAsyncFocuser::moveRelativeToPosision(int nSteps)
+{
+    if(!m_Focuser.m_bIsConnected)
+        co_return ERR_COMMNOLINK;
+    co_return co_await queueMove(true, nSteps);
+}
+
+// CSmartFocus::queueMove, armed and written under m_GotoLock so a halt can't come in between.
+CSFTask CSFAsyncFocuser::queueMove(bool bRelative, int nValue)
+{
+    CSFMessage<'g'> Goto;
+    bool bSent = false;
+    int nErr;
+
+    nErr = co_await transact(&Goto.Transaction, &m_Focuser.m_GotoLock, [&](bool &bSend) {
+        int nPos;
+        int nArmErr = m_Focuser.armMove(bRelative, nValue, bSend, nPos);
+
+        if(!nArmErr && bSend) {
+            Goto.setParam(nPos);
+            bSent = true;
+        }
+        return nArmErr;
+    });
+    // refused by armMove, queued behind the running move, or never got to it.
+    if(!bSent)
+        co_return nErr;
+    if(!nErr && Goto.isRefused())
+        nErr = ERR_CMDFAILED;
+    if(nErr)
+        m_Focuser.gotoFailed(nErr);
+    co_return nErr;
+}
+
+CSFTask CSFAsyncFocuser::haltFocuser()
+{
+    CSFMessage<'s'> Stop;
+
+    if(!m_Focuser.m_bIsConnected)
+        co_return ERR_COMMNOLINK;
+
+    // disarmed and written under m_GotoLock, a queued move being sent goes out before the 's', not after it.
+    co_return co_await transact(&Stop.Transaction, &m_Focuser.m_GotoLock, [this](bool &bSend) {
+        m_Focuser.disarmMove();
+        bSend = true;
+        return PLUGIN_OK;
+    });
+}
+
+CSFTask CSFAsyncFocuser::getPosition(int &nPosition)
+{
+    CSFMessage<'p'> Position;
+    int nErr;
+
+    if(!m_Focuser.m_bIsConnected)
+        co_return ERR_COMMNOLINK;
+    if(m_Focuser.cachedPosition(nPosition))
+        co_return PLUGIN_OK;
+
+    nErr = co_await transact(&Position.Transaction);
+    co_return m_Focuser.positionReply(Position, nErr, nPosition);
+}
+
+CSFTask CSFAsyncFocuser::getDeviceStatus(int &nStatus)
+{
+    CSFMessage<'t'> Status;
+    int nErr;
+
+    if(!m_Focuser.m_bIsConnected)
+        co_return ERR_COMMNOLINK;
+    if(m_Focuser.cachedStatus(nStatus))
+        co_return PLUGIN_OK;
+
+    nErr = co_await transact(&Status.Transaction);
+    co_return m_Focuser.statusReply(Status, nErr, nStatus);
+}
+
+// the I/O thread ends the move on 'c' or 'r' and wakes the scheduler.
+CSFTask CSFAsyncFocuser::waitGoToComplete(bool &bComplete, int nTimeoutMs)
+{
+    if(!m_Focuser.m_bIsConnected)
+        co_return ERR_COMMNOLINK;
+
+    co_await m_Scheduler.waitFor([this](long long &) { return m_Focuser.m_nMoveState != MOVE_RUNNING || !m_Focuser.m_bIsConnected; }, nTimeoutMs);
+    co_return m_Focuser.isGoToComplete(bComplete);
+}
+
+// CSmartFocus::Transact : with the supervisor running a command lost with the link is sent again once it's back, but a 'g'.
+CSFTask CSFAsyncFocuser::transact(SFTransaction *pTransaction, std::mutex *pGate, BeforeSend Before, int nTimeoutMs)
+{
+    int nErr;
+
+    if(m_Focuser.m_bSupervisorRunning && m_Focuser.m_nLinkState != LINK_UP) {
+        co_await m_Scheduler.waitFor([this](long long &) { return m_Focuser.m_nLinkState == LINK_UP || !m_Focuser.m_bSupervisorRunning; }, RECONNECT_WAIT);
+        if(m_Focuser.m_nLinkState != LINK_UP)
+            co_return ERR_COMMNOLINK;
+    }
+
+    nErr = co_await transactOnce(pTransaction, pGate, Before, nTimeoutMs);
+    if(!nErr || !m_Focuser.m_bSupervisorRunning || m_Focuser.m_nLinkState == LINK_UP)
+        co_return nErr;
+
+    co_await m_Scheduler.waitFor([this](long long &) { return m_Focuser.m_nLinkState == LINK_UP || !m_Focuser.m_bSupervisorRunning; }, RECONNECT_WAIT);
+    if(m_Focuser.m_nLinkState != LINK_UP)
+        co_return ERR_COMMNOLINK;
+    if(pTransaction->pCmd[0] == 'g')
+        co_return m_Focuser.restoredGotoResult();
+    sfResetTransaction(*pTransaction);
+    co_return co_await transactOnce(pTransaction, pGate, Before, nTimeoutMs);
+}
+
+// CSmartFocus::transactOnce with the pacer gap and the reply awaited instead of slept on.
+CSFTask CSFAsyncFocuser::transactOnce(SFTransaction *pTransaction, std::mutex *pGate, BeforeSend Before, int nTimeoutMs)
+{
+    int nDelayUs;
+    int nErr = PLUGIN_OK;
+    bool bSend = true;
+
+    if(!m_Focuser.m_bIsConnected)
+        co_return ERR_COMMNOLINK;
+
+    while((nDelayUs = m_Focuser.pacingDelayUs(&pTransaction, 1)) > 0)
+        co_await m_Scheduler.sleepUs(nDelayUs);
+    if(pGate)
+        co_await m_Scheduler.lock(*pGate);
+    if(Before)
+        nErr = Before(bSend);
+    if(!nErr && bSend)
+        nErr = m_Focuser.sendTransactions(&pTransaction, 1, false);
+    if(pGate)
+        pGate->unlock();
+    if(nErr || !bSend || !pTransaction->nExpectedLen)
+        co_return nErr;
+
+    // a reply that stops half way is given up when it goes stale, the recheck is for that.
+    co_await m_Scheduler.waitFor([this, pTransaction](long long &llRecheckUs) {
+        std::unique_lock<std::mutex> respLock(m_Focuser.m_RespLock);
+        return m_Focuser.responseDone(pTransaction, respLock, llRecheckUs);
+    }, nTimeoutMs);
+
+    std::lock_guard<std::mutex> respLock(m_Focuser.m_RespLock);
+    co_return m_Focuser.finishResponse(pTransaction);
+}
+
+#endif // SF_ASYNC_AVAILABLE
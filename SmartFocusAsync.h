@@ -0,0 +1,206 @@
+//
+//  SmartFocusAsync.h
+//
+//  SmartFocus X2 plugin
+//  C++20 coroutine versions of the CSmartFocus calls, so one thread can run
+//  the focus sequences of many focusers (or a focuser and other gear) at the
+//  same time :
+//
+//      CSFTask focusRun(CSFAsyncFocuser &Focuser)
+//      {
+//          bool bComplete;
+//          int nErr = co_await Focuser.gotoPosition(12000);
+//          if(!nErr)
+//              nErr = co_await Focuser.waitGoToComplete(bComplete, 30000);
+//          co_return nErr;
+//      }
+//
+//      CSFScheduler Scheduler;
+//      CSFAsyncFocuser Focuser1(SmartFocus1, Scheduler), Focuser2(SmartFocus2, Scheduler);
+//      Scheduler.spawn(focusRun(Focuser1));
+//      Scheduler.spawn(focusRun(Focuser2));
+//      Scheduler.run();
+//
+//  The commands are written from the scheduler thread and the replies come in
+//  on the shared I/O thread as for the blocking calls. Instead of sleeping on
+//  the pacer or waiting on m_RespCond the coroutine is suspended, CSmartFocus
+//  wakes the scheduler (CSFWaker) when a reply, a move event or a link change
+//  comes in and the scheduler resumes whatever can go on. Nothing on the
+//  scheduler thread blocks on the serial port.
+//
+//  Calls return the same error codes as the blocking ones, out parameters are
+//  references and must outlive the co_await. The CSmartFocus is connected and
+//  disconnected with the blocking calls, and only one scheduler can drive it.
+//
+//  Only built when the compiler has coroutines (-std=c++20).
+//
+
+#ifndef __SMARTFOCUS_ASYNC__
+#define __SMARTFOCUS_ASYNC__
+
+#if defined(__cpp_impl_coroutine) && __cpp_impl_coroutine >= 201902L && defined(__has_include)
+#if __has_include(<coroutine>)
+#define SF_ASYNC_AVAILABLE
+#endif
+#endif
+
+#ifdef SF_ASYNC_AVAILABLE
+
+#include <coroutine>
+#include <functional>
+#include <vector>
+#include <deque>
+#include <mutex>
+#include <condition_variable>
+
+#include "SmartFocus.h"
+
+#define SF_WAIT_FOREVER     -1
+#define SF_LOCK_POLL_US     1000    // a std::mutex held by a driver thread is tried again this often
+
+class CSFScheduler;
+
+// a coroutine returning an error code. started when awaited or spawned.
+class CSFTask
+{
+public:
+    class promise_type;
+    typedef std::coroutine_handle<promise_type> Handle;
+
+    // resumes whoever awaited the task, a spawned task is done and goes away.
+    class FinalAwaiter
+    {
+    public:
+        bool            await_ready() noexcept { return false; };
+        std::coroutine_handle<> await_suspend(Handle Task) noexcept;
+        void            await_resume() noexcept {};
+    };
+
+    class promise_type
+    {
+    public:
+        CSFTask         get_return_object() { return CSFTask(Handle::from_promise(*this)); };
+        std::suspend_always initial_suspend() noexcept { return {}; };
+        FinalAwaiter    final_suspend() noexcept { return {}; };
+        void            return_value(int nResult) { m_nResult = nResult; };
+        // the driver reports errors with codes, an exception here is a bug.
+        void            unhandled_exception() { std::terminate(); };
+
+        int                     m_nResult = 0;
+        std::coroutine_handle<> m_Continuation;
+        CSFScheduler            *m_pScheduler = NULL;  // spawned
+        int                     *m_pnResult = NULL;
+    };
+
+    explicit CSFTask(Handle Task) : m_Task(Task) {};
+    CSFTask(CSFTask &&Other) noexcept : m_Task(Other.m_Task) { Other.m_Task = NULL; };
+    CSFTask(const CSFTask &) = delete;
+    CSFTask &operator=(const CSFTask &) = delete;
+    ~CSFTask() { if(m_Task) m_Task.destroy(); };
+
+    // co_await runs the task and returns its error code.
+    bool            await_ready() { return false; };
+    std::coroutine_handle<> await_suspend(std::coroutine_handle<> Caller) { m_Task.promise().m_Continuation = Caller; return m_Task; };
+    int             await_resume() { return m_Task.promise().m_nResult; };
+
+    Handle          release() { Handle Task = m_Task; m_Task = NULL; return Task; };
+
+protected:
+    Handle          m_Task;
+};
+
+// suspends until Ready says so or the deadline passes. co_await returns true when Ready
+// did, Ready is only ever called from the scheduler thread and can set llRecheckUs
+// (CCommandPacer::now() time) to be asked again then with no wake in between.
+class CSFWait
+{
+public:
+    typedef std::function<bool(long long &llRecheckUs)> ReadyFunc;
+
+    CSFWait(CSFScheduler *pScheduler, ReadyFunc Ready, long long llDeadlineUs);
+
+    bool            await_ready();
+    void            await_suspend(std::coroutine_handle<> Waiter);
+    bool            await_resume() { return m_bReady; };
+
+protected:
+    friend class CSFScheduler;
+
+    bool            check(long long &llRecheckUs);
+
+    CSFScheduler    *m_pScheduler;
+    ReadyFunc       m_Ready;
+    long long       m_llDeadlineUs;     // LLONG_MAX for none
+    bool            m_bReady;
+    std::coroutine_handle<> m_Waiter;
+};
+
+// runs the coroutines of one thread, from run().
+class CSFScheduler : public CSFWaker
+{
+public:
+    CSFScheduler();
+
+    // started by the next run(), *pnResult gets its error code when it ends.
+    void            spawn(CSFTask Task, int *pnResult = NULL);
+    // returns once every spawned task has ended.
+    void            run();
+
+    // CSFWaker, from any thread
+    virtual void    wake();
+
+    CSFWait         sleepFor(int nMs);
+    CSFWait         sleepUs(long long llUs);
+    CSFWait         waitFor(CSFWait::ReadyFunc Ready, int nTimeoutMs = SF_WAIT_FOREVER);
+    // a std::mutex shared with the driver threads, without blocking the scheduler. unlock it before the next co_await.
+    CSFWait         lock(std::mutex &Mutex);
+
+protected:
+    friend class CSFWait;
+    friend class CSFTask::FinalAwaiter;
+
+    void            suspend(CSFWait *pWait);
+    void            taskDone() { m_nTasks--; };
+
+    std::deque<std::coroutine_handle<> >  m_Ready;
+    std::vector<CSFWait *>  m_Waits;
+    int             m_nTasks;
+
+    std::mutex      m_WakeLock;
+    std::condition_variable m_WakeCond;
+    bool            m_bWoken;
+};
+
+// the awaitable CSmartFocus calls
+class CSFAsyncFocuser
+{
+public:
+    CSFAsyncFocuser(CSmartFocus &Focuser, CSFScheduler &Scheduler);
+    ~CSFAsyncFocuser();
+
+    CSFTask         gotoPosition(int nPos);
+    CSFTask         moveRelativeToPosision(int nSteps);
+    CSFTask         haltFocuser();
+    CSFTask         getPosition(int &nPosition);
+    CSFTask         getDeviceStatus(int &nStatus);
+    // resumes when the move ends, like isGoToComplete. bComplete is false when nTimeoutMs ran out first.
+    CSFTask         waitGoToComplete(bool &bComplete, int nTimeoutMs = SF_WAIT_FOREVER);
+
+    CSmartFocus     &getFocuser() { return m_Focuser; };
+
+protected:
+    // runs with the gate held just before the write. an error, or bSend false, and nothing is written.
+    typedef std::function<int(bool &bSend)> BeforeSend;
+
+    CSFTask         queueMove(bool bRelative, int nValue);
+    // Transact for a single command. pGate is taken around Before and the write, see queueMove and haltFocuser.
+    CSFTask         transact(SFTransaction *pTransaction, std::mutex *pGate = NULL, BeforeSend Before = BeforeSend(), int nTimeoutMs = MAX_TIMEOUT);
+    CSFTask         transactOnce(SFTransaction *pTransaction, std::mutex *pGate, BeforeSend Before, int nTimeoutMs);
+
+    CSmartFocus     &m_Focuser;
+    CSFScheduler    &m_Scheduler;
+};
+
+#endif // SF_ASYNC_AVAILABLE
+
+#endif //__SMARTFOCUS_ASYNC__
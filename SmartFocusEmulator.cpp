@@ -0,0 +1,714 @@
+//
+//  SmartFocusEmulator.cpp
+//
+//  SmartFocus X2 plugin
+//  In-process emulation of the JMI Smart Focus firmware.
+//
+//  The host side (readFile, writeFile, ...) runs in real time. Every byte the
+//  "device" sends is queued with the time at which it would have finished
+//  arriving on a real 8N1 line, so reads block exactly as long as they would
+//  against the hardware. Motion is modelled analytically (start, end, target)
+//  and the async 'c' completion byte is materialised lazily once the move
+//  end time has passed.
+//
+//  Faults are applied when a frame is queued : its bytes are dropped,
+//  doubled, held back or garbled on their way to the host queue, a stall
+//  pushes the move end back and an unplug kills the open handle and makes
+//  open fail until the adapter is back. The motor doesn't care about the
+//  USB side, a move goes on through an outage and its 'c' is lost.
+//
+
+#include "SmartFocusEmulator.h"
+#include "SmartFocus.h"
+#include <stdlib.h>
+#include <string.h>
+#include <thread>
+#include <sstream>
+
+#define EMU_BOOT_NOISE_BYTE 0xFE
+#define EMU_CORRUPT_MASK    0x5A    // xor applied to a corrupted byte
+#define EMU_STALL_FOREVER   24      // hours, a stall of 0 ms until the next 's' or 'g'
+
+CSmartFocusEmulator::CSmartFocusEmulator()
+{
+    setConfig(defaultConfig());
+    m_bOpen = false;
+    m_nNextFault = 0;
+    m_nFaultMatches = 0;
+}
+
+CSmartFocusEmulator::CSmartFocusEmulator(const EmulatorConfig &Config)
+{
+    setConfig(Config);
+    m_bOpen = false;
+    m_nNextFault = 0;
+    m_nFaultMatches = 0;
+}
+
+CSmartFocusEmulator::~CSmartFocusEmulator()
+{
+}
+
+EmulatorConfig CSmartFocusEmulator::defaultConfig()
+{
+    EmulatorConfig Config;
+
+    Config.nBaudRate = 9600;
+    Config.bByteTiming = true;
+    Config.nTurnaroundUs = 2000;
+    Config.nJitterUs = 500;
+    Config.dStepsPerSecond = 1000.0;
+    Config.nMoveOverheadMs = 50;
+    Config.nBootMs = 1200;
+    Config.nQuirks = EMU_QUIRK_NONE;
+    Config.nFirmwareVersion = 11;
+    Config.nStartPosition = 1000;
+    Config.nMaxPosition = 65535;
+    Config.nSeed = 1;
+    return Config;
+}
+
+void CSmartFocusEmulator::setConfig(const EmulatorConfig &Config)
+{
+    std::lock_guard<std::mutex> lock(m_Lock);
+
+    m_Config = Config;
+    m_Rng.seed(Config.nSeed);
+    m_RxQueue.clear();
+    m_nCmdLen = 0;
+    m_tTxDone = m_tRxLineFree = m_tBootDone = Clock::now();
+    m_bBootNoiseSent = true;
+    m_nPosition = m_nTarget = Config.nStartPosition;
+    m_tMoveStart = m_tMoveEnd = Clock::now();
+    m_bMoving = false;
+    m_bCompletionQueued = false;
+    m_bStalled = false;
+    m_nStallRecord = -1;
+    m_bUnplugPending = false;
+    m_tUnplug = m_tReplug = Clock::now();
+}
+
+EmulatorConfig CSmartFocusEmulator::getConfig()
+{
+    std::lock_guard<std::mutex> lock(m_Lock);
+    return m_Config;
+}
+
+#pragma mark SerXInterface
+int CSmartFocusEmulator::open(const char* pszPort, const unsigned long& dwBaudRate, const Parity& parity, const char* pszSession)
+{
+    std::lock_guard<std::mutex> lock(m_Lock);
+    Clock::time_point tNow = Clock::now();
+
+    (void)pszPort;
+    (void)parity;
+    (void)pszSession;
+
+    if(m_bOpen)
+        return ERR_COMMOPENING;
+
+    if(dwBaudRate != m_Config.nBaudRate)
+        return ERR_COMMSETTINGS;
+
+    // unplugged, the port isn't there.
+    if(m_tUnplug <= tNow && tNow < m_tReplug)
+        return ERR_COMMOPENING;
+    m_bUnplugPending = m_bUnplugPending && m_tUnplug > tNow;
+
+    m_bOpen = true;
+    // what the device sent while the port was closed is lost.
+    availableLocked(tNow);
+    m_RxQueue.clear();
+    m_nCmdLen = 0;
+    m_tTxDone = m_tRxLineFree = tNow;
+    // asserting DTR resets the controller, it keeps its position across the reset.
+    if(m_Config.nQuirks & EMU_QUIRK_BOOT_DELAY) {
+        m_tBootDone = tNow + std::chrono::milliseconds(m_Config.nBootMs);
+        m_bBootNoiseSent = !(m_Config.nQuirks & EMU_QUIRK_BOOT_NOISE);
+    }
+    else {
+        m_tBootDone = tNow;
+        m_bBootNoiseSent = true;
+    }
+    return SB_OK;
+}
+
+int CSmartFocusEmulator::close()
+{
+    std::lock_guard<std::mutex> lock(m_Lock);
+
+    m_bOpen = false;
+    m_RxQueue.clear();
+    m_nCmdLen = 0;
+    m_RxCond.notify_all();
+    return SB_OK;
+}
+
+bool CSmartFocusEmulator::isConnected(void) const
+{
+    std::lock_guard<std::mutex> lock(m_Lock);
+    return m_bOpen && !(m_bUnplugPending && m_tUnplug <= Clock::now());
+}
+
+int CSmartFocusEmulator::flushTx(void)
+{
+    Clock::time_point tTxDone;
+    {
+        std::lock_guard<std::mutex> lock(m_Lock);
+        if(!portAliveLocked(Clock::now()))
+            return ERR_COMMNOLINK;
+        tTxDone = m_tTxDone;
+    }
+    // like tcdrain, block until the last byte is on the wire.
+    if(tTxDone > Clock::now())
+        std::this_thread::sleep_until(tTxDone);
+    return SB_OK;
+}
+
+int CSmartFocusEmulator::purgeTxRx(void)
+{
+    std::lock_guard<std::mutex> lock(m_Lock);
+    Clock::time_point tNow = Clock::now();
+
+    if(!portAliveLocked(tNow))
+        return ERR_COMMNOLINK;
+
+    availableLocked(tNow);
+    // only what already reached the host buffer is discarded, bytes still on the wire arrive later.
+    while(!m_RxQueue.empty() && m_RxQueue.front().tReady <= tNow)
+        m_RxQueue.pop_front();
+    return SB_OK;
+}
+
+int CSmartFocusEmulator::waitForBytesRx(const int& nNumber, const int& nTimeOutMs)
+{
+    std::unique_lock<std::mutex> lock(m_Lock);
+    Clock::time_point tDeadline = Clock::now() + std::chrono::milliseconds(nTimeOutMs);
+
+    while(true) {
+        Clock::time_point tNow = Clock::now();
+        if(!portAliveLocked(tNow))
+            return ERR_COMMNOLINK;
+        if(availableLocked(tNow) >= nNumber)
+            return SB_OK;
+        if(tNow >= tDeadline)
+            return ERR_RXTIMEOUT;
+
+        Clock::time_point tWake = tDeadline;
+        if(!m_RxQueue.empty() && m_RxQueue.front().tReady < tWake)
+            tWake = m_RxQueue.front().tReady;
+        if(m_bMoving && !m_bCompletionQueued && m_tMoveEnd < tWake)
+            tWake = m_tMoveEnd;
+        if(m_bUnplugPending && m_tUnplug < tWake)
+            tWake = m_tUnplug;
+        m_RxCond.wait_until(lock, tWake);
+    }
+}
+
+int CSmartFocusEmulator::readFile(void* lpBuffer, const unsigned long dwTotalBytesToRead, unsigned long& dwBytesRead, const unsigned long& dwTimeOut)
+{
+    std::unique_lock<std::mutex> lock(m_Lock);
+    unsigned char *pBuffer = (unsigned char *)lpBuffer;
+    Clock::time_point tDeadline = Clock::now() + std::chrono::milliseconds(dwTimeOut);
+
+    dwBytesRead = 0;
+    while(true) {
+        Clock::time_point tNow = Clock::now();
+        if(!portAliveLocked(tNow))
+            return ERR_COMMNOLINK;
+
+        // hand over whatever has arrived so far.
+        while(dwBytesRead < dwTotalBytesToRead && !m_RxQueue.empty() && m_RxQueue.front().tReady <= tNow) {
+            pBuffer[dwBytesRead++] = m_RxQueue.front().cByte;
+            m_RxQueue.pop_front();
+        }
+        if(dwBytesRead >= dwTotalBytesToRead || tNow >= tDeadline)
+            return SB_OK;   // short read on timeout, like the host SerX
+
+        availableLocked(tNow);
+        Clock::time_point tWake = tDeadline;
+        if(!m_RxQueue.empty() && m_RxQueue.front().tReady < tWake)
+            tWake = m_RxQueue.front().tReady;
+        if(m_bMoving && !m_bCompletionQueued && m_tMoveEnd < tWake)
+            tWake = m_tMoveEnd;
+        if(!m_bBootNoiseSent && m_tBootDone < tWake)
+            tWake = m_tBootDone;
+        if(m_bUnplugPending && m_tUnplug < tWake)
+            tWake = m_tUnplug;
+        if(tWake > tNow)
+            m_RxCond.wait_until(lock, tWake);
+    }
+}
+
+int CSmartFocusEmulator::writeFile(void* lpBuffer, const unsigned long& dwBytesToWrite, unsigned long& dwBytesWritten)
+{
+    std::lock_guard<std::mutex> lock(m_Lock);
+    const unsigned char *pBuffer = (const unsigned char *)lpBuffer;
+    Clock::time_point tNow = Clock::now();
+    Clock::time_point tArrival;
+    unsigned long i;
+
+    dwBytesWritten = 0;
+    if(!portAliveLocked(tNow))
+        return ERR_COMMNOLINK;
+
+    tArrival = (m_tTxDone > tNow) ? m_tTxDone : tNow;
+    for(i = 0; i < dwBytesToWrite; i++) {
+        tArrival += byteTime();
+        // input is ignored while the controller is rebooting.
+        if(tArrival < m_tBootDone)
+            continue;
+        m_szCmdBuf[m_nCmdLen++] = pBuffer[i];
+        if(m_nCmdLen >= commandLength(m_szCmdBuf[0])) {
+            processCommand(m_szCmdBuf, m_nCmdLen, tArrival);
+            m_nCmdLen = 0;
+        }
+    }
+    m_tTxDone = tArrival;
+    dwBytesWritten = dwBytesToWrite;
+    m_RxCond.notify_all();
+    return SB_OK;
+}
+
+int CSmartFocusEmulator::bytesWaitingRx(void)
+{
+    std::lock_guard<std::mutex> lock(m_Lock);
+    Clock::time_point tNow = Clock::now();
+
+    if(!portAliveLocked(tNow))
+        return 0;
+    return availableLocked(tNow);
+}
+
+#pragma mark device side inspection
+int CSmartFocusEmulator::getDevicePosition()
+{
+    std::lock_guard<std::mutex> lock(m_Lock);
+    return positionAt(Clock::now());
+}
+
+bool CSmartFocusEmulator::isDeviceMoving()
+{
+    std::lock_guard<std::mutex> lock(m_Lock);
+    return movingAt(Clock::now());
+}
+
+#pragma mark firmware model
+int CSmartFocusEmulator::commandLength(unsigned char cOpcode)
+{
+    return sfCommandLength(cOpcode);
+}
+
+void CSmartFocusEmulator::processCommand(const unsigned char *pCmd, int nLen, Clock::time_point tArrival)
+{
+    unsigned char szReply[4];
+    Clock::time_point tReply = tArrival + turnaround();
+    Clock::time_point tRefused;
+    const EmulatorFault *pFault;
+    int nTarget;
+
+    (void)nLen;
+    // bring the async state (completion byte) up to the time the command is seen.
+    availableLocked(tArrival);
+
+    pFault = matchFault(pCmd[0]);
+    if(pFault && pFault->nType == EMU_FAULT_REFUSE) {
+        szReply[0] = 'r';
+        tRefused = queueReply(szReply, 1, tReply);
+        recordFault(pFault, tRefused, tRefused);
+        return;
+    }
+
+    switch(pCmd[0]) {
+        case 'g':
+            nTarget = (int(pCmd[1]) << 8) | int(pCmd[2]);
+            if(nTarget > m_Config.nMaxPosition || (movingAt(tArrival) && (m_Config.nQuirks & EMU_QUIRK_REFUSE_WHEN_BUSY))) {
+                szReply[0] = 'r';
+                queueReply(szReply, 1, tReply, pFault);
+                break;
+            }
+            szReply[0] = 'g';
+            queueReply(szReply, 1, tReply, pFault);
+            // a new goto while moving re-targets from wherever the motor is now.
+            m_nPosition = positionAt(tReply);
+            endStallAt(tReply);
+            m_nTarget = nTarget;
+            m_tMoveStart = tReply;
+            m_tMoveEnd = tReply + std::chrono::milliseconds(m_Config.nMoveOverheadMs)
+                        + std::chrono::microseconds((long long)(abs(nTarget - m_nPosition) * 1000000.0 / m_Config.dStepsPerSecond));
+            m_bMoving = true;
+            m_bCompletionQueued = false;
+            break;
+
+        case 's':
+            if(movingAt(tArrival)) {
+                stopMotionAt(tArrival);
+                szReply[0] = 's';
+                if(m_Config.nQuirks & EMU_QUIRK_NO_C_AFTER_HALT) {
+                    queueReply(szReply, 1, tReply, pFault);
+                }
+                else {
+                    szReply[1] = 'c';
+                    queueReply(szReply, 2, tReply, pFault);
+                }
+            }
+            else {
+                szReply[0] = 's';
+                queueReply(szReply, 1, tReply, pFault);
+            }
+            break;
+
+        case 'p':
+            nTarget = positionAt(tReply);
+            szReply[0] = 'p';
+            szReply[1] = (nTarget & 0xff00) >> 8;
+            szReply[2] = (nTarget & 0x00ff);
+            queueReply(szReply, 3, tReply, pFault);
+            break;
+
+        case 't':
+            szReply[0] = 't';
+            szReply[1] = movingAt(tReply) ? MOVING : IDLE;
+            queueReply(szReply, 2, tReply, pFault);
+            break;
+
+        case 'b':
+            szReply[0] = 'b';
+            szReply[1] = (unsigned char)m_Config.nFirmwareVersion;
+            queueReply(szReply, 2, tReply, pFault);
+            break;
+
+        case 'z':
+            if(movingAt(tArrival)) {
+                if(m_Config.nQuirks & EMU_QUIRK_REFUSE_WHEN_BUSY) {
+                    szReply[0] = 'r';
+                    queueReply(szReply, 1, tReply, pFault);
+                    break;
+                }
+                stopMotionAt(tArrival);
+            }
+            m_nPosition = m_nTarget = 0;
+            szReply[0] = 'z';
+            queueReply(szReply, 1, tReply, pFault);
+            break;
+
+        default:
+            // unknown opcodes are silently dropped by the firmware.
+            break;
+    }
+    // after the command, a stall on a 'g' holds the move it started.
+    startFault(pFault, tReply);
+}
+
+// returns when the last byte is in, byte faults (drop, duplicate, delay, corrupt) are applied here.
+CSmartFocusEmulator::Clock::time_point CSmartFocusEmulator::queueReply(const unsigned char *pData, int nLen, Clock::time_point tReady, const EmulatorFault *pFault)
+{
+    RxByte Byte;
+    std::uniform_int_distribution<int> Jitter(0, m_Config.nJitterUs > 0 ? m_Config.nJitterUs : 0);
+    Clock::time_point tOnset;
+    int nType = -1;
+    int nLast = 0;
+    bool bHit;
+
+    if(pFault && pFault->nType <= EMU_FAULT_CORRUPT && pFault->nByte < nLen) {
+        nType = pFault->nType;
+        nLast = pFault->nCount > 0 ? pFault->nByte + pFault->nCount : nLen;
+    }
+
+    tReady += std::chrono::microseconds(Jitter(m_Rng));
+    for(int i = 0; i < nLen; i++) {
+        bHit = nType >= 0 && i >= pFault->nByte && i < nLast;
+        // the device -> host line is serial too, bytes can't overlap.
+        if(tReady < m_tRxLineFree)
+            tReady = m_tRxLineFree;
+        tReady += byteTime();
+        if(bHit && i == pFault->nByte) {
+            tOnset = tReady;
+            // a hub sitting on its buffer, what follows waits too.
+            if(nType == EMU_FAULT_DELAY)
+                tReady += std::chrono::milliseconds(pFault->nDurationMs);
+        }
+        m_tRxLineFree = tReady;
+        Byte.tReady = tReady;
+        Byte.cByte = (bHit && nType == EMU_FAULT_CORRUPT) ? pData[i] ^ EMU_CORRUPT_MASK : pData[i];
+        // a dropped byte still took its time on the wire.
+        if(!bHit || nType != EMU_FAULT_DROP)
+            m_RxQueue.push_back(Byte);
+        if(bHit && nType == EMU_FAULT_DUPLICATE) {
+            tReady += byteTime();
+            m_tRxLineFree = tReady;
+            Byte.tReady = tReady;
+            m_RxQueue.push_back(Byte);
+        }
+    }
+    if(nType >= 0)
+        recordFault(pFault, tOnset, nType == EMU_FAULT_DELAY ? tOnset + std::chrono::milliseconds(pFault->nDurationMs) : tOnset);
+    return tReady;
+}
+
+// emits the lazily generated async bytes due by tNow and returns how many bytes the host can read.
+int CSmartFocusEmulator::availableLocked(Clock::time_point tNow)
+{
+    unsigned char cByte;
+    const EmulatorFault *pFault;
+    Clock::time_point tDone;
+    int nCount = 0;
+
+    if(!m_bBootNoiseSent && m_tBootDone <= tNow) {
+        cByte = EMU_BOOT_NOISE_BYTE;
+        queueReply(&cByte, 1, m_tBootDone);
+        m_bBootNoiseSent = true;
+    }
+    if(m_bMoving && !m_bCompletionQueued && m_tMoveEnd <= tNow) {
+        m_bCompletionQueued = true;
+        // a move failure is an 'r' in place of the 'c'.
+        pFault = matchFault('c');
+        cByte = (pFault && pFault->nType == EMU_FAULT_REFUSE) ? 'r' : 'c';
+        tDone = queueReply(&cByte, 1, m_tMoveEnd, pFault);
+        if(cByte == 'r')
+            recordFault(pFault, tDone, tDone);
+        else
+            startFault(pFault, m_tMoveEnd);
+    }
+    if(m_bMoving && m_tMoveEnd <= tNow) {
+        m_nPosition = m_nTarget;
+        m_bMoving = false;
+        endStallAt(m_tMoveEnd);
+    }
+
+    for(std::deque<RxByte>::iterator it = m_RxQueue.begin(); it != m_RxQueue.end() && it->tReady <= tNow; ++it)
+        nCount++;
+    return nCount;
+}
+
+int CSmartFocusEmulator::positionAt(Clock::time_point t)
+{
+    Clock::duration Overhead = std::chrono::milliseconds(m_Config.nMoveOverheadMs);
+    Clock::time_point tRunStart = m_tMoveStart + Overhead / 2;
+    Clock::time_point tRunEnd = m_tMoveEnd - Overhead / 2;
+
+    // the motor doesn't advance during a stall, the rest of the move comes after it.
+    if(m_bStalled) {
+        tRunEnd -= m_StallLength;
+        if(t > m_tStallStart)
+            t = (t < m_tStallStart + m_StallLength) ? m_tStallStart : t - m_StallLength;
+    }
+    if(!m_bMoving || t <= tRunStart)
+        return m_nPosition;
+    if(t >= tRunEnd)
+        return m_nTarget;
+
+    double dFraction = std::chrono::duration<double>(t - tRunStart).count() / std::chrono::duration<double>(tRunEnd - tRunStart).count();
+    return m_nPosition + int((m_nTarget - m_nPosition) * dFraction);
+}
+
+bool CSmartFocusEmulator::movingAt(Clock::time_point t)
+{
+    return m_bMoving && t < m_tMoveEnd;
+}
+
+void CSmartFocusEmulator::stopMotionAt(Clock::time_point t)
+{
+    m_nPosition = m_nTarget = positionAt(t);
+    m_bMoving = false;
+    endStallAt(t);
+}
+
+CSmartFocusEmulator::Clock::duration CSmartFocusEmulator::byteTime()
+{
+    if(!m_Config.bByteTiming || !m_Config.nBaudRate)
+        return Clock::duration::zero();
+    // 8N1 : start + 8 data + stop bits
+    return std::chrono::duration_cast<Clock::duration>(std::chrono::nanoseconds(10ULL * 1000000000ULL / m_Config.nBaudRate));
+}
+
+CSmartFocusEmulator::Clock::duration CSmartFocusEmulator::turnaround()
+{
+    return std::chrono::microseconds(m_Config.nTurnaroundUs);
+}
+
+#pragma mark fault injection
+static long long nsOf(std::chrono::steady_clock::time_point t)
+{
+    return std::chrono::duration_cast<std::chrono::nanoseconds>(t.time_since_epoch()).count();
+}
+
+void CSmartFocusEmulator::setFaultScript(const std::vector<EmulatorFault> &Script)
+{
+    std::lock_guard<std::mutex> lock(m_Lock);
+
+    m_FaultScript = Script;
+    m_nNextFault = 0;
+    m_nFaultMatches = 0;
+    m_FaultRecords.clear();
+    m_nStallRecord = -1;
+}
+
+void CSmartFocusEmulator::getFaultRecords(std::vector<EmulatorFaultRecord> &Records)
+{
+    std::lock_guard<std::mutex> lock(m_Lock);
+
+    Records = m_FaultRecords;
+}
+
+bool CSmartFocusEmulator::parseFaultScript(const char *pszScript, std::vector<EmulatorFault> &Script)
+{
+    static const char *pszTypes[] = {"drop", "dup", "delay", "corrupt", "stall", "refuse", "disconnect"};
+    std::istringstream Entries(pszScript ? pszScript : "");
+    std::string sEntry;
+    std::string sWord;
+    EmulatorFault Fault;
+    size_t nPos;
+    const char *pszValue;
+    char *pszEnd;
+    int nValue;
+    int i;
+
+    Script.clear();
+    while(std::getline(Entries, sEntry, ';')) {
+        std::istringstream Words(sEntry);
+        if(!(Words >> sWord))
+            continue;
+        memset(&Fault, 0, sizeof(Fault));
+        Fault.nType = -1;
+        Fault.nCount = 1;
+        nPos = sWord.find('@');
+        if(nPos != std::string::npos) {
+            if(sWord.size() != nPos + 2)
+                return false;
+            Fault.cTrigger = (unsigned char)sWord[nPos + 1];
+            sWord.resize(nPos);
+        }
+        for(i = 0; i <= EMU_FAULT_DISCONNECT; i++) {
+            if(sWord == pszTypes[i])
+                Fault.nType = i;
+        }
+        if(Fault.nType < 0)
+            return false;
+
+        while(Words >> sWord) {
+            nPos = sWord.find('=');
+            if(nPos == std::string::npos)
+                return false;
+            pszValue = sWord.c_str() + nPos + 1;
+            nValue = (int)strtol(pszValue, &pszEnd, 10);
+            if(pszEnd == pszValue || *pszEnd || nValue < 0)
+                return false;
+            sWord.resize(nPos);
+            if(sWord == "skip")
+                Fault.nSkip = nValue;
+            else if(sWord == "byte")
+                Fault.nByte = nValue;
+            else if(sWord == "count")
+                Fault.nCount = nValue;
+            else if(sWord == "after")
+                Fault.nAfterMs = nValue;
+            else if(sWord == "ms")
+                Fault.nDurationMs = nValue;
+            else
+                return false;
+        }
+        Script.push_back(Fault);
+    }
+    return true;
+}
+
+// the armed entry, when this frame fires it. the next one is armed.
+const EmulatorFault *CSmartFocusEmulator::matchFault(unsigned char cTrigger)
+{
+    const EmulatorFault *pFault;
+
+    if(m_nNextFault >= (int)m_FaultScript.size())
+        return NULL;
+    pFault = &m_FaultScript[m_nNextFault];
+    if(pFault->cTrigger && pFault->cTrigger != cTrigger)
+        return NULL;
+    if(m_nFaultMatches++ < pFault->nSkip)
+        return NULL;
+    m_nNextFault++;
+    m_nFaultMatches = 0;
+    return pFault;
+}
+
+// stall and disconnect, the other faults are applied by queueReply.
+void CSmartFocusEmulator::startFault(const EmulatorFault *pFault, Clock::time_point tTrigger)
+{
+    Clock::time_point tOnset;
+
+    if(!pFault)
+        return;
+    tOnset = tTrigger + std::chrono::milliseconds(pFault->nAfterMs);
+    switch(pFault->nType) {
+        case EMU_FAULT_STALL:
+            // nothing to hold once the move is over.
+            if(m_bStalled || !m_bMoving || tOnset >= m_tMoveEnd) {
+                recordFault(pFault, tOnset, tOnset);
+                break;
+            }
+            m_bStalled = true;
+            m_tStallStart = tOnset;
+            m_nStallRecord = (int)m_FaultRecords.size();
+            if(pFault->nDurationMs > 0) {
+                m_StallLength = std::chrono::milliseconds(pFault->nDurationMs);
+                recordFault(pFault, tOnset, tOnset + m_StallLength);
+            }
+            else {
+                m_StallLength = std::chrono::hours(EMU_STALL_FOREVER);
+                recordFault(pFault, tOnset, Clock::time_point());
+            }
+            m_tMoveEnd += m_StallLength;
+            break;
+
+        case EMU_FAULT_DISCONNECT:
+            m_bUnplugPending = true;
+            m_tUnplug = tOnset;
+            m_tReplug = tOnset + std::chrono::milliseconds(pFault->nDurationMs);
+            recordFault(pFault, m_tUnplug, m_tReplug);
+            m_RxCond.notify_all();
+            break;
+
+        default:
+            break;
+    }
+}
+
+// halt or new goto, the stall record ends there if it hadn't yet.
+void CSmartFocusEmulator::endStallAt(Clock::time_point t)
+{
+    if(!m_bStalled)
+        return;
+    if(m_nStallRecord >= 0 && t < m_tStallStart + m_StallLength)
+        m_FaultRecords[m_nStallRecord].llClearNs = nsOf(t > m_tStallStart ? t : m_tStallStart);
+    m_bStalled = false;
+    m_nStallRecord = -1;
+}
+
+void CSmartFocusEmulator::recordFault(const EmulatorFault *pFault, Clock::time_point tOnset, Clock::time_point tClear)
+{
+    EmulatorFaultRecord Record;
+
+    Record.nType = pFault->nType;
+    Record.llOnsetNs = nsOf(tOnset);
+    Record.llClearNs = nsOf(tClear);
+    m_FaultRecords.push_back(Record);
+}
+
+// the adapter went away : the open handle is dead and what the host hadn't read is lost.
+bool CSmartFocusEmulator::portAliveLocked(Clock::time_point tNow)
+{
+    if(m_bOpen && m_bUnplugPending && m_tUnplug <= tNow) {
+        availableLocked(tNow);
+        m_RxQueue.clear();
+        m_nCmdLen = 0;
+        m_bOpen = false;
+        m_bUnplugPending = false;
+        m_RxCond.notify_all();
+    }
+    return m_bOpen;
+}
+
+#pragma mark CEmulatorSleeper
+void CEmulatorSleeper::sleep(const int& milliSecondsToSleep)
+{
+    std::this_thread::sleep_for(std::chrono::milliseconds(milliSecondsToSleep));
+}
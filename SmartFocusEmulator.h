@@ -0,0 +1,176 @@
+//
+//  SmartFocusEmulator.h
+//
+//  SmartFocus X2 plugin
+//  In-process emulation of the JMI Smart Focus firmware, used as a SerXInterface
+//  stand-in so the driver can be profiled and benchmarked without a focuser.
+//
+//  A fault script (setFaultScript) makes it a flaky link : bytes dropped,
+//  duplicated, delayed or corrupted, a stalled motor, a refused command or the
+//  adapter unplugged for a while. The entries fire one after the other, each
+//  on the frame that triggers it, and every fault is time stamped so the time
+//  the driver takes to notice and get over it can be measured (tools/sffault).
+//
+
+#ifndef __SMARTFOCUS_EMULATOR__
+#define __SMARTFOCUS_EMULATOR__
+
+#include <stdint.h>
+#include <deque>
+#include <mutex>
+#include <condition_variable>
+#include <chrono>
+#include <random>
+#include <vector>
+
+#include "../../licensedinterfaces/sberrorx.h"
+#include "../../licensedinterfaces/serxinterface.h"
+#include "../../licensedinterfaces/sleeperinterface.h"
+
+// firmware quirks the emulator can reproduce
+#define EMU_QUIRK_NONE              0x00
+#define EMU_QUIRK_BOOT_DELAY        0x01    // controller resets on open (DTR) and ignores input for nBootMs
+#define EMU_QUIRK_BOOT_NOISE        0x02    // bootloader sends a garbage byte once it's up
+#define EMU_QUIRK_REFUSE_WHEN_BUSY  0x04    // 'g' or 'z' while moving answers 'r' instead of the echo
+#define EMU_QUIRK_NO_C_AFTER_HALT   0x08    // a halted move never sends its 'c'
+
+typedef struct {
+    unsigned long   nBaudRate;          // line speed, 8N1 so 10 bits per byte
+    bool            bByteTiming;        // false = in-memory, bytes are available immediately
+    int             nTurnaroundUs;      // firmware processing time between last command byte and reply
+    int             nJitterUs;          // uniformly distributed extra reply delay
+    double          dStepsPerSecond;    // motor step rate
+    int             nMoveOverheadMs;    // acceleration / deceleration cost added to every move
+    int             nBootMs;            // see EMU_QUIRK_BOOT_DELAY
+    int             nQuirks;            // EMU_QUIRK_xxx
+    int             nFirmwareVersion;   // byte returned by 'b'
+    int             nStartPosition;
+    int             nMaxPosition;
+    unsigned int    nSeed;              // jitter RNG seed, runs are reproducible
+} EmulatorConfig;
+
+// faults the script can inject
+enum EmulatorFaultType {EMU_FAULT_DROP = 0, EMU_FAULT_DUPLICATE, EMU_FAULT_DELAY, EMU_FAULT_CORRUPT, EMU_FAULT_STALL, EMU_FAULT_REFUSE, EMU_FAULT_DISCONNECT};
+
+// one script entry. the trigger is the reply to a command, by opcode, or 'c' for
+// the end of a move. byte faults hit the trigger frame, EMU_FAULT_REFUSE sends
+// 'r' in its place (the command isn't carried out), a stall holds the running
+// move and a disconnect unplugs the adapter, both nAfterMs past the trigger.
+typedef struct {
+    int             nType;          // EMU_FAULT_xxx
+    unsigned char   cTrigger;       // opcode, 'c', or 0 for any frame
+    int             nSkip;          // matching frames let through first
+    int             nByte;          // first byte hit, a frame shorter than that is left alone
+    int             nCount;         // bytes hit, 0 for the rest of the frame
+    int             nAfterMs;       // stall and disconnect onset
+    int             nDurationMs;    // delay, stall and disconnect length, a stall of 0 lasts until 's' or 'g'
+} EmulatorFault;
+
+// what a fault did, in CStopWatch::NowNs time (both use the steady clock)
+typedef struct {
+    int             nType;
+    long long       llOnsetNs;      // the first byte hit was due, or the stall / unplug started
+    long long       llClearNs;      // the delayed byte came, the stall or the outage ended. 0 while it lasts
+} EmulatorFaultRecord;
+
+class CSmartFocusEmulator : public SerXInterface
+{
+public:
+    CSmartFocusEmulator();
+    CSmartFocusEmulator(const EmulatorConfig &Config);
+    virtual ~CSmartFocusEmulator();
+
+    static EmulatorConfig defaultConfig();
+
+    // SerXInterface
+    virtual int     open(const char* pszPort, const unsigned long& dwBaudRate = 9600, const Parity& parity = B_NOPARITY, const char* pszSession = 0);
+    virtual int     close();
+    virtual bool    isConnected(void) const;
+    virtual int     flushTx(void);
+    virtual int     purgeTxRx(void);
+    virtual int     waitForBytesRx(const int& nNumber, const int& nTimeOutMs);
+    virtual int     readFile(void* lpBuffer, const unsigned long dwTotalBytesToRead, unsigned long& dwBytesRead, const unsigned long& dwTimeOut = 1000);
+    virtual int     writeFile(void* lpBuffer, const unsigned long& dwBytesToWrite, unsigned long& dwBytesWritten);
+    virtual int     bytesWaitingRx(void);
+
+    // device side inspection, for benchmarks
+    int             getDevicePosition();
+    bool            isDeviceMoving();
+    void            setConfig(const EmulatorConfig &Config);
+    EmulatorConfig  getConfig();
+
+    // fault injection. the script starts over, the records are cleared.
+    void            setFaultScript(const std::vector<EmulatorFault> &Script);
+    void            getFaultRecords(std::vector<EmulatorFaultRecord> &Records);
+    // "type[@trigger] [skip=n] [byte=n] [count=n] [after=ms] [ms=ms]; ..." with type one of
+    // drop, dup, delay, corrupt, stall, refuse, disconnect. false on a syntax error.
+    static bool     parseFaultScript(const char *pszScript, std::vector<EmulatorFault> &Script);
+
+protected:
+    typedef std::chrono::steady_clock Clock;
+
+    typedef struct {
+        Clock::time_point   tReady;
+        unsigned char       cByte;
+    } RxByte;
+
+    void            processCommand(const unsigned char *pCmd, int nLen, Clock::time_point tArrival);
+    Clock::time_point   queueReply(const unsigned char *pData, int nLen, Clock::time_point tReady, const EmulatorFault *pFault = NULL);
+    int             positionAt(Clock::time_point t);
+    bool            movingAt(Clock::time_point t);
+    void            stopMotionAt(Clock::time_point t);
+    const EmulatorFault *matchFault(unsigned char cTrigger);
+    void            startFault(const EmulatorFault *pFault, Clock::time_point tTrigger);
+    void            endStallAt(Clock::time_point t);
+    void            recordFault(const EmulatorFault *pFault, Clock::time_point tOnset, Clock::time_point tClear);
+    bool            portAliveLocked(Clock::time_point tNow);
+    int             commandLength(unsigned char cOpcode);
+    Clock::duration byteTime();
+    Clock::duration turnaround();
+    int             availableLocked(Clock::time_point tNow);
+
+    EmulatorConfig  m_Config;
+
+    mutable std::mutex          m_Lock;
+    std::condition_variable     m_RxCond;
+    std::deque<RxByte>          m_RxQueue;      // device -> host, ordered by tReady
+    unsigned char               m_szCmdBuf[8];  // partial command received by the device
+    int                         m_nCmdLen;
+    Clock::time_point           m_tTxDone;      // host -> device line idle after this
+    Clock::time_point           m_tRxLineFree;  // device -> host line idle after this
+    Clock::time_point           m_tBootDone;
+    bool                        m_bOpen;
+    bool                        m_bBootNoiseSent;
+
+    // motion model, the move runs from m_tMoveStart to m_tMoveEnd
+    int                         m_nPosition;    // position at m_tMoveStart (or current when idle)
+    int                         m_nTarget;
+    Clock::time_point           m_tMoveStart;
+    Clock::time_point           m_tMoveEnd;
+    bool                        m_bMoving;
+    bool                        m_bCompletionQueued;
+
+    // fault script, only the entry at m_nNextFault is armed
+    std::vector<EmulatorFault>  m_FaultScript;
+    int                         m_nNextFault;
+    int                         m_nFaultMatches;    // frames the armed entry has let through
+    std::vector<EmulatorFaultRecord>    m_FaultRecords;
+    bool                        m_bStalled;     // the motor holds from m_tStallStart for m_StallLength, m_tMoveEnd includes it
+    Clock::time_point           m_tStallStart;
+    Clock::duration             m_StallLength;
+    int                         m_nStallRecord; // in m_FaultRecords, for a stall that lasts until halted
+    bool                        m_bUnplugPending;   // the open handle dies at m_tUnplug
+    Clock::time_point           m_tUnplug;      // the adapter is gone from m_tUnplug to m_tReplug
+    Clock::time_point           m_tReplug;
+
+    std::mt19937                m_Rng;
+};
+
+// SleeperInterface backed by std::this_thread, to go with the emulator
+class CEmulatorSleeper : public SleeperInterface
+{
+public:
+    virtual void    sleep(const int& milliSecondsToSleep);
+};
+
+#endif //__SMARTFOCUS_EMULATOR__
@@ -0,0 +1,149 @@
+//
+//  SmartFocusProtocol.h
+//
+//  SmartFocus X2 plugin
+//  The JMI Smart Focus serial protocol, described once. SF_OPCODES gives the
+//  command and reply length of every opcode, CSFMessage<opcode> builds the
+//  command and decodes the reply from it : buffers are sized exactly at
+//  compile time and asking a message for a parameter or a value its opcode
+//  doesn't have doesn't compile.
+//
+//  Commands are the opcode, 'g' is followed by the target, 16 bits big endian.
+//  Replies start with the opcode, a refused goto is a single 'r'.
+//
+
+#ifndef __SMARTFOCUS_PROTOCOL__
+#define __SMARTFOCUS_PROTOCOL__
+
+#define MAX_CMD_SIZE        4
+#define MAX_REPLY_SIZE      4
+
+#define SF_REFUSED          'r'
+
+typedef struct {
+    unsigned char   cOpcode;
+    int             nCmdLen;
+    int             nReplyLen;      // 0 for commands without a reply
+    bool            bRefusable;     // may be answered by a lone SF_REFUSED
+    int             nMaxPayload;    // largest valid value after the opcode, big endian
+    const char      *pszName;
+} SFOpcodeInfo;
+
+constexpr SFOpcodeInfo SF_OPCODES[] = {
+    {'b', 1, 2, false, 255,   "firmware"},  // 'b' version
+    {'g', 3, 1, true,  0,     "goto"},      // 'g', then 'c' when the move ends
+    {'p', 1, 3, false, 65535, "position"},  // 'p' msb lsb
+    {'s', 1, 1, false, 0,     "stop"},      // 's'
+    {'t', 1, 2, false, 1,     "status"},    // 't' IDLE or MOVING
+    {'z', 1, 1, false, 0,     "zero"},      // 'z'
+};
+
+constexpr int SF_OPCODE_COUNT = int(sizeof(SF_OPCODES) / sizeof(SF_OPCODES[0]));
+
+// single return statements, these are C++11 constexpr.
+constexpr int sfOpcodeIndex(unsigned char cOpcode, int nIndex = 0)
+{
+    return nIndex >= SF_OPCODE_COUNT ? -1 : (SF_OPCODES[nIndex].cOpcode == cOpcode ? nIndex : sfOpcodeIndex(cOpcode, nIndex + 1));
+}
+
+// lookups by index, so each one searches the table once.
+constexpr int sfCommandLengthAt(int nIndex) { return nIndex < 0 ? 1 : SF_OPCODES[nIndex].nCmdLen; }
+constexpr int sfReplyLengthAt(int nIndex) { return nIndex < 0 ? 0 : SF_OPCODES[nIndex].nReplyLen; }
+constexpr bool sfIsRefusableAt(int nIndex) { return nIndex >= 0 && SF_OPCODES[nIndex].bRefusable; }
+constexpr int sfMaxPayloadAt(int nIndex) { return nIndex < 0 ? 0 : SF_OPCODES[nIndex].nMaxPayload; }
+
+// unknown opcodes are taken as a single byte.
+constexpr int sfCommandLength(unsigned char cOpcode) { return sfCommandLengthAt(sfOpcodeIndex(cOpcode)); }
+constexpr int sfReplyLength(unsigned char cOpcode) { return sfReplyLengthAt(sfOpcodeIndex(cOpcode)); }
+constexpr bool sfIsRefusable(unsigned char cOpcode) { return sfIsRefusableAt(sfOpcodeIndex(cOpcode)); }
+constexpr int sfMaxPayload(unsigned char cOpcode) { return sfMaxPayloadAt(sfOpcodeIndex(cOpcode)); }
+
+constexpr bool sfLengthsFit(int nIndex = 0)
+{
+    return nIndex >= SF_OPCODE_COUNT || (SF_OPCODES[nIndex].nCmdLen <= MAX_CMD_SIZE && SF_OPCODES[nIndex].nReplyLen <= MAX_REPLY_SIZE && sfLengthsFit(nIndex + 1));
+}
+
+constexpr bool sfOpcodesUnique(int nIndex = 0)
+{
+    return nIndex >= SF_OPCODE_COUNT || (sfOpcodeIndex(SF_OPCODES[nIndex].cOpcode) == nIndex && sfOpcodesUnique(nIndex + 1));
+}
+
+static_assert(sfOpcodesUnique(), "SF_OPCODES lists an opcode twice");
+static_assert(sfLengthsFit(), "SF_OPCODES entry longer than MAX_CMD_SIZE or MAX_REPLY_SIZE");
+
+// one command / reply exchange, replies are matched in order by opcode and length.
+// the buffers belong to the CSFMessage the transaction is part of.
+typedef struct {
+    const unsigned char *pCmd;
+    int             nCmdLen;
+    unsigned char   *pResp;
+    int             nExpectedLen;   // 0 for commands without a reply
+    int             nRespLen;
+    bool            bDone;
+    long long       llSentUs;       // CCommandPacer::now() time stamps
+    long long       llDoneUs;
+} SFTransaction;
+
+// ready to be sent, again if need be.
+inline void sfResetTransaction(SFTransaction &Transaction)
+{
+    Transaction.nRespLen = 0;
+    Transaction.bDone = false;
+    Transaction.llSentUs = 0;
+    Transaction.llDoneUs = 0;
+}
+
+template <unsigned char OPCODE>
+class CSFMessage
+{
+public:
+    static constexpr int CMD_LEN = sfCommandLength(OPCODE);
+    static constexpr int REPLY_LEN = sfReplyLength(OPCODE);
+
+    static_assert(sfOpcodeIndex(OPCODE) >= 0, "opcode missing from SF_OPCODES");
+
+    CSFMessage()
+    {
+        m_szCmd[0] = OPCODE;
+        Transaction.pCmd = m_szCmd;
+        Transaction.nCmdLen = CMD_LEN;
+        Transaction.pResp = m_szResp;
+        Transaction.nExpectedLen = REPLY_LEN;
+        sfResetTransaction(Transaction);
+    }
+    // the transaction points into the message.
+    CSFMessage(const CSFMessage &) = delete;
+    CSFMessage &operator=(const CSFMessage &) = delete;
+
+    void        setParam(int nValue)
+    {
+        static_assert(CMD_LEN == 3, "opcode takes no parameter");
+        m_szCmd[1] = (unsigned char)((nValue >> 8) & 0xff);
+        m_szCmd[2] = (unsigned char)(nValue & 0xff);
+    }
+
+    // a complete reply to this opcode
+    bool        isValid() const { return Transaction.nRespLen == REPLY_LEN && m_szResp[0] == OPCODE; };
+    bool        isRefused() const { return sfIsRefusable(OPCODE) && Transaction.nRespLen == 1 && m_szResp[0] == SF_REFUSED; };
+
+    // payloads, only valid when isValid()
+    int         byteValue() const
+    {
+        static_assert(REPLY_LEN == 2, "reply has no byte value");
+        return m_szResp[1];
+    }
+    int         wordValue() const
+    {
+        static_assert(REPLY_LEN == 3, "reply has no 16 bit value");
+        return (int(m_szResp[1]) << 8) | int(m_szResp[2]);
+    }
+    const unsigned char *reply() const { return m_szResp; };
+
+    SFTransaction   Transaction;
+
+protected:
+    unsigned char   m_szCmd[CMD_LEN];
+    unsigned char   m_szResp[REPLY_LEN > 0 ? REPLY_LEN : 1];
+};
+
+#endif //__SMARTFOCUS_PROTOCOL__
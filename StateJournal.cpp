@@ -0,0 +1,153 @@
+//
+//  StateJournal.cpp
+//
+//  SmartFocus X2 plugin
+//
+
+#include "StateJournal.h"
+#include <stdio.h>
+#include <string.h>
+
+CStateJournal::CStateJournal()
+{
+    memset(&m_State, 0, sizeof(m_State));
+    m_bRunning = false;
+    m_bDirty = false;
+    m_llWrites = 0;
+}
+
+CStateJournal::~CStateJournal()
+{
+    stop();
+}
+
+void CStateJournal::start(const char *pszPath)
+{
+    stop();
+    if(!pszPath || !*pszPath)
+        return;
+
+    std::lock_guard<std::mutex> lock(m_Lock);
+    m_sPath = pszPath;
+    m_bDirty = false;
+    m_bRunning = true;
+    m_WriterThread = std::thread(&CStateJournal::writerThread, this);
+}
+
+void CStateJournal::stop()
+{
+    {
+        std::lock_guard<std::mutex> lock(m_Lock);
+        if(!m_bRunning)
+            return;
+        m_bRunning = false;
+        m_WakeCond.notify_all();
+    }
+    if(m_WriterThread.joinable())
+        m_WriterThread.join();
+}
+
+void CStateJournal::update(const JournalState &State)
+{
+    std::lock_guard<std::mutex> lock(m_Lock);
+
+    if(!m_bRunning)
+        return;
+    m_State = State;
+    if(!m_bDirty) {
+        m_bDirty = true;
+        m_WakeCond.notify_all();
+    }
+}
+
+bool CStateJournal::load(const char *pszPath, JournalState &State)
+{
+    FILE *pFile;
+    char szLine[128];
+    char szDirection[8];
+    int nVersion = 0;
+    int nValid;
+    int nMoving;
+    int nDir;
+    MoveSample Sample;
+
+    if(!pszPath || !*pszPath)
+        return false;
+    pFile = fopen(pszPath, "r");
+    if(!pFile)
+        return false;
+
+    memset(&State, 0, sizeof(State));
+    if(!fgets(szLine, sizeof(szLine), pFile) || sscanf(szLine, JOURNAL_MAGIC " %d", &nVersion) != 1 || nVersion != JOURNAL_VERSION) {
+        fclose(pFile);
+        return false;
+    }
+    // unknown lines are skipped, so a newer driver can add some.
+    while(fgets(szLine, sizeof(szLine), pFile)) {
+        if(sscanf(szLine, "position %d %d", &State.nPosition, &nValid) == 2)
+            State.bPositionValid = nValid != 0;
+        else if(sscanf(szLine, "move %d %d", &nMoving, &State.nTarget) == 2)
+            State.bMoving = nMoving != 0;
+        else if(sscanf(szLine, "sample %7s %d %lf", szDirection, &Sample.nSteps, &Sample.dSeconds) == 3) {
+            nDir = strcmp(szDirection, "out") ? 0 : 1;
+            if(State.nSamples[nDir] < MOTION_SAMPLES)
+                State.Samples[nDir][State.nSamples[nDir]++] = Sample;
+        }
+    }
+    fclose(pFile);
+    return true;
+}
+
+// one write per JOURNAL_MIN_INTERVAL at most, of the latest state.
+void CStateJournal::writerThread()
+{
+    std::unique_lock<std::mutex> lock(m_Lock);
+    JournalState State;
+    std::chrono::steady_clock::time_point tNextWrite = std::chrono::steady_clock::now();
+
+    while(true) {
+        m_WakeCond.wait(lock, [this] { return m_bDirty || !m_bRunning; });
+        if(m_bRunning && m_WakeCond.wait_until(lock, tNextWrite, [this] { return !m_bRunning; }))
+            continue;
+        if(!m_bDirty)
+            break;
+        State = m_State;
+        m_bDirty = false;
+        lock.unlock();
+        writeFile(State);
+        tNextWrite = std::chrono::steady_clock::now() + std::chrono::milliseconds(JOURNAL_MIN_INTERVAL);
+        lock.lock();
+    }
+}
+
+bool CStateJournal::writeFile(const JournalState &State)
+{
+    std::string sTemp = m_sPath + ".tmp";
+    FILE *pFile;
+    bool bOk;
+
+    pFile = fopen(sTemp.c_str(), "w");
+    if(!pFile)
+        return false;
+    fprintf(pFile, JOURNAL_MAGIC " %d\n", JOURNAL_VERSION);
+    fprintf(pFile, "position %d %d\n", State.nPosition, State.bPositionValid ? 1 : 0);
+    fprintf(pFile, "move %d %d\n", State.bMoving ? 1 : 0, State.nTarget);
+    for(int nDir = 0; nDir < 2; nDir++) {
+        for(int i = 0; i < State.nSamples[nDir]; i++)
+            fprintf(pFile, "sample %s %d %.6f\n", nDir ? "out" : "in", State.Samples[nDir][i].nSteps, State.Samples[nDir][i].dSeconds);
+    }
+    bOk = fflush(pFile) == 0;
+    bOk = fclose(pFile) == 0 && bOk;
+    if(!bOk) {
+        remove(sTemp.c_str());
+        return false;
+    }
+#if defined(SB_WIN_BUILD)
+    // rename doesn't replace on Windows.
+    remove(m_sPath.c_str());
+#endif
+    if(rename(sTemp.c_str(), m_sPath.c_str()))
+        return false;
+    m_llWrites++;
+    return true;
+}
@@ -0,0 +1,77 @@
+//
+//  StateJournal.h
+//
+//  SmartFocus X2 plugin
+//  What the driver knows about the focuser, kept on disk for the next session :
+//  last known position, the move in progress and the move timings the motion
+//  profile is fitted on. Written behind the I/O path, update() only copies the
+//  state, a writer thread replaces the file at most every JOURNAL_MIN_INTERVAL
+//  ms with the latest state, so a burst of updates is a single write.
+//
+//  File layout, text :
+//      SFJOURNAL 1
+//      position <steps> <1 if read from or reached by the controller>
+//      move <1 if running> <target>
+//      sample <in|out> <steps> <seconds>     one per sample, oldest first
+//  The file is written next to the journal and renamed over it, a crash leaves
+//  either the previous state or the new one.
+//
+
+#ifndef __STATE_JOURNAL__
+#define __STATE_JOURNAL__
+
+#include <string>
+#include <thread>
+#include <atomic>
+#include <mutex>
+#include <condition_variable>
+
+#include "MotionModel.h"
+
+#define JOURNAL_MAGIC           "SFJOURNAL"
+#define JOURNAL_VERSION         1
+#define JOURNAL_MIN_INTERVAL    500     // ms between two writes
+
+typedef struct {
+    int             nPosition;
+    bool            bPositionValid;
+    bool            bMoving;
+    int             nTarget;
+    int             nSamples[2];    // inward, outward
+    MoveSample      Samples[2][MOTION_SAMPLES];
+} JournalState;
+
+class CStateJournal
+{
+public:
+    CStateJournal();
+    ~CStateJournal();
+
+    // writes to pszPath from now on, an empty path stops journaling.
+    void        start(const char *pszPath);
+    // writes what's still pending first.
+    void        stop();
+    bool        isActive() { return m_bRunning; };
+
+    // never waits for the disk.
+    void        update(const JournalState &State);
+    long long   getWriteCount() { return m_llWrites; };
+
+    // false if there is no journal or it can't be read.
+    static bool load(const char *pszPath, JournalState &State);
+
+protected:
+    void        writerThread();
+    bool        writeFile(const JournalState &State);
+
+    std::string         m_sPath;
+    std::thread         m_WriterThread;
+    std::mutex          m_Lock;
+    std::condition_variable m_WakeCond;
+    std::atomic<bool>   m_bRunning;
+    bool                m_bDirty;
+    JournalState        m_State;
+    std::atomic<long long>  m_llWrites;
+};
+
+#endif //__STATE_JOURNAL__
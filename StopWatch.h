@@ -1,105 +1,141 @@
-// StopWatch.h
-// Stopwatch class for high resolution timing.
-// Code by Richard S. Wright Jr.
-// March 23, 1999
-// 
-// This function uses the High performance counter on Win32 and
-// gettimeofday on Mac OS X/Linux. gettimeofday is actually pretty
-// good on the Mac (about 10ms).
-
-/* Copyright (c) 2005-2009, Richard S. Wright Jr.
-All rights reserved.
-
-Redistribution and use in source and binary forms, with or without modification, 
-are permitted provided that the following conditions are met:
-
-Redistributions of source code must retain the above copyright notice, this list 
-of conditions and the following disclaimer.
-
-Redistributions in binary form must reproduce the above copyright notice, this list 
-of conditions and the following disclaimer in the documentation and/or other 
-materials provided with the distribution.
-
-Neither the name of Richard S. Wright Jr. nor the names of other contributors may be used 
-to endorse or promote products derived from this software without specific prior 
-written permission.
-
-THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS" AND ANY 
-EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED WARRANTIES 
-OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT 
-SHALL THE COPYRIGHT OWNER OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, 
-INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED 
-TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR 
-BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN 
-CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN 
-ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
-*/
-
-#ifndef STOPWATCH_HEADER
-#define STOPWATCH_HEADER
-
-#ifdef WIN32
-#include <windows.h>
-#else
-#include <sys/time.h>
-#endif
-
-
-///////////////////////////////////////////////////////////////////////////////
-// Simple Stopwatch class. Use this for high resolution timing 
-// purposes (or, even low resolution timings)
-// Pretty self-explanitory.... 
-// Reset(), or GetElapsedSeconds().
-class CStopWatch
-	{
-	public:
-		CStopWatch(void)	// Constructor
-			{
-			#ifdef WIN32
-			QueryPerformanceFrequency(&m_CounterFrequency);
-			QueryPerformanceCounter(&m_LastCount);
-			#else
-            gettimeofday(&m_LastCount, 0);
-			#endif
-			}
-
-		// Resets timer (difference) to zero
-		inline void Reset(void) 
-			{
-			#ifdef WIN32
-			QueryPerformanceCounter(&m_LastCount);
-			#else
-			gettimeofday(&m_LastCount, 0);
-			#endif
-			}					
-		
-		// Get elapsed time in seconds
-		float GetElapsedSeconds(void)
-			{
-			// Get the current count
-			#ifdef WIN32
-			LARGE_INTEGER lCurrent;
-			QueryPerformanceCounter(&lCurrent);
-
-			return float((lCurrent.QuadPart - m_LastCount.QuadPart) /
-										double(m_CounterFrequency.QuadPart));
-			#else
-            timeval lcurrent;
-            gettimeofday(&lcurrent, 0);
-            float fSeconds = (float)(lcurrent.tv_sec - m_LastCount.tv_sec);
-            float fFraction = (float)(lcurrent.tv_usec - m_LastCount.tv_usec) * 0.000001f;
-            return fSeconds + fFraction;
-			#endif
-			}	
-	
-	protected:
-	#ifdef WIN32
-		LARGE_INTEGER m_CounterFrequency;
-		LARGE_INTEGER m_LastCount;
-	#else
-        timeval m_LastCount;
-	#endif
-	};
-
-
-#endif
+// StopWatch.h
+// Stopwatch class for high resolution timing.
+// Code by Richard S. Wright Jr.
+// March 23, 1999
+// 
+// This function uses the High performance counter on Win32 and
+// gettimeofday on Mac OS X/Linux. gettimeofday is actually pretty
+// good on the Mac (about 10ms).
+//
+// Modified for the SmartFocus X2 plugin : all platforms now use the
+// monotonic std::chrono::steady_clock with integer nanosecond results, so
+// NTP steps of the wall clock can't break timings, and laps accumulate
+// min / max / mean statistics. The resolution is whatever the standard
+// library's steady_clock provides on the platform.
+
+/* Copyright (c) 2005-2009, Richard S. Wright Jr.
+All rights reserved.
+
+Redistribution and use in source and binary forms, with or without modification, 
+are permitted provided that the following conditions are met:
+
+Redistributions of source code must retain the above copyright notice, this list 
+of conditions and the following disclaimer.
+
+Redistributions in binary form must reproduce the above copyright notice, this list 
+of conditions and the following disclaimer in the documentation and/or other 
+materials provided with the distribution.
+
+Neither the name of Richard S. Wright Jr. nor the names of other contributors may be used 
+to endorse or promote products derived from this software without specific prior 
+written permission.
+
+THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS" AND ANY 
+EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED WARRANTIES 
+OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT 
+SHALL THE COPYRIGHT OWNER OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, 
+INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED 
+TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR 
+BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN 
+CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN 
+ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+*/
+
+#ifndef STOPWATCH_HEADER
+#define STOPWATCH_HEADER
+
+#include <chrono>
+#include <climits>
+
+
+///////////////////////////////////////////////////////////////////////////////
+// Simple Stopwatch class. Use this for high resolution timing 
+// purposes (or, even low resolution timings)
+// Pretty self-explanitory.... 
+// Reset(), GetElapsedNs() or GetElapsedSeconds().
+// Lap() returns the time since the previous lap and accumulates it in the
+// lap statistics, ResetLaps() clears them.
+class CStopWatch
+	{
+	public:
+		CStopWatch(void)	// Constructor
+			{
+			m_LastCount = Clock::now();
+			m_LapStart = m_LastCount;
+			ResetLaps();
+			}
+
+		// monotonic time stamp in nanoseconds, only differences are meaningful
+		static inline long long NowNs(void)
+			{
+			return std::chrono::duration_cast<std::chrono::nanoseconds>(Clock::now().time_since_epoch()).count();
+			}
+
+		// Resets timer (difference) to zero
+		inline void Reset(void) 
+			{
+			m_LastCount = Clock::now();
+			m_LapStart = m_LastCount;
+			}					
+		
+		// Get elapsed time in nanoseconds
+		inline long long GetElapsedNs(void) const
+			{
+			return std::chrono::duration_cast<std::chrono::nanoseconds>(Clock::now() - m_LastCount).count();
+			}
+
+		// Get elapsed time in seconds
+		float GetElapsedSeconds(void) const
+			{
+			return float(GetElapsedNs() * 1e-9);
+			}	
+
+		// time since the previous lap (or Reset), added to the lap statistics
+		long long Lap(void)
+			{
+			Clock::time_point lCurrent = Clock::now();
+			long long llLapNs = std::chrono::duration_cast<std::chrono::nanoseconds>(lCurrent - m_LapStart).count();
+
+			m_LapStart = lCurrent;
+			AddLap(llLapNs);
+			return llLapNs;
+			}
+
+		// accumulate a duration measured elsewhere
+		void AddLap(long long llLapNs)
+			{
+			m_llLapCount++;
+			m_llLapTotalNs += llLapNs;
+			if(llLapNs < m_llLapMinNs)
+				m_llLapMinNs = llLapNs;
+			if(llLapNs > m_llLapMaxNs)
+				m_llLapMaxNs = llLapNs;
+			}
+
+		void ResetLaps(void)
+			{
+			m_llLapCount = 0;
+			m_llLapTotalNs = 0;
+			m_llLapMinNs = LLONG_MAX;
+			m_llLapMaxNs = 0;
+			}
+
+		long long GetLapCount(void) const	{ return m_llLapCount; }
+		long long GetLapTotalNs(void) const	{ return m_llLapTotalNs; }
+		long long GetLapMinNs(void) const	{ return m_llLapCount ? m_llLapMinNs : 0; }
+		long long GetLapMaxNs(void) const	{ return m_llLapMaxNs; }
+		long long GetLapMeanNs(void) const	{ return m_llLapCount ? m_llLapTotalNs / m_llLapCount : 0; }
+	
+	protected:
+		typedef std::chrono::steady_clock Clock;
+
+		Clock::time_point m_LastCount;
+		Clock::time_point m_LapStart;
+		long long m_llLapCount;
+		long long m_llLapTotalNs;
+		long long m_llLapMinNs;
+		long long m_llLapMaxNs;
+	};
+
+
+#endif
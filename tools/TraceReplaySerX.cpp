@@ -0,0 +1,253 @@
+//
+//  TraceReplaySerX.cpp
+//
+//  SmartFocus X2 plugin tools
+//
+//  Replies are timed from the write that matched their command rather than
+//  from the start of the session, so a driver that runs slower or faster than
+//  the recorded one still sees every reply after its command. Bytes recorded
+//  before the first command (boot noise) are timed from open().
+//
+
+#include "TraceReplaySerX.h"
+#include <string.h>
+#include <thread>
+
+CTraceReplaySerX::CTraceReplaySerX(const std::vector<TraceRecord> &Records, size_t nFirst, size_t nEnd, double dSpeed)
+    : m_Records(Records)
+{
+    m_nFirst = nFirst;
+    m_nEnd = nEnd;
+    m_dSpeed = dSpeed;
+    m_Consumed.assign(Records.size(), false);
+    m_nNextTx = nextTx(nFirst);
+    m_bOpen = false;
+    m_nMatched = 0;
+    m_nSkipped = 0;
+    m_nMismatched = 0;
+}
+
+CTraceReplaySerX::~CTraceReplaySerX()
+{
+}
+
+#pragma mark SerXInterface
+int CTraceReplaySerX::open(const char* pszPort, const unsigned long& dwBaudRate, const Parity& parity, const char* pszSession)
+{
+    std::lock_guard<std::mutex> lock(m_Lock);
+
+    (void)pszPort;
+    (void)dwBaudRate;
+    (void)parity;
+    (void)pszSession;
+
+    if(m_bOpen)
+        return ERR_COMMOPENING;
+    m_bOpen = true;
+    m_RxQueue.clear();
+    scheduleReplies(m_nFirst, Clock::now());
+    return SB_OK;
+}
+
+int CTraceReplaySerX::close()
+{
+    std::lock_guard<std::mutex> lock(m_Lock);
+
+    m_bOpen = false;
+    m_RxQueue.clear();
+    m_RxCond.notify_all();
+    return SB_OK;
+}
+
+bool CTraceReplaySerX::isConnected(void) const
+{
+    std::lock_guard<std::mutex> lock(m_Lock);
+    return m_bOpen;
+}
+
+int CTraceReplaySerX::flushTx(void)
+{
+    return SB_OK;
+}
+
+int CTraceReplaySerX::purgeTxRx(void)
+{
+    std::lock_guard<std::mutex> lock(m_Lock);
+    Clock::time_point tNow = Clock::now();
+
+    if(!m_bOpen)
+        return ERR_COMMNOLINK;
+    while(!m_RxQueue.empty() && m_RxQueue.front().tReady <= tNow)
+        m_RxQueue.pop_front();
+    return SB_OK;
+}
+
+int CTraceReplaySerX::waitForBytesRx(const int& nNumber, const int& nTimeOutMs)
+{
+    std::unique_lock<std::mutex> lock(m_Lock);
+    Clock::time_point tDeadline = Clock::now() + std::chrono::milliseconds(nTimeOutMs);
+
+    while(true) {
+        Clock::time_point tNow = Clock::now();
+        if(!m_bOpen)
+            return ERR_COMMNOLINK;
+        if(availableLocked(tNow) >= nNumber)
+            return SB_OK;
+        if(tNow >= tDeadline)
+            return ERR_RXTIMEOUT;
+
+        Clock::time_point tWake = tDeadline;
+        if(!m_RxQueue.empty() && m_RxQueue.front().tReady < tWake)
+            tWake = m_RxQueue.front().tReady;
+        m_RxCond.wait_until(lock, tWake);
+    }
+}
+
+int CTraceReplaySerX::readFile(void* lpBuffer, const unsigned long dwTotalBytesToRead, unsigned long& dwBytesRead, const unsigned long& dwTimeOut)
+{
+    std::unique_lock<std::mutex> lock(m_Lock);
+    unsigned char *pBuffer = (unsigned char *)lpBuffer;
+    Clock::time_point tDeadline = Clock::now() + std::chrono::milliseconds(dwTimeOut);
+
+    dwBytesRead = 0;
+    while(true) {
+        Clock::time_point tNow = Clock::now();
+        if(!m_bOpen)
+            return ERR_COMMNOLINK;
+
+        while(dwBytesRead < dwTotalBytesToRead && !m_RxQueue.empty() && m_RxQueue.front().tReady <= tNow) {
+            pBuffer[dwBytesRead++] = m_RxQueue.front().cByte;
+            m_RxQueue.pop_front();
+        }
+        if(dwBytesRead >= dwTotalBytesToRead || tNow >= tDeadline)
+            return SB_OK;
+
+        Clock::time_point tWake = tDeadline;
+        if(!m_RxQueue.empty() && m_RxQueue.front().tReady < tWake)
+            tWake = m_RxQueue.front().tReady;
+        m_RxCond.wait_until(lock, tWake);
+    }
+}
+
+// commands the driver didn't send this time are skipped, their replies are not played.
+int CTraceReplaySerX::writeFile(void* lpBuffer, const unsigned long& dwBytesToWrite, unsigned long& dwBytesWritten)
+{
+    std::lock_guard<std::mutex> lock(m_Lock);
+    const TraceRecord *pRecord;
+    size_t nIndex;
+    int nLookahead;
+
+    dwBytesWritten = 0;
+    if(!m_bOpen)
+        return ERR_COMMNOLINK;
+    dwBytesWritten = dwBytesToWrite;
+
+    nIndex = m_nNextTx;
+    for(nLookahead = 0; nLookahead < REPLAY_LOOKAHEAD && nIndex < m_nEnd; nLookahead++) {
+        pRecord = &m_Records[nIndex];
+        if(pRecord->Data.size() == dwBytesToWrite && !memcmp(pRecord->Data.data(), lpBuffer, dwBytesToWrite)) {
+            m_nSkipped += nLookahead;
+            m_nMatched++;
+            m_Consumed[nIndex] = true;
+            m_nNextTx = nextTx(nIndex);
+            scheduleReplies(nIndex, Clock::now());
+            m_RxCond.notify_all();
+            return SB_OK;
+        }
+        nIndex = nextTx(nIndex);
+    }
+    // nothing like it was recorded, the driver will time out on it.
+    m_nMismatched++;
+    return SB_OK;
+}
+
+int CTraceReplaySerX::bytesWaitingRx(void)
+{
+    std::lock_guard<std::mutex> lock(m_Lock);
+
+    if(!m_bOpen)
+        return 0;
+    return availableLocked(Clock::now());
+}
+
+#pragma mark replay state
+bool CTraceReplaySerX::isConsumed(size_t nIndex)
+{
+    std::lock_guard<std::mutex> lock(m_Lock);
+    return nIndex < m_Consumed.size() && m_Consumed[nIndex];
+}
+
+int CTraceReplaySerX::getMatched()
+{
+    std::lock_guard<std::mutex> lock(m_Lock);
+    return m_nMatched;
+}
+
+int CTraceReplaySerX::getSkipped()
+{
+    std::lock_guard<std::mutex> lock(m_Lock);
+    return m_nSkipped;
+}
+
+int CTraceReplaySerX::getMismatched()
+{
+    std::lock_guard<std::mutex> lock(m_Lock);
+    return m_nMismatched;
+}
+
+std::chrono::steady_clock::duration CTraceReplaySerX::scaled(long long llNs)
+{
+    if(m_dSpeed <= 0.0 || llNs <= 0)
+        return Clock::duration::zero();
+    return std::chrono::duration_cast<Clock::duration>(std::chrono::nanoseconds((long long)(llNs / m_dSpeed)));
+}
+
+size_t CTraceReplaySerX::nextTx(size_t nIndex)
+{
+    for(nIndex++; nIndex < m_nEnd; nIndex++) {
+        if(m_Records[nIndex].nType == TRACE_TX)
+            break;
+    }
+    return nIndex;
+}
+
+// everything received between Records[nIndex] and the next command, kept in arrival order.
+void CTraceReplaySerX::scheduleReplies(size_t nIndex, Clock::time_point tBase)
+{
+    std::deque<RxByte>::iterator it;
+    RxByte Byte;
+    size_t nRecord;
+
+    for(nRecord = nIndex + 1; nRecord < m_nEnd && m_Records[nRecord].nType != TRACE_TX; nRecord++) {
+        if(m_Records[nRecord].nType != TRACE_RX)
+            continue;
+        Byte.tReady = tBase + scaled(m_Records[nRecord].llTimeNs - m_Records[nIndex].llTimeNs);
+        for(unsigned char cByte : m_Records[nRecord].Data) {
+            Byte.cByte = cByte;
+            it = m_RxQueue.end();
+            while(it != m_RxQueue.begin() && (it - 1)->tReady > Byte.tReady)
+                --it;
+            m_RxQueue.insert(it, Byte);
+        }
+    }
+}
+
+int CTraceReplaySerX::availableLocked(Clock::time_point tNow)
+{
+    int nCount = 0;
+
+    for(const RxByte &Byte : m_RxQueue) {
+        if(Byte.tReady > tNow)
+            break;
+        nCount++;
+    }
+    return nCount;
+}
+
+#pragma mark CReplaySleeper
+void CReplaySleeper::sleep(const int& milliSecondsToSleep)
+{
+    if(m_dSpeed <= 0.0)
+        return;
+    std::this_thread::sleep_for(std::chrono::microseconds((long long)(milliSecondsToSleep * 1000 / m_dSpeed)));
+}
@@ -0,0 +1,93 @@
+//
+//  TraceReplaySerX.h
+//
+//  SmartFocus X2 plugin tools
+//  SerXInterface stand-in playing back one session of a protocol trace. Each
+//  write is matched against the recorded commands and the bytes the controller
+//  sent after that command are delivered again with the same delays, divided
+//  by the replay speed.
+//
+
+#ifndef __TRACE_REPLAY_SERX__
+#define __TRACE_REPLAY_SERX__
+
+#include <vector>
+#include <deque>
+#include <mutex>
+#include <condition_variable>
+#include <chrono>
+
+#include "../../../licensedinterfaces/sberrorx.h"
+#include "../../../licensedinterfaces/serxinterface.h"
+#include "../../../licensedinterfaces/sleeperinterface.h"
+
+#include "../ProtocolTrace.h"
+
+#define REPLAY_LOOKAHEAD    8   // recorded commands a write may skip over to find its match
+
+class CTraceReplaySerX : public SerXInterface
+{
+public:
+    // replays Records[nFirst] (a TRACE_OPEN) up to Records[nEnd], dSpeed 0 means no delays at all.
+    CTraceReplaySerX(const std::vector<TraceRecord> &Records, size_t nFirst, size_t nEnd, double dSpeed);
+    virtual ~CTraceReplaySerX();
+
+    // SerXInterface
+    virtual int     open(const char* pszPort, const unsigned long& dwBaudRate = 9600, const Parity& parity = B_NOPARITY, const char* pszSession = 0);
+    virtual int     close();
+    virtual bool    isConnected(void) const;
+    virtual int     flushTx(void);
+    virtual int     purgeTxRx(void);
+    virtual int     waitForBytesRx(const int& nNumber, const int& nTimeOutMs);
+    virtual int     readFile(void* lpBuffer, const unsigned long dwTotalBytesToRead, unsigned long& dwBytesRead, const unsigned long& dwTimeOut = 1000);
+    virtual int     writeFile(void* lpBuffer, const unsigned long& dwBytesToWrite, unsigned long& dwBytesWritten);
+    virtual int     bytesWaitingRx(void);
+
+    // true once the driver sent the command recorded at Records[nIndex]
+    bool            isConsumed(size_t nIndex);
+    int             getMatched();
+    int             getSkipped();
+    int             getMismatched();
+
+    std::chrono::steady_clock::duration scaled(long long llNs);
+
+protected:
+    typedef std::chrono::steady_clock Clock;
+
+    typedef struct {
+        Clock::time_point   tReady;
+        unsigned char       cByte;
+    } RxByte;
+
+    size_t          nextTx(size_t nIndex);
+    void            scheduleReplies(size_t nIndex, Clock::time_point tBase);
+    int             availableLocked(Clock::time_point tNow);
+
+    const std::vector<TraceRecord>  &m_Records;
+    size_t                          m_nFirst;
+    size_t                          m_nEnd;
+    double                          m_dSpeed;
+
+    mutable std::mutex              m_Lock;
+    std::condition_variable         m_RxCond;
+    std::deque<RxByte>              m_RxQueue;      // ordered by tReady
+    std::vector<bool>               m_Consumed;
+    size_t                          m_nNextTx;      // oldest recorded command not matched or skipped yet
+    bool                            m_bOpen;
+    int                             m_nMatched;
+    int                             m_nSkipped;
+    int                             m_nMismatched;
+};
+
+// SleeperInterface running faster by the replay speed
+class CReplaySleeper : public SleeperInterface
+{
+public:
+    CReplaySleeper(double dSpeed) : m_dSpeed(dSpeed) {};
+    virtual void    sleep(const int& milliSecondsToSleep);
+
+protected:
+    double          m_dSpeed;
+};
+
+#endif //__TRACE_REPLAY_SERX__
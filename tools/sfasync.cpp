@@ -0,0 +1,136 @@
+//
+//  sfasync.cpp
+//
+//  SmartFocus X2 plugin tools
+//  Checks the coroutine API : two CSFAsyncFocuser on one CSFScheduler, each
+//  against its own CSmartFocusEmulator, run the same sequence side by side :
+//
+//      goto            gotoPosition, then waitGoToComplete with a 1 ms timeout
+//                      while it runs (must time out, bComplete false), then
+//                      without one (ends on target, emulator agrees)
+//      halt            a long goto halted 200 ms in, waitGoToComplete ends and
+//                      getPosition agrees with where the emulator stopped
+//
+//  and the first moves of both focusers have to overlap in time, nothing on
+//  the scheduler thread blocks on the serial port.
+//
+//  Prints one line per check, exits with 1 if any failed. Needs -std=c++20,
+//  'make async' builds and runs it.
+//
+//  usage : sfasync
+//
+
+#include <stdio.h>
+#include <stdlib.h>
+
+#include "../SmartFocus.h"
+#include "../SmartFocusEmulator.h"
+#include "../SmartFocusAsync.h"
+
+#ifndef SF_ASYNC_AVAILABLE
+#error "sfasync needs a compiler with coroutines, -std=c++20"
+#endif
+
+#define ASYNC_STEP_RATE     5000.0  // emulator steps per second
+#define ASYNC_MOVE_LIMIT    10000   // ms for a move to end
+#define ASYNC_HALT_AFTER    200     // ms into the move to halt
+
+typedef struct {
+    int         nIndex;
+    int         nStart;
+    int         nTarget;
+    long long   llMoveStartNs;      // first move, CStopWatch::NowNs()
+    long long   llMoveEndNs;
+} AsyncRun;
+
+static int g_nFailed = 0;
+
+static void check(const AsyncRun &Run, const char *pszWhat, bool bOk, int nErr, int nValue)
+{
+    printf("focuser %d  %-44s %-4s err %3d  %d\n", Run.nIndex, pszWhat, bOk ? "ok" : "FAIL", nErr, nValue);
+    if(!bOk)
+        g_nFailed++;
+}
+
+static CSFTask runSequence(CSFAsyncFocuser &Focuser, CSFScheduler &Scheduler, CSmartFocusEmulator &SerX, AsyncRun &Run)
+{
+    bool bComplete = true;
+    int nPosition = -1;
+    int nErr;
+
+    Run.llMoveStartNs = CStopWatch::NowNs();
+    nErr = co_await Focuser.gotoPosition(Run.nTarget);
+    check(Run, "gotoPosition", !nErr, nErr, Run.nTarget);
+
+    nErr = co_await Focuser.waitGoToComplete(bComplete, 1);
+    check(Run, "waitGoToComplete times out while moving", !nErr && !bComplete && SerX.isDeviceMoving(), nErr, bComplete);
+
+    nErr = co_await Focuser.waitGoToComplete(bComplete, ASYNC_MOVE_LIMIT);
+    Run.llMoveEndNs = CStopWatch::NowNs();
+    check(Run, "waitGoToComplete ends with the move", !nErr && bComplete && !SerX.isDeviceMoving(), nErr, bComplete);
+
+    nErr = co_await Focuser.getPosition(nPosition);
+    check(Run, "getPosition on target", !nErr && nPosition == Run.nTarget && SerX.getDevicePosition() == Run.nTarget, nErr, nPosition);
+
+    nErr = co_await Focuser.gotoPosition(Run.nStart);
+    check(Run, "gotoPosition back", !nErr, nErr, Run.nStart);
+    co_await Scheduler.sleepFor(ASYNC_HALT_AFTER);
+    nErr = co_await Focuser.haltFocuser();
+    check(Run, "haltFocuser", !nErr, nErr, 0);
+
+    nErr = co_await Focuser.waitGoToComplete(bComplete, ASYNC_MOVE_LIMIT);
+    check(Run, "waitGoToComplete ends with the halt", !nErr && bComplete && !SerX.isDeviceMoving(), nErr, bComplete);
+
+    nErr = co_await Focuser.getPosition(nPosition);
+    check(Run, "getPosition where the motor stopped", !nErr && nPosition == SerX.getDevicePosition() &&
+          nPosition != Run.nStart && nPosition != Run.nTarget, nErr, nPosition);
+    co_return PLUGIN_OK;
+}
+
+int main(int argc, char **argv)
+{
+    EmulatorConfig Config = CSmartFocusEmulator::defaultConfig();
+    AsyncRun Runs[2] = {{1, 1000, 3000, 0, 0}, {2, 1000, 6000, 0, 0}};
+    CSmartFocusEmulator *pSerX[2];
+    CSmartFocus Focusers[2];
+    CEmulatorSleeper Sleeper;
+    int nResults[2] = {-1, -1};
+    bool bOverlap;
+    int i;
+
+    (void)argc;
+    (void)argv;
+    Config.dStepsPerSecond = ASYNC_STEP_RATE;
+    for(i = 0; i < 2; i++) {
+        Config.nStartPosition = Runs[i].nStart;
+        Config.nSeed = i + 1;
+        pSerX[i] = new CSmartFocusEmulator(Config);
+        Focusers[i].SetSerxPointer(pSerX[i]);
+        Focusers[i].setSleeper(&Sleeper);
+        if(Focusers[i].Connect("async")) {
+            printf("focuser %d : can't connect to the emulator\n", i + 1);
+            return 1;
+        }
+    }
+
+    {
+        CSFScheduler Scheduler;
+        CSFAsyncFocuser Focuser1(Focusers[0], Scheduler);
+        CSFAsyncFocuser Focuser2(Focusers[1], Scheduler);
+
+        Scheduler.spawn(runSequence(Focuser1, Scheduler, *pSerX[0], Runs[0]), &nResults[0]);
+        Scheduler.spawn(runSequence(Focuser2, Scheduler, *pSerX[1], Runs[1]), &nResults[1]);
+        Scheduler.run();
+    }
+
+    bOverlap = Runs[0].llMoveStartNs < Runs[1].llMoveEndNs && Runs[1].llMoveStartNs < Runs[0].llMoveEndNs;
+    printf("both    %-44s %-4s\n", "first moves ran at the same time", bOverlap ? "ok" : "FAIL");
+    if(!bOverlap)
+        g_nFailed++;
+
+    for(i = 0; i < 2; i++) {
+        Focusers[i].Disconnect();
+        delete pSerX[i];
+    }
+    return g_nFailed || nResults[0] || nResults[1] ? 1 : 0;
+}
@@ -0,0 +1,165 @@
+//
+//  sfautofocus.cpp
+//
+//  SmartFocus X2 plugin tools
+//  Checks CAutoFocus against CSmartFocusEmulator : every run samples a synthetic
+//  V-curve whose minimum is known, HFD = sqrt(a^2 + (a/b)^2 * (x - c)^2) for the
+//  hyperbola or a + k * (x - c)^2 for the parabola, optionally with gaussian
+//  noise, moving the emulated focuser to each grid position the sequencer asks
+//  for. A run passes when it ends where it should :
+//
+//      converging runs     AF_DONE, nBestPos within the expected error of the
+//                          true minimum, bConverged, fewer samples than the
+//                          grid and the focuser parked on nBestPos
+//      failing runs        AF_FAILED and the focuser back on the grid center
+//
+//  Prints one line per run, exits with 1 if any failed.
+//
+//  usage : sfautofocus [-v]
+//      -v  prints every sample
+//
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include <math.h>
+#include <random>
+
+#include "../SmartFocus.h"
+#include "../SmartFocusEmulator.h"
+#include "../AutoFocus.h"
+
+#define FOCUS_MOVE_LIMIT    2000    // ms for a move, the emulator runs them at 1e6 steps/s
+
+typedef struct {
+    const char  *pszName;
+    int         nModel;         // the curve sampled, and fitted
+    int         nCenter;        // grid center handed to start()
+    int         nStepSize;
+    int         nGridSize;
+    int         nTolerance;     // steps, 0 for half a grid step
+    double      dTrueMin;       // c, where the curve's minimum really is
+    double      dA;             // hyperbola a or parabola minimum
+    double      dB;             // hyperbola b or parabola k
+    double      dNoise;         // sigma of the gaussian noise added to the HFD, relative
+    int         nMaxError;      // steps from dTrueMin allowed for nBestPos, -1 when the run must fail
+} FocusCase;
+
+static const FocusCase g_Cases[] = {
+    {"hyperbola, minimum on a grid point",      AF_HYPERBOLA, 20000, 100, 21, 0,  20300.0, 2.0, 150.0, 0.0,   1},
+    {"hyperbola, minimum between grid points",  AF_HYPERBOLA, 20000, 100, 21, 0,  19863.0, 2.0, 150.0, 0.0,   1},
+    {"hyperbola, 2% noise",                     AF_HYPERBOLA, 20000, 100, 21, 25, 20137.0, 2.0, 150.0, 0.02,  25},
+    {"parabola, minimum between grid points",   AF_PARABOLA,  30000, 50,  25, 0,  30210.0, 2.5, 2e-5,  0.0,   1},
+    {"parabola, 1% noise",                      AF_PARABOLA,  30000, 50,  25, 15, 29880.0, 2.5, 2e-5,  0.01,  15},
+    {"minimum past the end of the grid",        AF_HYPERBOLA, 20000, 100, 11, 0,  21500.0, 2.0, 150.0, 0.0,   -1},
+};
+
+static bool g_bVerbose = false;
+
+static double curveHfd(const FocusCase &Case, int nPos)
+{
+    double dX = nPos - Case.dTrueMin;
+
+    if(Case.nModel == AF_HYPERBOLA)
+        return sqrt(Case.dA * Case.dA + (Case.dA / Case.dB) * (Case.dA / Case.dB) * dX * dX);
+    return Case.dA + Case.dB * dX * dX;
+}
+
+static int waitForMove(CSmartFocus &Focuser)
+{
+    CStopWatch Timer;
+    bool bComplete = false;
+    int nErr;
+
+    Timer.Reset();
+    while(Timer.GetElapsedSeconds() * 1000 < FOCUS_MOVE_LIMIT) {
+        nErr = Focuser.isGoToComplete(bComplete);
+        if(nErr || bComplete)
+            return nErr;
+        usleep(1000);
+    }
+    return ERR_CMDFAILED;
+}
+
+static bool runCase(const FocusCase &Case, unsigned int nSeed)
+{
+    EmulatorConfig Config = CSmartFocusEmulator::defaultConfig();
+    std::mt19937 Rng(nSeed);
+    std::normal_distribution<double> Noise(0.0, 1.0);
+    AutoFocusResult Result;
+    double dHfd;
+    int nErr;
+    int nPosition;
+    bool bPass;
+
+    Config.bByteTiming = false;
+    Config.nTurnaroundUs = 0;
+    Config.nJitterUs = 0;
+    Config.nMoveOverheadMs = 0;
+    Config.nBootMs = 0;
+    Config.dStepsPerSecond = 1e6;
+    Config.nStartPosition = Case.nCenter;
+    CSmartFocusEmulator SerX(Config);
+    CEmulatorSleeper Sleeper;
+    CSmartFocus Focuser;
+    CAutoFocus AutoFocus(Focuser);
+
+    Focuser.SetSerxPointer(&SerX);
+    Focuser.setSleeper(&Sleeper);
+    if(Focuser.Connect("autofocus")) {
+        printf("%-42s can't connect to the emulator\n", Case.pszName);
+        return false;
+    }
+
+    nErr = AutoFocus.start(Case.nCenter, Case.nStepSize, Case.nGridSize, Case.nModel, Case.nTolerance);
+    while(!nErr && AutoFocus.getState() == AF_SAMPLING) {
+        nErr = waitForMove(Focuser);
+        if(nErr)
+            break;
+        dHfd = curveHfd(Case, SerX.getDevicePosition());
+        dHfd *= 1.0 + Case.dNoise * Noise(Rng);
+        if(g_bVerbose)
+            printf("    %6d %8.4f\n", AutoFocus.getSamplePosition(), dHfd);
+        AutoFocus.addMeasurement(dHfd);
+    }
+    // the last move, to the minimum or back to the center.
+    if(!nErr)
+        nErr = waitForMove(Focuser);
+    nPosition = SerX.getDevicePosition();
+    AutoFocus.getResult(Result);
+    Focuser.Disconnect();
+
+    if(Case.nMaxError < 0) {
+        bPass = !nErr && AutoFocus.getState() == AF_FAILED && nPosition == Case.nCenter;
+        printf("%-42s %-4s %7s %7.0f %7s %5d/%-3d %9s %7d\n", Case.pszName, bPass ? "ok" : "FAIL", "-", Case.dTrueMin, "-",
+               Result.nSamples, Case.nGridSize, "-", nPosition);
+        return bPass;
+    }
+    bPass = !nErr && AutoFocus.getState() == AF_DONE && abs(Result.nBestPos - int(lround(Case.dTrueMin))) <= Case.nMaxError &&
+            Result.bConverged && Result.nSamples < Case.nGridSize && nPosition == Result.nBestPos;
+    printf("%-42s %-4s %7d %7.0f %7.1f %5d/%-3d %9s %7d\n", Case.pszName, bPass ? "ok" : "FAIL", Result.nBestPos, Case.dTrueMin,
+           Result.dSigmaSteps, Result.nSamples, Case.nGridSize, Result.bConverged ? "yes" : "no", nPosition);
+    return bPass;
+}
+
+int main(int argc, char **argv)
+{
+    int nFailed = 0;
+    int nOpt;
+
+    while((nOpt = getopt(argc, argv, "v")) != -1) {
+        switch(nOpt) {
+            case 'v':   g_bVerbose = true; break;
+            default:
+                fprintf(stderr, "usage : %s [-v]\n", argv[0]);
+                return 1;
+        }
+    }
+
+    printf("%-42s %-4s %7s %7s %7s %9s %9s %7s\n", "curve", "", "best", "true", "sigma", "samples", "converged", "parked");
+    for(size_t i = 0; i < sizeof(g_Cases) / sizeof(g_Cases[0]); i++) {
+        if(!runCase(g_Cases[i], (unsigned int)i + 1))
+            nFailed++;
+    }
+    return nFailed ? 1 : 0;
+}
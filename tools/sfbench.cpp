@@ -0,0 +1,283 @@
+//
+//  sfbench.cpp
+//
+//  SmartFocus X2 plugin tools
+//  Measures the driver's own overhead : CSmartFocus and X2Focuser entry points
+//  run against CSmartFocusEmulator in memory mode (no line or firmware delays),
+//  so everything reported is time spent in the driver and the OS.
+//
+//  Per operation :
+//      ns/op       wall time
+//      serx/op     calls into the SerXInterface, each one is at least a syscall on a real port
+//      sysrw/op    read / write syscalls of the whole process (Linux, /proc/self/io)
+//      csw/op      context switches of the whole process (getrusage)
+//      alloc/op    operator new calls of the whole process
+//  The reader thread is part of the driver, so its share is included.
+//
+//  usage : sfbench [-i iteration_scale]
+//
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include <new>
+#include <atomic>
+#include <mutex>
+#include <sys/resource.h>
+
+#include "../SmartFocus.h"
+#include "../SmartFocusEmulator.h"
+#include "../x2focuser.h"
+
+#include "../../../licensedinterfaces/mutexinterface.h"
+
+#define BENCH_IO_ITERATIONS     20000   // operations doing a round trip
+#define BENCH_FAST_ITERATIONS   2000000 // operations answered from memory
+#define BENCH_CYCLE_ITERATIONS  5000    // complete X2 goto sequences
+
+#pragma mark allocation counter
+static std::atomic<long long> g_llAllocations(0);
+
+void *operator new(size_t nSize)
+{
+    void *p;
+
+    g_llAllocations.fetch_add(1, std::memory_order_relaxed);
+    p = malloc(nSize ? nSize : 1);
+    if(!p)
+        throw std::bad_alloc();
+    return p;
+}
+
+void *operator new[](size_t nSize)
+{
+    return operator new(nSize);
+}
+
+void operator delete(void *p) noexcept
+{
+    free(p);
+}
+
+void operator delete[](void *p) noexcept
+{
+    free(p);
+}
+
+void operator delete(void *p, size_t) noexcept
+{
+    free(p);
+}
+
+void operator delete[](void *p, size_t) noexcept
+{
+    free(p);
+}
+
+#pragma mark stand-ins
+// counts the calls the driver makes into the serial port
+class CCountingSerX : public CSmartFocusEmulator
+{
+public:
+    CCountingSerX(const EmulatorConfig &Config) : CSmartFocusEmulator(Config) { m_llCalls = 0; };
+
+    virtual int     flushTx(void)   { m_llCalls++; return CSmartFocusEmulator::flushTx(); };
+    virtual int     purgeTxRx(void) { m_llCalls++; return CSmartFocusEmulator::purgeTxRx(); };
+    virtual int     waitForBytesRx(const int& nNumber, const int& nTimeOutMs) { m_llCalls++; return CSmartFocusEmulator::waitForBytesRx(nNumber, nTimeOutMs); };
+    virtual int     readFile(void* lpBuffer, const unsigned long dwTotalBytesToRead, unsigned long& dwBytesRead, const unsigned long& dwTimeOut = 1000)
+                    { m_llCalls++; return CSmartFocusEmulator::readFile(lpBuffer, dwTotalBytesToRead, dwBytesRead, dwTimeOut); };
+    virtual int     writeFile(void* lpBuffer, const unsigned long& dwBytesToWrite, unsigned long& dwBytesWritten)
+                    { m_llCalls++; return CSmartFocusEmulator::writeFile(lpBuffer, dwBytesToWrite, dwBytesWritten); };
+    virtual int     bytesWaitingRx(void) { m_llCalls++; return CSmartFocusEmulator::bytesWaitingRx(); };
+
+    std::atomic<long long>  m_llCalls;
+};
+
+class CBenchMutex : public MutexInterface
+{
+public:
+    virtual void    lock()      { m_Mutex.lock(); };
+    virtual void    unlock()    { m_Mutex.unlock(); };
+
+protected:
+    std::mutex      m_Mutex;
+};
+
+#pragma mark measurement
+typedef struct {
+    long long   llNs;
+    long long   llSerXCalls;
+    long long   llSysRW;
+    long long   llSwitches;
+    long long   llAllocations;
+} BenchSample;
+
+static CCountingSerX *g_pSerX = NULL;   // the port of the instance being measured
+
+static long long sysReadWrites()
+{
+    FILE *pFile;
+    char szLine[128];
+    long long llValue;
+    long long llTotal = 0;
+
+    pFile = fopen("/proc/self/io", "r");
+    if(!pFile)
+        return 0;
+    while(fgets(szLine, sizeof(szLine), pFile)) {
+        if(sscanf(szLine, "syscr: %lld", &llValue) == 1 || sscanf(szLine, "syscw: %lld", &llValue) == 1)
+            llTotal += llValue;
+    }
+    fclose(pFile);
+    return llTotal;
+}
+
+static long long contextSwitches()
+{
+    struct rusage Usage;
+
+    getrusage(RUSAGE_SELF, &Usage);
+    return Usage.ru_nvcsw + Usage.ru_nivcsw;
+}
+
+static void sample(BenchSample &Sample)
+{
+    Sample.llSerXCalls = g_pSerX ? g_pSerX->m_llCalls.load() : 0;
+    Sample.llSysRW = sysReadWrites();
+    Sample.llSwitches = contextSwitches();
+    Sample.llAllocations = g_llAllocations;
+    Sample.llNs = CStopWatch::NowNs();
+}
+
+template<typename Operation>
+static void bench(const char *pszName, long long llIterations, Operation Op)
+{
+    BenchSample Start;
+    BenchSample End;
+    double dCount;
+    long long i;
+
+    for(i = 0; i < llIterations / 100 + 1; i++)
+        Op();
+    sample(Start);
+    for(i = 0; i < llIterations; i++)
+        Op();
+    sample(End);
+    // /proc/self/io is read twice by sample() itself, don't charge it.
+    End.llSysRW -= 2;
+
+    dCount = (double)llIterations;
+    printf("%-44s %10lld %12.1f %9.3f %9.3f %9.3f %9.3f\n", pszName, llIterations,
+           (End.llNs - Start.llNs) / dCount,
+           (End.llSerXCalls - Start.llSerXCalls) / dCount,
+           (End.llSysRW - Start.llSysRW) / dCount,
+           (End.llSwitches - Start.llSwitches) / dCount,
+           (End.llAllocations - Start.llAllocations) / dCount);
+}
+
+#pragma mark benchmarks
+static EmulatorConfig benchConfig(double dStepsPerSecond)
+{
+    EmulatorConfig Config = CSmartFocusEmulator::defaultConfig();
+
+    Config.bByteTiming = false;
+    Config.nTurnaroundUs = 0;
+    Config.nJitterUs = 0;
+    Config.nMoveOverheadMs = 0;
+    Config.dStepsPerSecond = dStepsPerSecond;
+    return Config;
+}
+
+static void benchSmartFocus(double dScale)
+{
+    CCountingSerX SerX(benchConfig(1.0));
+    CEmulatorSleeper Sleeper;
+    CSmartFocus Focuser;
+    int nPosition;
+    int nStatus;
+    bool bComplete;
+
+    Focuser.SetSerxPointer(&SerX);
+    Focuser.setSleeper(&Sleeper);
+    if(Focuser.Connect("bench")) {
+        printf("CSmartFocus : can't connect to the emulator\n");
+        return;
+    }
+    g_pSerX = &SerX;
+
+    bench("CSmartFocus::getPosition (idle, cached)", (long long)(BENCH_IO_ITERATIONS * dScale), [&] { Focuser.getPosition(nPosition); });
+    bench("CSmartFocus::refreshDeviceState", (long long)(BENCH_IO_ITERATIONS * dScale), [&] { Focuser.refreshDeviceState(nStatus, nPosition); });
+
+    // 1 step per second, the move outlasts the benchmark.
+    Focuser.gotoPosition(60000);
+    bench("CSmartFocus::isGoToComplete (moving)", (long long)(BENCH_FAST_ITERATIONS * dScale), [&] { Focuser.isGoToComplete(bComplete); });
+    bench("CSmartFocus::getPosition (moving)", (long long)(BENCH_FAST_ITERATIONS * dScale), [&] { Focuser.getPosition(nPosition); });
+    Focuser.haltFocuser();
+
+    g_pSerX = NULL;
+    Focuser.Disconnect();
+}
+
+static void benchX2Focuser(double dScale)
+{
+    // X2Focuser deletes its interfaces.
+    CCountingSerX *pSerX = new CCountingSerX(benchConfig(1.0));
+    X2Focuser Focuser("SmartFocus bench", 0, pSerX, NULL, new CEmulatorSleeper, NULL, NULL, new CBenchMutex, NULL);
+    int nPosition;
+    int nDirection = 1;
+    bool bComplete;
+    std::string sLocks;
+
+    if(Focuser.establishLink()) {
+        printf("X2Focuser : can't connect to the emulator\n");
+        return;
+    }
+    g_pSerX = pSerX;
+
+    bench("X2Focuser::focPosition (idle, cached)", (long long)(BENCH_IO_ITERATIONS * dScale), [&] { Focuser.focPosition(nPosition); });
+
+    Focuser.startFocGoto(1000);
+    bench("X2Focuser::isCompleteFocGoto (moving)", (long long)(BENCH_FAST_ITERATIONS * dScale), [&] { Focuser.isCompleteFocGoto(bComplete); });
+    bench("X2Focuser::focPosition (moving)", (long long)(BENCH_FAST_ITERATIONS * dScale), [&] { Focuser.focPosition(nPosition); });
+    Focuser.focAbort();
+
+    // instant moves from here, the cost of a whole goto sequence as TheSkyX runs it.
+    pSerX->setConfig(benchConfig(1e9));
+    Focuser.focPosition(nPosition);
+    bench("X2Focuser::startFocGoto .. endFocGoto", (long long)(BENCH_CYCLE_ITERATIONS * dScale), [&] {
+        Focuser.startFocGoto(10 * nDirection);
+        nDirection = -nDirection;
+        do {
+            if(Focuser.isCompleteFocGoto(bComplete))
+                break;
+        } while(!bComplete);
+        Focuser.endFocGoto();
+    });
+
+    g_pSerX = NULL;
+    Focuser.getLockStatsReport(sLocks);
+    Focuser.terminateLink();
+    printf("\nhost mutex, per X2Focuser entry point :\n%s", sLocks.c_str());
+}
+
+int main(int argc, char **argv)
+{
+    double dScale = 1.0;
+    int nOpt;
+
+    while((nOpt = getopt(argc, argv, "i:")) != -1) {
+        switch(nOpt) {
+            case 'i':   dScale = atof(optarg); break;
+            default:
+                fprintf(stderr, "usage : %s [-i iteration_scale]\n", argv[0]);
+                return 1;
+        }
+    }
+    if(dScale <= 0.0)
+        dScale = 1.0;
+
+    printf("%-44s %10s %12s %9s %9s %9s %9s\n", "operation", "iterations", "ns/op", "serx/op", "sysrw/op", "csw/op", "alloc/op");
+    benchSmartFocus(dScale);
+    benchX2Focuser(dScale);
+    return 0;
+}
@@ -0,0 +1,261 @@
+//
+//  sffault.cpp
+//
+//  SmartFocus X2 plugin tools
+//  Fault recovery benchmark : CSmartFocus against CSmartFocusEmulator at 9600
+//  baud with byte timing and a fault script, driven the way the host drives a
+//  goto (gotoPosition, then isGoToComplete and a status / position round trip
+//  every poll). For every fault it reports how long after the fault hit the
+//  line or the motor the driver noticed it, and how long the goto took to end
+//  on target with a working link, to compare with the fault free first line.
+//
+//  noticed     a call failed, a reply timed out, was cut short or refused, a
+//              byte was unexpected or resynchronized, a move failed or the
+//              link went down. sampled every ms.
+//  on target   from the goto until isGoToComplete says done and a fresh
+//              status / position round trip agrees with the controller. a
+//              refused or failed goto is sent again, as the host would.
+//  errors      failed driver calls per run, what the host got to see
+//
+//  A fault the driver never notices, or doesn't get over within FAULT_RUN_LIMIT,
+//  shows as "-".
+//
+//  usage : sffault [-n runs] [-f fault_script]
+//      -n  runs per fault, FAULT_RUNS by default
+//      -f  only this script, see CSmartFocusEmulator::parseFaultScript
+//
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include <algorithm>
+#include <atomic>
+#include <thread>
+#include <vector>
+
+#include "../SmartFocus.h"
+#include "../SmartFocusEmulator.h"
+
+#define FAULT_RUNS          3
+#define FAULT_START         1000    // steps, the emulator's default start position
+#define FAULT_TARGET        2500    // a 1.5 s move at the default 1000 steps/s
+#define FAULT_POLL_MS       50
+#define FAULT_RUN_LIMIT     8000    // ms from the goto
+
+typedef struct {
+    const char  *pszName;
+    const char  *pszScript;
+} FaultScenario;
+
+static const FaultScenario g_Scenarios[] = {
+    {"none",                            ""},
+    {"'p' reply loses a byte",          "drop@p byte=1"},
+    {"'t' reply doubled",               "dup@t count=0"},
+    {"'p' opcode corrupted",            "corrupt@p"},
+    {"'t' reply held 800 ms",           "delay@t ms=800"},
+    {"'c' lost",                        "drop@c"},
+    {"'c' corrupted",                   "corrupt@c"},
+    {"goto refused",                    "refuse@g"},
+    {"move failed, 'r' for 'c'",        "refuse@c"},
+    {"motor stalled 2 s",               "stall@g after=300 ms=2000"},
+    {"unplugged 1.5 s mid-move",        "disconnect@g after=300 ms=1500"},
+};
+
+typedef struct {
+    bool        bFired;
+    bool        bNoticed;
+    bool        bOnTarget;
+    double      dNoticeMs;      // from the fault onset
+    double      dOnTargetMs;    // from the goto
+    int         nErrors;
+} RunResult;
+
+#pragma mark measurement
+// everything the driver counts when something goes wrong on the link
+static long long symptomCount(CSmartFocus &Focuser)
+{
+    LinkCounters Counters;
+    OpcodeStats Stats;
+    long long llCount;
+
+    Focuser.getLinkCounters(Counters);
+    llCount = Counters.llUnexpectedBytes + Counters.llMoveFailures + Counters.llResyncs + Counters.llLostCompletions;
+    for(int i = 0; i < SF_OPCODE_COUNT; i++) {
+        if(Focuser.getOpcodeStats(SF_OPCODES[i].cOpcode, Stats))
+            llCount += Stats.llTimeouts + Stats.llShortReads + Stats.llRefused;
+    }
+    return llCount;
+}
+
+static void noteTime(std::atomic<long long> &llTimeNs)
+{
+    long long llZero = 0;
+
+    llTimeNs.compare_exchange_strong(llZero, CStopWatch::NowNs());
+}
+
+static bool runOnce(const std::vector<EmulatorFault> &Script, unsigned int nSeed, RunResult &Result)
+{
+    EmulatorConfig Config = CSmartFocusEmulator::defaultConfig();
+    std::vector<EmulatorFaultRecord> Records;
+    std::atomic<long long> llNoticedNs(0);
+    std::atomic<bool> bWatching(true);
+    long long llBaseline;
+    long long llGotoNs;
+    long long llOnTargetNs = 0;
+    long long llDeadlineNs;
+    int nStatus;
+    int nPosition;
+    int nErr;
+    bool bComplete;
+    bool bResend;
+
+    Config.nSeed = nSeed;
+    Config.nStartPosition = FAULT_START;
+    CSmartFocusEmulator SerX(Config);
+    CEmulatorSleeper Sleeper;
+    CSmartFocus Focuser;
+
+    memset(&Result, 0, sizeof(Result));
+    Focuser.SetSerxPointer(&SerX);
+    Focuser.setSleeper(&Sleeper);
+    Focuser.setAutoReconnect(true);
+    if(Focuser.Connect("fault"))
+        return false;
+
+    // armed once connected, the connect probes aren't part of the run.
+    llBaseline = symptomCount(Focuser);
+    SerX.setFaultScript(Script);
+    std::thread Watcher([&] {
+        while(bWatching) {
+            if(symptomCount(Focuser) != llBaseline || !Focuser.isLinkUp())
+                noteTime(llNoticedNs);
+            std::this_thread::sleep_for(std::chrono::milliseconds(1));
+        }
+    });
+
+    llGotoNs = CStopWatch::NowNs();
+    llDeadlineNs = llGotoNs + FAULT_RUN_LIMIT * 1000000LL;
+    bResend = true;
+    while(CStopWatch::NowNs() < llDeadlineNs) {
+        if(bResend) {
+            nErr = Focuser.gotoPosition(FAULT_TARGET);
+            bResend = nErr != PLUGIN_OK;
+        }
+        else {
+            nErr = Focuser.isGoToComplete(bComplete);
+            // a failed move is reported once, the host tries again.
+            bResend = nErr != PLUGIN_OK;
+            if(!nErr)
+                nErr = Focuser.refreshDeviceState(nStatus, nPosition);
+            if(!nErr && bComplete) {
+                if(nStatus == IDLE && nPosition == FAULT_TARGET && nPosition == SerX.getDevicePosition()) {
+                    llOnTargetNs = CStopWatch::NowNs();
+                    break;
+                }
+                // done according to the driver but not there.
+                bResend = true;
+            }
+        }
+        if(nErr) {
+            Result.nErrors++;
+            noteTime(llNoticedNs);
+        }
+        Sleeper.sleep(FAULT_POLL_MS);
+    }
+
+    bWatching = false;
+    Watcher.join();
+    Focuser.Disconnect();
+
+    if(llOnTargetNs) {
+        Result.bOnTarget = true;
+        Result.dOnTargetMs = (llOnTargetNs - llGotoNs) / 1e6;
+    }
+    SerX.getFaultRecords(Records);
+    if(Records.empty())
+        return true;
+    Result.bFired = true;
+    if(llNoticedNs) {
+        Result.bNoticed = true;
+        Result.dNoticeMs = std::max(llNoticedNs - Records[0].llOnsetNs, 0LL) / 1e6;
+    }
+    return true;
+}
+
+#pragma mark report
+static void printLatency(std::vector<double> &Latencies)
+{
+    if(Latencies.empty()) {
+        printf(" %9s %9s", "-", "-");
+        return;
+    }
+    std::sort(Latencies.begin(), Latencies.end());
+    printf(" %9.1f %9.1f", Latencies[Latencies.size() / 2], Latencies.back());
+}
+
+static void runScenario(const char *pszName, const char *pszScript, int nRuns)
+{
+    std::vector<EmulatorFault> Script;
+    std::vector<double> Noticed;
+    std::vector<double> OnTarget;
+    RunResult Result;
+    int nFired = 0;
+    int nErrors = 0;
+    int nDone = 0;
+
+    if(!CSmartFocusEmulator::parseFaultScript(pszScript, Script)) {
+        printf("%-30s bad fault script \"%s\"\n", pszName, pszScript);
+        return;
+    }
+    for(int i = 0; i < nRuns; i++) {
+        if(!runOnce(Script, i + 1, Result)) {
+            printf("%-30s can't connect to the emulator\n", pszName);
+            return;
+        }
+        nDone++;
+        nErrors += Result.nErrors;
+        if(Result.bOnTarget)
+            OnTarget.push_back(Result.dOnTargetMs);
+        if(!Result.bFired)
+            continue;
+        nFired++;
+        if(Result.bNoticed)
+            Noticed.push_back(Result.dNoticeMs);
+    }
+
+    printf("%-30s %5d %5d %7d", pszName, nDone, nFired, (int)Noticed.size());
+    printLatency(Noticed);
+    printf(" %9d", (int)OnTarget.size());
+    printLatency(OnTarget);
+    printf(" %7.1f\n", double(nErrors) / nDone);
+}
+
+int main(int argc, char **argv)
+{
+    const char *pszScript = NULL;
+    int nRuns = FAULT_RUNS;
+    int nOpt;
+
+    while((nOpt = getopt(argc, argv, "n:f:")) != -1) {
+        switch(nOpt) {
+            case 'n':   nRuns = atoi(optarg); break;
+            case 'f':   pszScript = optarg; break;
+            default:
+                fprintf(stderr, "usage : %s [-n runs] [-f fault_script]\n", argv[0]);
+                return 1;
+        }
+    }
+    if(nRuns <= 0)
+        nRuns = FAULT_RUNS;
+
+    printf("%-30s %5s %5s %7s %9s %9s %9s %9s %9s %7s\n", "fault", "runs", "fired", "noticed", "p50 ms", "max ms",
+           "on target", "p50 ms", "max ms", "errors");
+    if(pszScript) {
+        runScenario(pszScript, pszScript, nRuns);
+        return 0;
+    }
+    for(size_t i = 0; i < sizeof(g_Scenarios) / sizeof(g_Scenarios[0]); i++)
+        runScenario(g_Scenarios[i].pszName, g_Scenarios[i].pszScript, nRuns);
+    return 0;
+}
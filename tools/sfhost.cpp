@@ -0,0 +1,507 @@
+//
+//  sfhost.cpp
+//
+//  SmartFocus X2 plugin tools
+//  Stands in for TheSkyX : loads libSmartFocus.so with dlopen, gets the driver
+//  from sbPlugInFactory2 with host side SerX (a CSmartFocusEmulator), Sleeper,
+//  IniUtil, Logger, Mutex and TickCount stand-ins, and drives it through
+//  FocuserDriverInterface the way the host does. Every instance runs on two
+//  threads of its own :
+//      poller      focPosition at -r Hz, what the focuser window does while shown
+//      user        jog bursts (a few short moves, clicked in a row) and autofocus
+//                  sweeps (a move per sample, an exposure, a focPosition), each
+//                  goto polled with isCompleteFocGoto until done then endFocGoto
+//  Connecting runs the host's sequence, queryAbstraction, device info,
+//  establishLink, limits and position.
+//
+//  Per X2 call, all instances together : calls, calls/s, failures and latency
+//  percentiles, in us.
+//
+//  usage : sfhost [-n instances] [-t seconds] [-r poll_hz] [-e exposure_ms] [-m] [path to libSmartFocus.so]
+//      -m  in-memory emulator, no line or firmware delays, what's left is the driver
+//
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <dlfcn.h>
+#include <string>
+#include <map>
+#include <mutex>
+#include <thread>
+#include <atomic>
+#include <vector>
+
+#include "../StopWatch.h"
+#include "../LinkStats.h"
+#include "../SmartFocusEmulator.h"
+
+#include "../../../licensedinterfaces/sberrorx.h"
+#include "../../../licensedinterfaces/focuserdriverinterface.h"
+#include "../../../licensedinterfaces/theskyxfacadefordriversinterface.h"
+#include "../../../licensedinterfaces/basicstringinterface.h"
+#include "../../../licensedinterfaces/basiciniutilinterface.h"
+#include "../../../licensedinterfaces/loggerinterface.h"
+#include "../../../licensedinterfaces/mutexinterface.h"
+#include "../../../licensedinterfaces/tickcountinterface.h"
+#include "../../../licensedinterfaces/sleeperinterface.h"
+
+#define HOST_INSTANCES      4
+#define HOST_SECONDS        20
+#define HOST_POLL_HZ        10
+#define HOST_EXPOSURE_MS    500     // per autofocus sample
+#define HOST_GOTO_POLL_MS   100     // isCompleteFocGoto while a goto runs
+#define HOST_GOTO_LIMIT     30000   // ms before a goto is given up on
+#define HOST_JOG_MOVES      5
+#define HOST_JOG_PAUSE_MS   200     // between two clicks
+#define HOST_SWEEP_SAMPLES  7
+#define HOST_SWEEP_STEP     100
+
+typedef int (*PlugInNameProc)(BasicStringInterface &str);
+typedef int (*PlugInFactoryProc)(const char *pszDisplayName, const int &nInstanceIndex, SerXInterface *pSerXIn,
+                                 TheSkyXFacadeForDriversInterface *pTheSkyXIn, SleeperInterface *pSleeperIn,
+                                 BasicIniUtilInterface *pIniUtilIn, LoggerInterface *pLoggerIn, MutexInterface *pIOMutexIn,
+                                 TickCountInterface *pTickCountIn, void **ppObjectOut);
+
+enum HostCall {CALL_QUERY_ABSTRACTION = 0, CALL_DEVICE_INFO, CALL_ESTABLISH_LINK, CALL_TERMINATE_LINK, CALL_LIMITS,
+               CALL_FOC_POSITION, CALL_START_GOTO, CALL_IS_COMPLETE, CALL_END_GOTO, HOST_CALLS};
+
+static const char *s_pszCallNames[HOST_CALLS] = {
+    "queryAbstraction", "deviceInfo*", "establishLink", "terminateLink", "focMinimum/MaximumLimit",
+    "focPosition", "startFocGoto", "isCompleteFocGoto", "endFocGoto"
+};
+
+#pragma mark stand-ins
+class CHostString : public BasicStringInterface
+{
+public:
+    virtual BasicStringInterface &operator=(const char *psz)    { m_s = psz ? psz : ""; return *this; };
+    virtual BasicStringInterface &operator+=(const char *psz)   { m_s += psz ? psz : ""; return *this; };
+    virtual BasicStringInterface &operator=(const int &n)       { m_s = std::to_string(n); return *this; };
+    virtual BasicStringInterface &operator+=(const int &n)      { m_s += std::to_string(n); return *this; };
+    virtual BasicStringInterface &operator=(const double &d)    { m_s = std::to_string(d); return *this; };
+    virtual BasicStringInterface &operator+=(const double &d)   { m_s += std::to_string(d); return *this; };
+    virtual const char  *c_str()    { return m_s.c_str(); };
+    virtual int         length()    { return (int)m_s.size(); };
+
+protected:
+    std::string     m_s;
+};
+
+// the host's ini file, in memory. one per instance, as the host keys them by instance.
+class CHostIniUtil : public BasicIniUtilInterface
+{
+public:
+    CHostIniUtil()
+    {
+        // no journal files in $HOME from a benchmark.
+        m_Values["SmartFocus/JournalFile"] = "";
+    };
+
+    virtual int readInt(const char *pszParentKey, const char *pszChildKey, const int &nDefault, int *pnErr = 0)
+    {
+        std::string sValue;
+
+        if(pnErr)
+            *pnErr = SB_OK;
+        return find(pszParentKey, pszChildKey, sValue) ? atoi(sValue.c_str()) : nDefault;
+    };
+    virtual int writeInt(const char *pszParentKey, const char *pszChildKey, const int &nValue)
+    {
+        return set(pszParentKey, pszChildKey, std::to_string(nValue));
+    };
+    virtual double readDouble(const char *pszParentKey, const char *pszChildKey, const double &dDefault, int *pnErr = 0)
+    {
+        std::string sValue;
+
+        if(pnErr)
+            *pnErr = SB_OK;
+        return find(pszParentKey, pszChildKey, sValue) ? atof(sValue.c_str()) : dDefault;
+    };
+    virtual int writeDouble(const char *pszParentKey, const char *pszChildKey, const double &dValue)
+    {
+        return set(pszParentKey, pszChildKey, std::to_string(dValue));
+    };
+    virtual void readString(const char *pszParentKey, const char *pszChildKey, const char *pszDefault, char *pszOut, int nOutMaxSize, int *pnErr = 0)
+    {
+        std::string sValue;
+
+        if(pnErr)
+            *pnErr = SB_OK;
+        if(!find(pszParentKey, pszChildKey, sValue))
+            sValue = pszDefault ? pszDefault : "";
+        // pszDefault and pszOut may be the same buffer.
+        if(nOutMaxSize > 0)
+            snprintf(pszOut, nOutMaxSize, "%s", sValue.c_str());
+    };
+    virtual int writeString(const char *pszParentKey, const char *pszChildKey, const char *pszValue)
+    {
+        return set(pszParentKey, pszChildKey, pszValue ? pszValue : "");
+    };
+
+protected:
+    bool find(const char *pszParentKey, const char *pszChildKey, std::string &sValue)
+    {
+        std::lock_guard<std::mutex> lock(m_Lock);
+        std::map<std::string, std::string>::iterator it = m_Values.find(std::string(pszParentKey) + "/" + pszChildKey);
+
+        if(it == m_Values.end())
+            return false;
+        sValue = it->second;
+        return true;
+    };
+    int set(const char *pszParentKey, const char *pszChildKey, const std::string &sValue)
+    {
+        std::lock_guard<std::mutex> lock(m_Lock);
+
+        m_Values[std::string(pszParentKey) + "/" + pszChildKey] = sValue;
+        return SB_OK;
+    };
+
+    std::mutex                          m_Lock;
+    std::map<std::string, std::string>  m_Values;
+};
+
+static std::atomic<long long> g_llLogLines(0);
+
+// the host log window, only counted
+class CHostLogger : public LoggerInterface
+{
+public:
+    virtual int out(const char *) { g_llLogLines++; return 0; };
+};
+
+class CHostMutex : public MutexInterface
+{
+public:
+    virtual void    lock()      { m_Mutex.lock(); };
+    virtual void    unlock()    { m_Mutex.unlock(); };
+
+protected:
+    std::mutex      m_Mutex;
+};
+
+class CHostTickCount : public TickCountInterface
+{
+public:
+    CHostTickCount() { m_llStartNs = CStopWatch::NowNs(); };
+    virtual int elapsed(void) { return int((CStopWatch::NowNs() - m_llStartNs) / 1000000); };
+
+protected:
+    long long       m_llStartNs;
+};
+
+#pragma mark measurement
+// latencies go in the CLinkStats buckets in ns rather than us, sub-us cached calls stay apart.
+typedef struct {
+    long long   llBuckets[STATS_BUCKETS];
+    long long   llCount;
+    long long   llFailures;
+    long long   llMaxNs;
+} CallStats;
+
+class CCallTimer
+{
+public:
+    CCallTimer(CallStats &Stats) : m_Stats(Stats) { m_llStartNs = CStopWatch::NowNs(); };
+
+    int done(int nErr)
+    {
+        long long llNs = CStopWatch::NowNs() - m_llStartNs;
+
+        m_Stats.llBuckets[CLinkStats::bucketOf(llNs)]++;
+        m_Stats.llCount++;
+        if(nErr)
+            m_Stats.llFailures++;
+        if(llNs > m_Stats.llMaxNs)
+            m_Stats.llMaxNs = llNs;
+        return nErr;
+    };
+
+protected:
+    CallStats       &m_Stats;
+    long long       m_llStartNs;
+};
+
+// one driver as the host holds it, each thread keeps its own stats.
+typedef struct {
+    FocuserDriverInterface  *pDriver;
+    TickCountInterface      *pTickCount;    // X2Focuser doesn't delete this one
+    CallStats               Stats[2][HOST_CALLS];   // poller, user
+    long long               llGotos;
+    long long               llGotosTimedOut;
+} HostInstance;
+
+static std::atomic<bool> g_bRunning(true);
+
+static void hostSleep(int nMs)
+{
+    std::this_thread::sleep_for(std::chrono::milliseconds(nMs));
+}
+
+#pragma mark host call patterns
+static bool connectInstance(HostInstance &Instance)
+{
+    CallStats *pStats = Instance.Stats[1];
+    FocuserDriverInterface *pDriver = Instance.pDriver;
+    CHostString str;
+    void *pInterface;
+    int nValue;
+
+    {
+        CCallTimer Timer(pStats[CALL_QUERY_ABSTRACTION]);
+        pDriver->queryAbstraction(LinkInterface_Name, &pInterface);
+        pDriver->queryAbstraction(FocuserGotoInterface2_Name, &pInterface);
+        Timer.done(SB_OK);
+    }
+    {
+        CCallTimer Timer(pStats[CALL_DEVICE_INFO]);
+        pDriver->deviceInfoNameShort(str);
+        pDriver->deviceInfoNameLong(str);
+        pDriver->deviceInfoDetailedDescription(str);
+        pDriver->driverInfoDetailedInfo(str);
+        Timer.done(SB_OK);
+    }
+    if(CCallTimer(pStats[CALL_ESTABLISH_LINK]).done(pDriver->establishLink()))
+        return false;
+    {
+        CCallTimer Timer(pStats[CALL_DEVICE_INFO]);
+        pDriver->deviceInfoFirmwareVersion(str);
+        pDriver->deviceInfoModel(str);
+        Timer.done(SB_OK);
+    }
+    {
+        CCallTimer Timer(pStats[CALL_LIMITS]);
+        Timer.done(pDriver->focMinimumLimit(nValue) | pDriver->focMaximumLimit(nValue));
+    }
+    CCallTimer(pStats[CALL_FOC_POSITION]).done(pDriver->focPosition(nValue));
+    return true;
+}
+
+// startFocGoto, isCompleteFocGoto every HOST_GOTO_POLL_MS until done, endFocGoto.
+static void hostGoto(HostInstance &Instance, int nRelativeOffset)
+{
+    CallStats *pStats = Instance.Stats[1];
+    FocuserDriverInterface *pDriver = Instance.pDriver;
+    long long llDeadlineNs = CStopWatch::NowNs() + HOST_GOTO_LIMIT * 1000000LL;
+    bool bComplete = false;
+
+    Instance.llGotos++;
+    if(CCallTimer(pStats[CALL_START_GOTO]).done(pDriver->startFocGoto(nRelativeOffset)))
+        return;
+    while(CStopWatch::NowNs() < llDeadlineNs) {
+        if(CCallTimer(pStats[CALL_IS_COMPLETE]).done(pDriver->isCompleteFocGoto(bComplete)) || bComplete)
+            break;
+        hostSleep(HOST_GOTO_POLL_MS);
+    }
+    if(!bComplete && CStopWatch::NowNs() >= llDeadlineNs)
+        Instance.llGotosTimedOut++;
+    CCallTimer(pStats[CALL_END_GOTO]).done(pDriver->endFocGoto());
+}
+
+static void jogBurst(HostInstance &Instance, unsigned int &nSeed)
+{
+    for(int i = 0; i < HOST_JOG_MOVES && g_bRunning; i++) {
+        hostGoto(Instance, (rand_r(&nSeed) % 2 ? 1 : -1) * (10 + rand_r(&nSeed) % 41));
+        hostSleep(HOST_JOG_PAUSE_MS);
+    }
+}
+
+// out past focus, back through it a sample at a time, then to the best one.
+static void autofocusSweep(HostInstance &Instance, int nExposureMs)
+{
+    int nPosition;
+
+    hostGoto(Instance, HOST_SWEEP_STEP * (HOST_SWEEP_SAMPLES / 2));
+    for(int i = 0; i < HOST_SWEEP_SAMPLES && g_bRunning; i++) {
+        if(i)
+            hostGoto(Instance, -HOST_SWEEP_STEP);
+        hostSleep(nExposureMs);
+        CCallTimer(Instance.Stats[1][CALL_FOC_POSITION]).done(Instance.pDriver->focPosition(nPosition));
+    }
+    hostGoto(Instance, HOST_SWEEP_STEP * (HOST_SWEEP_SAMPLES / 2));
+}
+
+static void userThread(HostInstance *pInstance, int nIndex, int nExposureMs)
+{
+    unsigned int nSeed = nIndex + 1;
+
+    // instances don't all start their first move together.
+    hostSleep(rand_r(&nSeed) % 500);
+    while(g_bRunning) {
+        jogBurst(*pInstance, nSeed);
+        if(g_bRunning)
+            autofocusSweep(*pInstance, nExposureMs);
+    }
+}
+
+static void pollerThread(HostInstance *pInstance, int nPollHz)
+{
+    long long llPeriodNs = 1000000000LL / nPollHz;
+    long long llNextNs = CStopWatch::NowNs();
+    int nPosition;
+
+    while(g_bRunning) {
+        CCallTimer(pInstance->Stats[0][CALL_FOC_POSITION]).done(pInstance->pDriver->focPosition(nPosition));
+        llNextNs += llPeriodNs;
+        if(llNextNs > CStopWatch::NowNs())
+            std::this_thread::sleep_for(std::chrono::nanoseconds(llNextNs - CStopWatch::NowNs()));
+        else
+            llNextNs = CStopWatch::NowNs();
+    }
+}
+
+#pragma mark report
+static void printReport(std::vector<HostInstance> &Instances, double dSeconds)
+{
+    CallStats Total;
+    long long llCalls = 0;
+    long long llGotos = 0;
+    long long llTimedOut = 0;
+
+    printf("\n%-26s %10s %10s %8s %10s %10s %10s %10s\n", "call", "calls", "calls/s", "failed", "p50 us", "p90 us", "p99 us", "max us");
+    for(int nCall = 0; nCall < HOST_CALLS; nCall++) {
+        memset(&Total, 0, sizeof(Total));
+        for(size_t i = 0; i < Instances.size(); i++) {
+            for(int nThread = 0; nThread < 2; nThread++) {
+                const CallStats &Stats = Instances[i].Stats[nThread][nCall];
+
+                for(int b = 0; b < STATS_BUCKETS; b++)
+                    Total.llBuckets[b] += Stats.llBuckets[b];
+                Total.llCount += Stats.llCount;
+                Total.llFailures += Stats.llFailures;
+                if(Stats.llMaxNs > Total.llMaxNs)
+                    Total.llMaxNs = Stats.llMaxNs;
+            }
+        }
+        if(!Total.llCount)
+            continue;
+        llCalls += Total.llCount;
+        printf("%-26s %10lld %10.1f %8lld %10.3f %10.3f %10.3f %10.3f\n", s_pszCallNames[nCall], Total.llCount, Total.llCount / dSeconds, Total.llFailures,
+               CLinkStats::percentileUs(Total.llBuckets, Total.llCount, Total.llMaxNs, 50.0) / 1000.0,
+               CLinkStats::percentileUs(Total.llBuckets, Total.llCount, Total.llMaxNs, 90.0) / 1000.0,
+               CLinkStats::percentileUs(Total.llBuckets, Total.llCount, Total.llMaxNs, 99.0) / 1000.0,
+               Total.llMaxNs / 1000.0);
+    }
+    for(size_t i = 0; i < Instances.size(); i++) {
+        llGotos += Instances[i].llGotos;
+        llTimedOut += Instances[i].llGotosTimedOut;
+    }
+    printf("\n%lld calls in %.1f s, %.1f calls/s, %lld gotos (%lld timed out), %lld log lines\n", llCalls, dSeconds, llCalls / dSeconds,
+           llGotos, llTimedOut, g_llLogLines.load());
+}
+
+int main(int argc, char **argv)
+{
+    const char *pszLibrary = "./libSmartFocus.so";
+    int nInstances = HOST_INSTANCES;
+    int nSeconds = HOST_SECONDS;
+    int nPollHz = HOST_POLL_HZ;
+    int nExposureMs = HOST_EXPOSURE_MS;
+    bool bInMemory = false;
+    void *pLibrary;
+    PlugInNameProc pNameProc;
+    PlugInFactoryProc pFactoryProc;
+    CHostString sName;
+    EmulatorConfig Config;
+    std::vector<HostInstance> Instances;
+    std::vector<std::thread> Threads;
+    void *pObject;
+    long long llStartNs;
+    double dSeconds;
+    int nOpt;
+
+    while((nOpt = getopt(argc, argv, "n:t:r:e:m")) != -1) {
+        switch(nOpt) {
+            case 'n':   nInstances = atoi(optarg); break;
+            case 't':   nSeconds = atoi(optarg); break;
+            case 'r':   nPollHz = atoi(optarg); break;
+            case 'e':   nExposureMs = atoi(optarg); break;
+            case 'm':   bInMemory = true; break;
+            default:
+                fprintf(stderr, "usage : %s [-n instances] [-t seconds] [-r poll_hz] [-e exposure_ms] [-m] [libSmartFocus.so]\n", argv[0]);
+                return 1;
+        }
+    }
+    if(optind < argc)
+        pszLibrary = argv[optind];
+    if(nInstances <= 0)
+        nInstances = HOST_INSTANCES;
+    if(nSeconds <= 0)
+        nSeconds = HOST_SECONDS;
+    if(nPollHz <= 0)
+        nPollHz = HOST_POLL_HZ;
+    if(nExposureMs < 0)
+        nExposureMs = HOST_EXPOSURE_MS;
+
+    pLibrary = dlopen(pszLibrary, RTLD_NOW | RTLD_LOCAL);
+    if(!pLibrary) {
+        fprintf(stderr, "can't load %s : %s\n", pszLibrary, dlerror());
+        return 1;
+    }
+    pNameProc = (PlugInNameProc)dlsym(pLibrary, "sbPlugInName2");
+    pFactoryProc = (PlugInFactoryProc)dlsym(pLibrary, "sbPlugInFactory2");
+    if(!pNameProc || !pFactoryProc) {
+        fprintf(stderr, "%s : sbPlugInName2 or sbPlugInFactory2 missing\n", pszLibrary);
+        dlclose(pLibrary);
+        return 1;
+    }
+    pNameProc(sName);
+    printf("%s : %s, %d instances, %d s, focPosition at %d Hz, %s emulator\n", pszLibrary, sName.c_str(), nInstances, nSeconds, nPollHz,
+           bInMemory ? "in-memory" : "9600 baud");
+
+    Config = CSmartFocusEmulator::defaultConfig();
+    if(bInMemory) {
+        Config.bByteTiming = false;
+        Config.nTurnaroundUs = 0;
+        Config.nJitterUs = 0;
+        Config.nBootMs = 0;
+    }
+    // the driver deletes everything it's given but the tick count, like the host expects.
+    Instances.resize(nInstances);
+    for(int i = 0; i < nInstances; i++) {
+        HostInstance &Instance = Instances[i];
+
+        memset(&Instance, 0, sizeof(Instance));
+        Config.nSeed = i + 1;
+        Instance.pTickCount = new CHostTickCount;
+        pObject = NULL;
+        pFactoryProc("SmartFocus", i, new CSmartFocusEmulator(Config), NULL, new CEmulatorSleeper, new CHostIniUtil,
+                     new CHostLogger, new CHostMutex, Instance.pTickCount, &pObject);
+        // the factory hands out the driver object, FocuserDriverInterface is its first base.
+        Instance.pDriver = (FocuserDriverInterface *)pObject;
+        if(!Instance.pDriver) {
+            fprintf(stderr, "sbPlugInFactory2 failed for instance %d\n", i);
+            return 1;
+        }
+    }
+
+    // the host connects its devices one after the other.
+    for(int i = 0; i < nInstances; i++) {
+        if(!connectInstance(Instances[i])) {
+            fprintf(stderr, "instance %d : establishLink failed\n", i);
+            return 1;
+        }
+    }
+
+    llStartNs = CStopWatch::NowNs();
+    for(int i = 0; i < nInstances; i++) {
+        Threads.push_back(std::thread(pollerThread, &Instances[i], nPollHz));
+        Threads.push_back(std::thread(userThread, &Instances[i], i, nExposureMs));
+    }
+    hostSleep(nSeconds * 1000);
+    g_bRunning = false;
+    for(size_t i = 0; i < Threads.size(); i++)
+        Threads[i].join();
+    dSeconds = (CStopWatch::NowNs() - llStartNs) * 1e-9;
+
+    for(int i = 0; i < nInstances; i++) {
+        CCallTimer(Instances[i].Stats[1][CALL_TERMINATE_LINK]).done(Instances[i].pDriver->terminateLink());
+        delete Instances[i].pDriver;
+        delete Instances[i].pTickCount;
+    }
+    printReport(Instances, dSeconds);
+    dlclose(pLibrary);
+    return 0;
+}
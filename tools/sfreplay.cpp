@@ -0,0 +1,214 @@
+//
+//  sfreplay.cpp
+//
+//  SmartFocus X2 plugin tools
+//  Replays a protocol trace (see ProtocolTrace.h, TraceFile in the ini) through
+//  CSmartFocus with CTraceReplaySerX as the serial port. Every command found in
+//  the trace is turned back into the driver call that produced it and issued
+//  at the same point in time (divided by the speed), the controller side is
+//  played back from the recorded bytes.
+//
+//  usage : sfreplay [-s speed] [-n session] [-l] trace_file
+//      -s  1 (default) real time, 10 ten times faster, 0 as fast as possible
+//      -n  only replay this session (1 based), all of them by default
+//      -l  list the sessions and exit
+//
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <map>
+#include <string>
+#include <thread>
+
+#include "../SmartFocus.h"
+#include "TraceReplaySerX.h"
+
+typedef struct {
+    CStopWatch  Replay;         // laps = driver call durations during the replay
+    CStopWatch  Recorded;       // laps = command to first reply byte in the trace
+    int         nErrors;
+} CallStats;
+
+static const char *callName(const std::vector<unsigned char> &Cmd)
+{
+    switch(Cmd[0]) {
+        case 't':   return (Cmd.size() >= 2 && Cmd[1] == 'p') ? "refreshDeviceState" : "getDeviceStatus";
+        case 'p':   return "getPosition";
+        case 'g':   return "gotoPosition";
+        case 's':   return "haltFocuser";
+        case 'b':   return "getFirmwareVersion";
+        case 'z':   return "syncMotorPosition";
+        default:    return NULL;
+    }
+}
+
+// the public driver call that sends Cmd
+static int replayCall(CSmartFocus &Focuser, const std::vector<unsigned char> &Cmd)
+{
+    int nStatus;
+    int nPosition;
+    char szVersion[SERIAL_BUFFER_SIZE];
+
+    switch(Cmd[0]) {
+        case 't':
+            if(Cmd.size() >= 2 && Cmd[1] == 'p')
+                return Focuser.refreshDeviceState(nStatus, nPosition);
+            return Focuser.getDeviceStatus(nStatus);
+        case 'p':
+            return Focuser.getPosition(nPosition);
+        case 'g':
+            if(Cmd.size() < 3)
+                return ERR_CMDFAILED;
+            return Focuser.gotoPosition((int(Cmd[1]) << 8) | int(Cmd[2]));
+        case 's':
+            return Focuser.haltFocuser();
+        case 'b':
+            return Focuser.getFirmwareVersion(szVersion, SERIAL_BUFFER_SIZE);
+        case 'z':
+            return Focuser.syncMotorPosition(0);
+        default:
+            return ERR_CMDFAILED;
+    }
+}
+
+static std::string sessionPort(const TraceRecord &Open)
+{
+    if(Open.Data.size() <= 8)
+        return "trace";
+    return std::string(Open.Data.begin() + 8, Open.Data.end());
+}
+
+static long long sessionWallUs(const TraceRecord &Open)
+{
+    long long llWallUs = 0;
+
+    for(size_t i = 0; i < 8 && i < Open.Data.size(); i++)
+        llWallUs |= (long long)Open.Data[i] << (8 * i);
+    return llWallUs;
+}
+
+static void replaySession(const std::vector<TraceRecord> &Records, size_t nFirst, size_t nEnd, double dSpeed)
+{
+    CTraceReplaySerX SerX(Records, nFirst, nEnd, dSpeed);
+    CReplaySleeper Sleeper(dSpeed);
+    CSmartFocus Focuser;
+    std::map<std::string, CallStats> Stats;
+    std::chrono::steady_clock::time_point tStart;
+    CStopWatch SessionTimer;
+    CStopWatch CallTimer;
+    const char *pszName;
+    size_t nRecord;
+    size_t nReply;
+    int nErr;
+
+    Focuser.SetSerxPointer(&SerX);
+    Focuser.setSleeper(&Sleeper);
+
+    tStart = std::chrono::steady_clock::now();
+    SessionTimer.Reset();
+    for(nRecord = nFirst; nRecord < nEnd; nRecord++) {
+        const TraceRecord &Record = Records[nRecord];
+
+        std::this_thread::sleep_until(tStart + SerX.scaled(Record.llTimeNs));
+        switch(Record.nType) {
+            case TRACE_OPEN:
+                nErr = Focuser.Connect(sessionPort(Record).c_str());
+                if(nErr)
+                    printf("  Connect error %d\n", nErr);
+                break;
+
+            case TRACE_CLOSE:
+                Focuser.Disconnect();
+                break;
+
+            case TRACE_TX:
+                // sent by the driver on its own (Connect, ...), nothing to call.
+                if(Record.Data.empty() || SerX.isConsumed(nRecord))
+                    break;
+                pszName = callName(Record.Data);
+                if(!pszName) {
+                    printf("  unknown command 0x%02X at %.6fs\n", Record.Data[0], Record.llTimeNs * 1e-9);
+                    break;
+                }
+                for(nReply = nRecord + 1; nReply < nEnd && Records[nReply].nType != TRACE_TX; nReply++) {
+                    if(Records[nReply].nType == TRACE_RX) {
+                        Stats[pszName].Recorded.AddLap(Records[nReply].llTimeNs - Record.llTimeNs);
+                        break;
+                    }
+                }
+                CallTimer.Reset();
+                nErr = replayCall(Focuser, Record.Data);
+                Stats[pszName].Replay.AddLap(CallTimer.GetElapsedNs());
+                if(nErr)
+                    Stats[pszName].nErrors++;
+                break;
+        }
+    }
+    Focuser.Disconnect();
+
+    printf("  trace span %.3fs, replayed in %.3fs\n", Records[nEnd - 1].llTimeNs * 1e-9, SessionTimer.GetElapsedSeconds());
+    printf("  commands matched %d, skipped %d, not in the trace %d\n", SerX.getMatched(), SerX.getSkipped(), SerX.getMismatched());
+    printf("  %-20s %6s %6s %12s %12s %12s %14s\n", "call", "count", "errors", "min ms", "mean ms", "max ms", "recorded ms");
+    for(std::map<std::string, CallStats>::iterator it = Stats.begin(); it != Stats.end(); ++it) {
+        CallStats &Call = it->second;
+        printf("  %-20s %6lld %6d %12.3f %12.3f %12.3f %14.3f\n", it->first.c_str(),
+               Call.Replay.GetLapCount(), Call.nErrors,
+               Call.Replay.GetLapMinNs() * 1e-6, Call.Replay.GetLapMeanNs() * 1e-6, Call.Replay.GetLapMaxNs() * 1e-6,
+               Call.Recorded.GetLapMeanNs() * 1e-6);
+    }
+}
+
+int main(int argc, char **argv)
+{
+    std::vector<TraceRecord> Records;
+    std::vector<size_t> Sessions;
+    double dSpeed = 1.0;
+    int nSession = 0;
+    bool bList = false;
+    time_t tWall;
+    size_t nEnd;
+    int nOpt;
+    int nErr;
+
+    while((nOpt = getopt(argc, argv, "s:n:l")) != -1) {
+        switch(nOpt) {
+            case 's':   dSpeed = atof(optarg); break;
+            case 'n':   nSession = atoi(optarg); break;
+            case 'l':   bList = true; break;
+            default:
+                fprintf(stderr, "usage : %s [-s speed] [-n session] [-l] trace_file\n", argv[0]);
+                return 1;
+        }
+    }
+    if(optind >= argc) {
+        fprintf(stderr, "usage : %s [-s speed] [-n session] [-l] trace_file\n", argv[0]);
+        return 1;
+    }
+
+    nErr = CProtocolTrace::load(argv[optind], Records);
+    if(nErr) {
+        fprintf(stderr, "%s : %s\n", argv[optind], nErr == -1 ? "can't open" : "not a SmartFocus trace");
+        return 1;
+    }
+    for(size_t i = 0; i < Records.size(); i++) {
+        if(Records[i].nType == TRACE_OPEN)
+            Sessions.push_back(i);
+    }
+    if(Sessions.empty()) {
+        fprintf(stderr, "%s : no session\n", argv[optind]);
+        return 1;
+    }
+
+    for(size_t i = 0; i < Sessions.size(); i++) {
+        if(nSession && nSession != int(i + 1))
+            continue;
+        nEnd = (i + 1 < Sessions.size()) ? Sessions[i + 1] : Records.size();
+        tWall = (time_t)(sessionWallUs(Records[Sessions[i]]) / 1000000);
+        printf("session %d : %s, %d records, %s", int(i + 1), sessionPort(Records[Sessions[i]]).c_str(), int(nEnd - Sessions[i]), ctime(&tWall));
+        if(!bList)
+            replaySession(Records, Sessions[i], nEnd, dSpeed);
+    }
+    return 0;
+}
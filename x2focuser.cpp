@@ -1,6 +1,8 @@
 #include <stdio.h>
+#include <stdlib.h>
 #include <string.h>
 #include "x2focuser.h"
+#include "NativeSerX.h"
 
 #include "../../licensedinterfaces/theskyxfacadefordriversinterface.h"
 #include "../../licensedinterfaces/sleeperinterface.h"
@@ -13,6 +15,12 @@
 #include "../../licensedinterfaces/sberrorx.h"
 #include "../../licensedinterfaces/serialportparams2interface.h"
 
+// X2LockEntry names
+static const char * const s_pszLockEntries[X2_LOCK_ENTRIES] = {
+    "deviceInfoFirmwareVersion", "establishLink", "terminateLink", "set zero position", "focPosition", "focAbort",
+    "startFocGoto", "endFocGoto"
+};
+
 X2Focuser::X2Focuser(const char* pszDisplayName, 
 												const int& nInstanceIndex,
 												SerXInterface						* pSerXIn, 
@@ -22,8 +30,12 @@ X2Focuser::X2Focuser(const char* pszDisplayName,
 												LoggerInterface						* pLoggerIn,
 												MutexInterface						* pIOMutexIn,
 												TickCountInterface					* pTickCountIn)
-
+    : m_LockStats(s_pszLockEntries, X2_LOCK_ENTRIES)
 {
+    char szTraceFile[DRIVER_MAX_STRING];
+    char szJournalFile[DRIVER_MAX_STRING];
+
+    m_nPrivateMulitInstanceIndex    = nInstanceIndex;
 	m_pSerX							= pSerXIn;		
 	m_pTheSkyXForMounts				= pTheSkyXIn;
 	m_pSleeper						= pSleeperIn;
@@ -31,6 +43,7 @@ X2Focuser::X2Focuser(const char* pszDisplayName,
 	m_pLogger						= pLoggerIn;	
 	m_pIOMutex						= pIOMutexIn;
 	m_pTickCount					= pTickCountIn;
+    m_pNativeSerX                   = NULL;
 	
 	m_bLinked = false;
 	m_nPosition = 0;
@@ -39,16 +52,33 @@ X2Focuser::X2Focuser(const char* pszDisplayName,
     // Read in settings
     if (m_pIniUtil) {
         m_SmartFocusController.setPosLimit(m_pIniUtil->readInt(PARENT_KEY, POS_LIMIT, 65535));
+        if(m_pIniUtil->readInt(PARENT_KEY, DEBUG_LOG, 0))
+            m_SmartFocusController.setDebugLog(true);
+        m_SmartFocusController.setAutoReconnect(m_pIniUtil->readInt(PARENT_KEY, AUTO_RECONNECT, 1) != 0);
+        m_pIniUtil->readString(PARENT_KEY, TRACE_FILE, "", szTraceFile, DRIVER_MAX_STRING);
+        m_SmartFocusController.setTraceFile(szTraceFile);
+        defaultJournalPath(szJournalFile, DRIVER_MAX_STRING);
+        m_pIniUtil->readString(PARENT_KEY, JOURNAL_FILE, szJournalFile, szJournalFile, DRIVER_MAX_STRING);
+        m_SmartFocusController.setJournalFile(szJournalFile);
     }
-	m_SmartFocusController.SetSerxPointer(m_pSerX);
+#ifndef SB_WIN_BUILD
+    if(useNativeSerial())
+        m_pNativeSerX = new CNativeSerX();
+#endif
+	m_SmartFocusController.SetSerxPointer(m_pNativeSerX ? m_pNativeSerX : m_pSerX);
     m_SmartFocusController.setSleeper(m_pSleeper);
 }
 
 X2Focuser::~X2Focuser()
 {
+    // the I/O, move queue and supervisor threads use the port and the sleeper, they stop first.
+    m_SmartFocusController.Disconnect();
+
     //Delete objects used through composition
 	if (GetSerX())
 		delete GetSerX();
+	if (m_pNativeSerX)
+		delete m_pNativeSerX;
 	if (GetTheSkyXFacadeForDrivers())
 		delete GetTheSkyXFacadeForDrivers();
 	if (GetSleeper())
@@ -124,7 +154,7 @@ void X2Focuser::deviceInfoFirmwareVersion(BasicStringInterface& str)
         str="NA";
     }
     else {
-        X2MutexLocker ml(GetMutex());
+        CTimedLocker<MutexInterface> ml(GetMutex(), m_LockStats, LOCK_FIRMWARE);
         // get firmware version
         char cFirmware[SERIAL_BUFFER_SIZE];
         m_SmartFocusController.getFirmwareVersion(cFirmware, SERIAL_BUFFER_SIZE);
@@ -141,9 +171,12 @@ void X2Focuser::deviceInfoModel(BasicStringInterface& str)
 int	X2Focuser::establishLink(void)
 {
     char szPort[DRIVER_MAX_STRING];
+    char szLog[LOG_BUFFER_SIZE];
     int nErr;
 
-    X2MutexLocker ml(GetMutex());
+    // per session, like the link statistics.
+    m_LockStats.reset();
+    CTimedLocker<MutexInterface> ml(GetMutex(), m_LockStats, LOCK_ESTABLISH_LINK);
     // get serial port device name
     portNameOnToCharPtr(szPort,DRIVER_MAX_STRING);
     nErr = m_SmartFocusController.Connect(szPort);
@@ -152,6 +185,11 @@ int	X2Focuser::establishLink(void)
     else
         m_bLinked = true;
 
+    if(m_bLinked && m_pLogger) {
+        snprintf(szLog, LOG_BUFFER_SIZE, "SmartFocus connected in %.3f s", m_SmartFocusController.getConnectTimeUs() / 1e6);
+        m_pLogger->out(szLog);
+    }
+
     return nErr;
 }
 
@@ -160,10 +198,13 @@ int	X2Focuser::terminateLink(void)
     if(!m_bLinked)
         return SB_OK;
 
-    X2MutexLocker ml(GetMutex());
-    m_SmartFocusController.haltFocuser();
-    m_SmartFocusController.Disconnect();
-    m_bLinked = false;
+    {
+        CTimedLocker<MutexInterface> ml(GetMutex(), m_LockStats, LOCK_TERMINATE_LINK);
+        m_SmartFocusController.haltFocuser();
+        m_SmartFocusController.Disconnect();
+        m_bLinked = false;
+    }
+    logLinkStats();
 
 	return SB_OK;
 }
@@ -199,7 +240,7 @@ int	X2Focuser::execModalSettingsDialog(void)
     if (NULL == (dx = uiutil.X2DX()))
         return ERR_POINTER;
 
-    X2MutexLocker ml(GetMutex());
+    // no I/O in here, the mutex would be held as long as the dialog is open.
 	// set controls values
     dx->setEnabled("posLimit", true);
     if(m_bLinked) {
@@ -240,7 +281,11 @@ void X2Focuser::uiEvent(X2GUIExchangeInterface* uiex, const char* pszEvent)
 
     // new position
     if (!strcmp(pszEvent, "on_pushButton_clicked")) {
-        nErr = m_SmartFocusController.syncMotorPosition(0);
+        // not held across the message box, it stays up until the user closes it.
+        {
+            CTimedLocker<MutexInterface> ml(GetMutex(), m_LockStats, LOCK_SYNC_ZERO);
+            nErr = m_SmartFocusController.syncMotorPosition(0);
+        }
         if(nErr) {
             snprintf(szErrorMessage, LOG_BUFFER_SIZE, "Error setting zero position : Error %d", nErr);
             uiex->messageBox("Set Zero Position", szErrorMessage);
@@ -259,8 +304,13 @@ int	X2Focuser::focPosition(int& nPosition)
     if(!m_bLinked)
         return NOT_CONNECTED;
 
-    X2MutexLocker ml(GetMutex());
+    // moving, or nothing moved since it was read : no round trip, no need to wait for the mutex.
+    if(m_SmartFocusController.getCachedPosition(nPosition)) {
+        m_nPosition = nPosition;
+        return SB_OK;
+    }
 
+    CTimedLocker<MutexInterface> ml(GetMutex(), m_LockStats, LOCK_FOC_POSITION);
     nErr = m_SmartFocusController.getPosition(nPosition);
     m_nPosition = nPosition;
     return nErr;
@@ -275,7 +325,7 @@ int	X2Focuser::focMinimumLimit(int& nMinLimit)
 int	X2Focuser::focMaximumLimit(int& nPosLimit)			
 {
 
-	X2MutexLocker ml(GetMutex());
+    // a setting, not the device's.
     nPosLimit = m_SmartFocusController.getPosLimit();
 
 	return SB_OK;
@@ -287,19 +337,22 @@ int	X2Focuser::focAbort()
     if(!m_bLinked)
         return NOT_CONNECTED;
 
-    X2MutexLocker ml(GetMutex());
+    CTimedLocker<MutexInterface> ml(GetMutex(), m_LockStats, LOCK_FOC_ABORT);
     nErr = m_SmartFocusController.haltFocuser();
     return nErr;
 }
 
 int	X2Focuser::startFocGoto(const int& nRelativeOffset)	
 {
+    int nErr;
+
     if(!m_bLinked)
         return NOT_CONNECTED;
 
-    X2MutexLocker ml(GetMutex());
-    m_SmartFocusController.moveRelativeToPosision(nRelativeOffset);
-    return SB_OK;
+    CTimedLocker<MutexInterface> ml(GetMutex(), m_LockStats, LOCK_START_GOTO);
+    // queued behind a move still running rather than dropped.
+    nErr = m_SmartFocusController.moveRelativeToPosision(nRelativeOffset);
+    return nErr;
 }
 
 int	X2Focuser::isCompleteFocGoto(bool& bComplete) const
@@ -309,8 +362,8 @@ int	X2Focuser::isCompleteFocGoto(bool& bComplete) const
     if(!m_bLinked)
         return NOT_CONNECTED;
 
+    // the move state the I/O thread keeps up to date, no round trip to wait for.
     X2Focuser* pMe = (X2Focuser*)this;
-    X2MutexLocker ml(pMe->GetMutex());
 	nErr = pMe->m_SmartFocusController.isGoToComplete(bComplete);
 
     return nErr;
@@ -322,7 +375,10 @@ int	X2Focuser::endFocGoto(void)
     if(!m_bLinked)
         return NOT_CONNECTED;
 
-    X2MutexLocker ml(GetMutex());
+    if(m_SmartFocusController.getCachedPosition(m_nPosition))
+        return SB_OK;
+
+    CTimedLocker<MutexInterface> ml(GetMutex(), m_LockStats, LOCK_END_GOTO);
     nErr = m_SmartFocusController.getPosition(m_nPosition);
     return nErr;
 }
@@ -381,6 +437,50 @@ void X2Focuser::portNameOnToCharPtr(char* pszPort, const int& nMaxSize) const
     
 }
 
+// link and lock statistics of the session that just ended, to TheSkyX communication log.
+void X2Focuser::logLinkStats()
+{
+    std::string sReport;
+    std::string sLine;
+    size_t nStart;
+    size_t nEnd;
+
+    if(!m_pLogger)
+        return;
+    m_SmartFocusController.getLinkStatsReport(sReport);
+    for(nStart = 0; (nEnd = sReport.find('\n', nStart)) != std::string::npos; nStart = nEnd + 1) {
+        sLine = "SmartFocus " + sReport.substr(nStart, nEnd - nStart);
+        m_pLogger->out(sLine.c_str());
+    }
+    m_LockStats.report(sReport);
+    for(nStart = 0; (nEnd = sReport.find('\n', nStart)) != std::string::npos; nStart = nEnd + 1) {
+        sLine = "SmartFocus lock " + sReport.substr(nStart, nEnd - nStart);
+        m_pLogger->out(sLine.c_str());
+    }
+}
+
+
+
 
+// one per instance, in the home directory like the debug log.
+void X2Focuser::defaultJournalPath(char *pszPath, int nMaxSize)
+{
+#if defined(SB_WIN_BUILD)
+    snprintf(pszPath, nMaxSize, "%s%s\\SmartFocus_%d.journal", getenv("HOMEDRIVE") ? getenv("HOMEDRIVE") : "",
+             getenv("HOMEPATH") ? getenv("HOMEPATH") : ".", m_nPrivateMulitInstanceIndex);
+#else
+    snprintf(pszPath, nMaxSize, "%s/.SmartFocus_%d.journal", getenv("HOME") ? getenv("HOME") : ".", m_nPrivateMulitInstanceIndex);
+#endif
+}
 
+// the environment wins over the ini, "0" turns the native port off for one run.
+bool X2Focuser::useNativeSerial()
+{
+    const char *pszEnv = getenv(NATIVE_SERIAL_ENV);
 
+    if(pszEnv && *pszEnv)
+        return atoi(pszEnv) != 0;
+    if(m_pIniUtil)
+        return m_pIniUtil->readInt(PARENT_KEY, NATIVE_SERIAL, 0) != 0;
+    return false;
+}
@@ -11,6 +11,7 @@
 
 #include "StopWatch.h"
 #include "SmartFocus.h"
+#include "LockStats.h"
 
 // Forward declare the interfaces that this device is dependent upon
 class SerXInterface;
@@ -26,6 +27,12 @@ class TickCountInterface;
 #define PARENT_KEY			"SmartFocus"
 #define CHILD_KEY_PORTNAME	"PortName"
 #define POS_LIMIT           "PosLimit"
+#define DEBUG_LOG           "DebugLog"
+#define TRACE_FILE          "TraceFile"
+#define JOURNAL_FILE        "JournalFile"   // empty turns the journal off, see defaultJournalPath
+#define AUTO_RECONNECT      "AutoReconnect"
+#define NATIVE_SERIAL       "NativeSerial"
+#define NATIVE_SERIAL_ENV   "SMARTFOCUS_NATIVE_SERIAL"  // overrides NativeSerial when set
 
 #if defined(SB_WIN_BUILD)
 #define DEF_PORT_NAME					"COM1"
@@ -35,6 +42,10 @@ class TickCountInterface;
 #define DEF_PORT_NAME					"/dev/ttyUSB0"
 #endif
 
+// entry points that take the host I/O mutex, timed in m_LockStats
+enum X2LockEntry {LOCK_FIRMWARE=0, LOCK_ESTABLISH_LINK, LOCK_TERMINATE_LINK, LOCK_SYNC_ZERO, LOCK_FOC_POSITION, LOCK_FOC_ABORT,
+                  LOCK_START_GOTO, LOCK_END_GOTO, X2_LOCK_ENTRIES};
+
 #define LOG_BUFFER_SIZE 256
 #define TMP_BUF_SIZE    1024
 
@@ -60,6 +71,9 @@ public:
 
 	~X2Focuser();
 
+    // host I/O mutex wait and hold times per entry point, also logged on terminateLink
+    void                                        getLockStatsReport(std::string &sReport) { m_LockStats.report(sReport); };
+
 public:
 
 	/*!\name DriverRootInterface Implementation
@@ -138,6 +152,7 @@ private:
 	LoggerInterface*						m_pLogger;
 	mutable MutexInterface*					m_pIOMutex;
 	TickCountInterface*						m_pTickCount;
+    SerXInterface*                          m_pNativeSerX;  // our own termios port when NativeSerial is set
 
 	SerXInterface 							*GetSerX() {return m_pSerX; }		
 	TheSkyXFacadeForDriversInterface		*GetTheSkyXFacadeForDrivers() {return m_pTheSkyXForMounts;}
@@ -148,11 +163,15 @@ private:
 	TickCountInterface						*GetTickCountInterface() {return m_pTickCount;}
 
     void                                    portNameOnToCharPtr(char* pszPort, const int& nMaxSize) const;
+    void                                    logLinkStats();
+    void                                    defaultJournalPath(char *pszPath, int nMaxSize);
+    bool                                    useNativeSerial();
 
 	bool                                    m_bLinked;
 	int                                     m_nPosition;
     double                                  m_fLastTemp;
     CSmartFocus                             m_SmartFocusController;
+    CLockStats                              m_LockStats;
     bool                                    mUiEnabled;
 };
 